@@ -0,0 +1,650 @@
+/**
+    @file       bench_bg77.cpp
+    @version    0.0.3
+    @brief      Wall time of the quectel bg77 driver's public methods against the emulator
+
+    bench_bg77 [--iterations n] [--latency ms] [--jitter ms] [--seed n] [--only name,name]
+
+    Every benchmark runs its method n times against a fresh emulator and prints min, median,
+    p95 and max wall time, plus bytes in, out and throughput for the ones with a payload.
+    Exits non zero if any call failed, so it doubles as a smoke test.
+ */
+
+
+/** Includes */
+#include "bg77_emulator.h"
+#include "posix_serial.h"
+#include "kvstore_global_api.h"
+#include <quectel_bg77.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+static const char *const APN = "lpwa.vodafone.iot";
+static const char *const URL = "http://api.example.com/v1/assets";
+static const char *const HTTP_HEADER = "POST /v1/assets HTTP/1.1\r\n"
+                                       "Host: api.example.com\r\n"
+                                       "Content-Type: application/json\r\n"
+                                       "Content-Length: ";
+static const char *const BROKER = "mqtt.example.com";
+static const char *const TOPIC = "assets/5f1d0c2ab3e4f50012a6b7c8/state";
+static const char *const HTTP_ANSWER = "{\"info\":[{\"src\":{\"asset_id\":\"5f1d0c2ab3e4f50012a6b7c8\"},\"isSafe\":true}]}";
+
+/** Bytes a run handled, set by the benchmarks that parse, encode or compress a payload: 
+    in is what one run consumed, out what it produced, items how many records that was. 
+    Throughput is in, or out if nothing was consumed, over the median
+ */
+struct payload
+{
+    size_t  in;
+    size_t  out;
+    size_t  items;
+};
+static payload run_payload;
+
+/** One benchmark: setup runs once, untimed, then run is timed every iteration
+ */
+struct benchmark
+{
+    const char  *name;
+    int         max_iterations;     // 0 for no limit, the GNSS session takes a second at least
+    bool        (*setup)(QUECTEL_BG77 &modem, BG77_EMULATOR &emulator);
+    bool        (*run)(QUECTEL_BG77 &modem, BG77_EMULATOR &emulator);
+    bool        at_gnss;            // no GNSS port, positions are polled over AT
+};
+
+/** A telemetry record, encoded as the application would for the JSON and the CBOR path
+ */
+static const int ENCODE_RECORDS = 10000;
+static const float LAT = 52.516300f;
+static const float LON = 13.377700f;
+static const char *const ISO_TIME = "2026-10-16T22:37:40Z";
+
+static size_t encode_json(char *buffer, size_t size, int seq)
+{
+    int len = snprintf(buffer, size, "{\"lat\":%.6f,\"lon\":%.6f,\"t\":\"%s\",\"rsrp\":%d,\"rsrq\":%d,\"sinr\":%d}",
+                       LAT, LON, ISO_TIME, -95 - seq % 8, -9, 130);
+    return (len > 0 && (size_t) len < size) ? len : 0;
+}
+
+static size_t encode_cbor(uint8_t *buffer, size_t size, int seq)
+{
+    QUECTEL_BG77_CBOR cbor(buffer, size);
+    cbor.begin_map();
+    cbor.position(LAT, LON);
+    cbor.timestamp(ISO_TIME);
+    cbor.signal(-95 - seq % 8, -9, 130);
+    cbor.end();
+    return cbor.ok() ? cbor.length() : 0;
+}
+
+/** An answer of a few kB, the fields are in the last element so all of it is scanned
+ */
+static const std::string &large_answer()
+{
+    static std::string answer;
+    if (answer.empty())
+    {
+        answer = "{\"info\":[";
+        for (int i = 0; i < 400; i++)
+        {
+            answer += "{\"meta\":{\"seq\":" + std::to_string(i) + ",\"tags\":[\"a\",\"b\\\"c\",null,-1.5e3],"
+                      "\"note\":\"lorem ipsum dolor sit amet\"},\"src\":{\"zone\":\"north\"}},";
+        }
+        answer += "{\"src\":{\"asset_id\":\"5f1d0c2ab3e4f50012a6b7c8\"},\"isSafe\":true}],\"count\":401}";
+    }
+    return answer;
+}
+
+/** Device log of about 8 kB, the repetitive text the compressed post is meant for
+ */
+static const std::string &log_body()
+{
+    static std::string body;
+    if (body.empty())
+    {
+        for (int i = 0; i < 100; i++)
+        {
+            body += "2026-10-16T22:" + std::to_string(10 + i / 60) + ":" + std::to_string(10 + i % 50)
+                    + "Z INFO sensor temperature=" + std::to_string(20 + i % 7) + ".5 battery=3.61V state=parked\n";
+        }
+    }
+    return body;
+}
+
+static bool attached(QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+{
+    return modem.tcpip_startup(APN) == QUECTEL_BG77::Q_SUCCESS;
+}
+
+static bool http_ready(QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+{
+    emulator.set_http_response(200, HTTP_ANSWER, 150);
+    return attached(modem, emulator) && modem.configure_http_server() == QUECTEL_BG77::Q_SUCCESS
+           && modem.set_http_url(URL) == QUECTEL_BG77::Q_SUCCESS;
+}
+
+/** Connected to a broker that answers as fast as the HTTP server does
+ */
+static bool mqtt_ready(QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+{
+    const QUECTEL_BG77::mqtt_config config = { BROKER, 1883, "bench", nullptr, nullptr, 300, true };
+    emulator.set_broker_delay(150);
+    return attached(modem, emulator) && modem.mqtt_connect(config) == QUECTEL_BG77::Q_SUCCESS;
+}
+
+static const benchmark benchmarks[] =
+{
+    { "at", 0, nullptr,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator) { return modem.at() == QUECTEL_BG77::Q_SUCCESS; } },
+
+    { "tcpip_startup", 0, nullptr,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator) { return attached(modem, emulator); } },
+
+    { "attach", 0, nullptr,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          // Runs on the driver's work thread, done reports the outcome. Static as done may
+          // still come after a run that gave up waiting
+          static std::atomic<int> result;
+          result = 1;
+          if (modem.attach(APN, [](int status) { result = status; }) != QUECTEL_BG77::Q_SUCCESS)
+          {
+              return false;
+          }
+          for (int i = 0; i < 3000 && result == 1; i++)
+          {
+              std::this_thread::sleep_for(std::chrono::milliseconds(10));
+          }
+          return result == QUECTEL_BG77::Q_SUCCESS;
+      } },
+
+    { "resume", 0, attached,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          bool warm = false;
+          return modem.resume(APN, &warm) == QUECTEL_BG77::Q_SUCCESS && warm;
+      } },
+
+    { "get_signal", 0, attached,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          QUECTEL_BG77::signal_metrics metrics;
+          return modem.get_signal(metrics) == QUECTEL_BG77::Q_SUCCESS;
+      } },
+
+    { "activate_pdp", 0, attached,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator) { return modem.activate_pdp() == QUECTEL_BG77::Q_SUCCESS; } },
+
+    // The replies no pattern matches, each used to cost a full parser timeout per pattern tried
+    { "activate_pdp_miss", 0,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          bool ready = attached(modem, emulator);
+          emulator.set_response("AT+COPS?", "+COPS: 0,0,\"EE\",9\nOK");
+          emulator.set_response("AT+QIACT?", "+QIACT: 1,1,2,\"2001:db8::1\"\nOK");
+          return ready;
+      },
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator) { return modem.activate_pdp() == QUECTEL_BG77::Q_FAILURE; } },
+
+    { "csq", 0, attached,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator) { return modem.csq(APN) == QUECTEL_BG77::Q_SUCCESS; } },
+
+    { "csq_miss", 0,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          bool ready = attached(modem, emulator);
+          emulator.set_response("AT+QCSQ", "+QCSQ: \"eMTC\",-72,-95,130,-9\nOK");
+          return ready;
+      },
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator) { return modem.csq(APN) == QUECTEL_BG77::Q_FAILURE; } },
+
+    { "firmware_ver", 0, nullptr,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator) { return modem.firmware_ver() == 1; } },
+
+    { "firmware_ver_miss", 0,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          emulator.set_response("AT+GMR", "BG77LAR02A05\nOK");
+          return true;
+      },
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator) { return modem.firmware_ver() == 0; } },
+
+    { "band_config", 0, nullptr,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator) { return modem.band_config() == QUECTEL_BG77::Q_SUCCESS; } },
+
+    { "get_granted_timers", 0, attached,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          QUECTEL_BG77::granted_timers timers;
+          // The +CEREG format of tcpip_startup() is put back after the query
+          return modem.get_granted_timers(timers) == QUECTEL_BG77::Q_SUCCESS
+                 && emulator.last_command().compare(0, 9, "AT+CEREG=") == 0
+                 && emulator.last_command() != "AT+CEREG=4";
+      } },
+
+    { "send_http_post", 0, http_ready,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          uint8_t body[] = "{\"asset_id\":\"5f1d0c2ab3e4f50012a6b7c8\",\"state\":\"moving\"}";
+          uint32_t posts = emulator.posts();
+          // true means safe, which is also the answer to a failed post: count the posts
+          return modem.send_http_post(HTTP_HEADER, body, sizeof(body) - 1, "moving")
+                 && emulator.posts() == posts + 1;
+      } },
+
+    // out is what went to the server per message, to compare with the MQTT cases
+    { "http_post", 0, http_ready,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          static const uint8_t body[] = "{\"asset_id\":\"5f1d0c2ab3e4f50012a6b7c8\",\"state\":\"parked\"}";
+          QUECTEL_BG77::http_fragment fragment = { body, sizeof(body) - 1 };
+          QUECTEL_BG77::http_response response = { 0, 0, nullptr, 0 };
+          uint64_t uplink = emulator.uplink_bytes();
+          bool ok = modem.http_post(HTTP_HEADER, &fragment, 1, response, nullptr) == QUECTEL_BG77::Q_SUCCESS
+                    && response.http_code == 200;
+          run_payload = { 0, (size_t)(emulator.uplink_bytes() - uplink), 1 };
+          return ok;
+      } },
+
+    // The same message as http_post, as a QoS 1 publish and as a full batch of them
+    { "mqtt_publish", 0,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          // Batches with a message the module cannot take are refused before any AT+QMTPUB
+          const QUECTEL_BG77::mqtt_message invalid[] =
+          {
+              { nullptr, "{}", 2, 1, false },
+              { TOPIC, "{}", 2, 2, false },
+          };
+          bool ready = mqtt_ready(modem, emulator);
+          uint32_t commands = emulator.commands();
+          return ready && modem.mqtt_publish(&invalid[0], 1) == QUECTEL_BG77::Q_FAILURE
+                 && modem.mqtt_publish(&invalid[1], 1) == QUECTEL_BG77::Q_FAILURE && emulator.commands() == commands;
+      },
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          static const char body[] = "{\"asset_id\":\"5f1d0c2ab3e4f50012a6b7c8\",\"state\":\"parked\"}";
+          const QUECTEL_BG77::mqtt_message message = { TOPIC, body, sizeof(body) - 1, 1, false };
+          uint64_t uplink = emulator.uplink_bytes();
+          bool ok = modem.mqtt_publish(&message, 1) == 1;
+          run_payload = { 0, (size_t)(emulator.uplink_bytes() - uplink), 1 };
+          return ok;
+      } },
+
+    { "mqtt_publish_batch", 0, mqtt_ready,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          static const char body[] = "{\"asset_id\":\"5f1d0c2ab3e4f50012a6b7c8\",\"state\":\"parked\"}";
+          QUECTEL_BG77::mqtt_message messages[QUECTEL_BG77::MQTT_BATCH];
+          for (size_t i = 0; i < QUECTEL_BG77::MQTT_BATCH; i++)
+          {
+              messages[i] = { TOPIC, body, sizeof(body) - 1, 1, false };
+          }
+          uint64_t uplink = emulator.uplink_bytes();
+          bool ok = modem.mqtt_publish(messages, QUECTEL_BG77::MQTT_BATCH) == (int) QUECTEL_BG77::MQTT_BATCH;
+          run_payload = { 0, (size_t)(emulator.uplink_bytes() - uplink), QUECTEL_BG77::MQTT_BATCH };
+          return ok;
+      } },
+
+    { "http_post_header", 0,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          return http_ready(modem, emulator) && modem.response_http_header() == QUECTEL_BG77::Q_SUCCESS;
+      },
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          // The response header comes before the body and must not be scanned as part of it
+          static const uint8_t body[] = "{\"asset_id\":\"5f1d0c2ab3e4f50012a6b7c8\",\"state\":\"parked\"}";
+          char asset_id[25] = "";
+          QUECTEL_BG77_JSON::field field = { "info.src.asset_id", QUECTEL_BG77_JSON::JSON_STRING, asset_id,
+                                             sizeof(asset_id), false };
+          QUECTEL_BG77::http_fragment fragment = { body, sizeof(body) - 1 };
+          QUECTEL_BG77::http_response response = { 0, 0, &field, 1 };
+          return modem.http_post(HTTP_HEADER, &fragment, 1, response, nullptr) == QUECTEL_BG77::Q_SUCCESS
+                 && field.found && strcmp(asset_id, "5f1d0c2ab3e4f50012a6b7c8") == 0;
+      } },
+
+    { "lzss_encode", 0, nullptr,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          const std::string &body = log_body();
+          QUECTEL_BG77_LZSS lz;
+          for (char c : body)
+          {
+              if (lz.put((uint8_t) c))
+              {
+                  lz.drain();
+              }
+          }
+          while (lz.finish())
+          {
+              lz.drain();
+          }
+          run_payload = { lz.bytes_in(), lz.bytes_out(), 1 };
+          return lz.bytes_in() == body.size() && lz.bytes_out() > 0;
+      } },
+
+    // From AT+QFOPEN to the response of AT+QHTTPPOSTFILE, out is the staged body
+    { "http_post_compressed", 0, http_ready,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          static size_t offset;
+          offset = 0;
+          QUECTEL_BG77::http_response response = { 0, 0, nullptr, 0 };
+          int status = modem.http_post_compressed(HTTP_HEADER, [](uint8_t *buffer, size_t len) -> ssize_t
+          {
+              const std::string &body = log_body();
+              size_t n = std::min(len, body.size() - offset);
+              memcpy(buffer, body.data() + offset, n);
+              offset += n;
+              return n;
+          }, response);
+
+          // The Content-Length filled in afterwards must match what was staged
+          std::string post = emulator.last_post();
+          size_t end = post.find("\r\n\r\n");
+          size_t length = post.rfind("Content-Length: ", end);
+          if (status != QUECTEL_BG77::Q_SUCCESS || response.http_code != 200 || end == std::string::npos
+              || length == std::string::npos)
+          {
+              return false;
+          }
+          size_t body_len = post.size() - end - 4;
+          run_payload = { log_body().size(), body_len, 1 };
+          return strtoul(post.c_str() + length + 16, nullptr, 10) == body_len;
+      } },
+
+    { "json_parse", 0, nullptr,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          const std::string &answer = large_answer();
+          char asset_id[25] = "";
+          bool is_safe = false;
+          int count = 0;
+          QUECTEL_BG77_JSON::field fields[] =
+          {
+              { "info.src.asset_id", QUECTEL_BG77_JSON::JSON_STRING, asset_id, sizeof(asset_id), false },
+              { "info.isSafe", QUECTEL_BG77_JSON::JSON_BOOL, &is_safe, sizeof(is_safe), false },
+              { "count", QUECTEL_BG77_JSON::JSON_INT, &count, sizeof(count), false },
+          };
+          QUECTEL_BG77_JSON json(fields, 3);
+          int result = QUECTEL_BG77_JSON::JSON_MORE;
+          for (size_t i = 0; i < answer.size() && result == QUECTEL_BG77_JSON::JSON_MORE; i++)
+          {
+              result = json.feed(answer[i]);
+          }
+          run_payload = { answer.size(), 0, 1 };
+          return result == QUECTEL_BG77_JSON::JSON_DONE && fields[0].found && is_safe && count == 401
+                 && strcmp(asset_id, "5f1d0c2ab3e4f50012a6b7c8") == 0;
+      } },
+
+    // The same record on the JSON path and as CBOR, ENCODE_RECORDS of them per run
+    { "encode_json", 0, nullptr,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          char buffer[128];
+          size_t total = 0;
+          for (int i = 0; i < ENCODE_RECORDS; i++)
+          {
+              size_t len = encode_json(buffer, sizeof(buffer), i);
+              if (len == 0)
+              {
+                  return false;
+              }
+              total += len;
+          }
+          run_payload = { 0, total, ENCODE_RECORDS };
+          return true;
+      } },
+
+    { "encode_cbor", 0, nullptr,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          uint8_t buffer[128];
+          size_t total = 0;
+          for (int i = 0; i < ENCODE_RECORDS; i++)
+          {
+              size_t len = encode_cbor(buffer, sizeof(buffer), i);
+              if (len == 0)
+              {
+                  return false;
+              }
+              total += len;
+          }
+          run_payload = { 0, total, ENCODE_RECORDS };
+          return true;
+      } },
+
+    { "flush_queue", 0,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          // A 2xx without a body acknowledges every record
+          bool ready = http_ready(modem, emulator);
+          emulator.set_http_response(204, "", 150);
+          return ready;
+      },
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          static const char record[] = "{\"t\":1700000000,\"v\":21.5}";
+          const QUECTEL_BG77_QUEUE::thresholds flush_at = { 0, 0, 0 };
+          QUECTEL_BG77_QUEUE queue("bench", 16, flush_at);
+          for (int i = 0; i < 8; i++)
+          {
+              queue.push(record, sizeof(record) - 1);
+          }
+          return modem.flush_queue(queue, HTTP_HEADER) == QUECTEL_BG77::Q_SUCCESS && queue.count() == 0;
+      } },
+
+    { "sync_ntp", 0, attached,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator) { return modem.sync_ntp()[0] != '\0'; } },
+
+    // The fix from the NMEA of the GNSS port, and from AT+QGPSLOC for a board without it
+    { "parse_latlon", 3, nullptr,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          float lon = 0, lat = 0;
+          return modem.parse_latlon(lon, lat) == QUECTEL_BG77::Q_SUCCESS && lat > 52.0f && lon > 13.0f;
+      } },
+
+    { "parse_latlon_at", 3, nullptr,
+      [](QUECTEL_BG77 &modem, BG77_EMULATOR &emulator)
+      {
+          float lon = 0, lat = 0;
+          return modem.parse_latlon(lon, lat) == QUECTEL_BG77::Q_SUCCESS && lat > 52.0f && lon > 13.0f;
+      }, true },
+};
+
+struct options
+{
+    int         iterations;
+    uint32_t    latency_ms;
+    uint32_t    jitter_ms;
+    uint32_t    seed;
+    std::string only;
+};
+
+static bool selected(const options &opts, const char *name)
+{
+    if (opts.only.empty())
+    {
+        return true;
+    }
+    std::string list = "," + opts.only + ",";
+    return list.find("," + std::string(name) + ",") != std::string::npos;
+}
+
+static double percentile(std::vector<double> sorted, double p)
+{
+    size_t index = (size_t)(p * (sorted.size() - 1) + 0.5);
+    return sorted[index];
+}
+
+#if QUECTEL_BG77_STATS
+static void print_stats(QUECTEL_BG77 &modem)
+{
+    for (int i = 0; i < modem.command_stats_count(); i++)
+    {
+        QUECTEL_BG77::command_stats stats;
+        const char *command = modem.get_command_stats(i, stats);
+        if (stats.calls > 0)
+        {
+            printf("    %-22s calls %4u ok %4u failed %3u sent %6u received %6u\n", command ? command : "(other)",
+                   (unsigned) stats.calls, (unsigned) stats.ok, (unsigned) stats.failed,
+                   (unsigned) stats.bytes_sent, (unsigned) stats.bytes_received);
+        }
+    }
+}
+#endif
+
+/** Run one benchmark against a fresh emulator and driver
+    @return false if a call failed
+ */
+static bool run(const benchmark &bench, const options &opts)
+{
+    BG77_EMULATOR emulator(opts.seed);
+    emulator.set_latency(opts.latency_ms, opts.jitter_ms);
+    if (emulator.start() != 0)
+    {
+        fprintf(stderr, "%s: no pseudo-terminal\n", bench.name);
+        return false;
+    }
+    POSIX_SERIAL serial(emulator.port());
+    if (!serial.is_open())
+    {
+        fprintf(stderr, "%s: cannot open %s\n", bench.name, emulator.port());
+        return false;
+    }
+    POSIX_SERIAL gnss(emulator.gnss_port());
+    if (!gnss.is_open())
+    {
+        fprintf(stderr, "%s: cannot open %s\n", bench.name, emulator.gnss_port());
+        return false;
+    }
+    // Nothing carries over from the last benchmark, as on a board with a fresh flash
+    kv_reset_all();
+    QUECTEL_BG77 modem(&serial, NC, bench.at_gnss ? nullptr : &gnss);
+
+    if (bench.setup && !bench.setup(modem, emulator))
+    {
+        fprintf(stderr, "%s: setup failed at %s\n", bench.name, emulator.last_command().c_str());
+        return false;
+    }
+#if QUECTEL_BG77_STATS
+    modem.reset_stats();
+#endif
+    int iterations = (bench.max_iterations > 0 && bench.max_iterations < opts.iterations)
+                     ? bench.max_iterations : opts.iterations;
+    std::vector<double> times;
+    uint32_t commands = emulator.commands();
+    bool ok = true;
+    for (int i = 0; i < iterations; i++)
+    {
+        run_payload = { 0, 0, 0 };
+        auto start = std::chrono::steady_clock::now();
+        bool passed = bench.run(modem, emulator);
+        times.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+        if (!passed)
+        {
+            fprintf(stderr, "%s: run %d failed, last command %s\n", bench.name, i, emulator.last_command().c_str());
+            ok = false;
+        }
+    }
+    std::sort(times.begin(), times.end());
+    printf("%-20s %5d %9.1f %9.1f %9.1f %9.1f %9.1f\n", bench.name, iterations, times.front(),
+           percentile(times, 0.5), percentile(times, 0.95), times.back(),
+           (double)(emulator.commands() - commands) / iterations);
+    if (run_payload.in > 0 || run_payload.out > 0)
+    {
+        double median_ms = percentile(times, 0.5);
+        size_t bytes = run_payload.in ? run_payload.in : run_payload.out;
+        printf("    payload");
+        if (run_payload.in > 0)
+        {
+            printf(" in %zu bytes", run_payload.in);
+        }
+        if (run_payload.out > 0)
+        {
+            printf(" out %zu bytes", run_payload.out);
+        }
+        if (run_payload.in > 0 && run_payload.out > 0)
+        {
+            printf(" ratio %.2f", (double) run_payload.out / run_payload.in);
+        }
+        if (run_payload.items > 1)
+        {
+            printf(" per item %.1f bytes %.3f us", (double) bytes / run_payload.items, 
+                   median_ms * 1000.0 / run_payload.items);
+        }
+        // Uploads over the emulated link only get to kB/s
+        double kb_per_s = (median_ms > 0) ? bytes / median_ms : 0.0;
+        if (kb_per_s < 1000.0)
+        {
+            printf(" %.1f kB/s\n", kb_per_s);
+        }
+        else
+        {
+            printf(" %.1f MB/s\n", kb_per_s / 1000.0);
+        }
+    }
+#if QUECTEL_BG77_STATS
+    print_stats(modem);
+#endif
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    options opts = { 20, 10, 5, 1, "" };
+    for (int i = 1; i < argc; i++)
+    {
+        const char *value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+        if (value && strcmp(argv[i], "--iterations") == 0)
+        {
+            opts.iterations = atoi(value);
+        }
+        else if (value && strcmp(argv[i], "--latency") == 0)
+        {
+            opts.latency_ms = strtoul(value, nullptr, 10);
+        }
+        else if (value && strcmp(argv[i], "--jitter") == 0)
+        {
+            opts.jitter_ms = strtoul(value, nullptr, 10);
+        }
+        else if (value && strcmp(argv[i], "--seed") == 0)
+        {
+            opts.seed = strtoul(value, nullptr, 10);
+        }
+        else if (value && strcmp(argv[i], "--only") == 0)
+        {
+            opts.only = value;
+        }
+        else
+        {
+            fprintf(stderr, "usage: %s [--iterations n] [--latency ms] [--jitter ms] [--seed n] [--only a,b]\n", argv[0]);
+            return 2;
+        }
+        i++;
+    }
+    if (opts.iterations < 1)
+    {
+        opts.iterations = 1;
+    }
+
+    printf("latency %u ms, jitter %u ms, seed %u\n", (unsigned) opts.latency_ms, (unsigned) opts.jitter_ms,
+           (unsigned) opts.seed);
+    printf("%-20s %5s %9s %9s %9s %9s %9s\n", "benchmark", "runs", "min ms", "median ms", "p95 ms", "max ms", "commands");
+    int failed = 0;
+    for (const benchmark &bench : benchmarks)
+    {
+        if (selected(opts, bench.name) && !run(bench, opts))
+        {
+            failed++;
+        }
+    }
+    return failed ? 1 : 0;
+}
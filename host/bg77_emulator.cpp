@@ -0,0 +1,1043 @@
+/**
+    @file       bg77_emulator.cpp
+    @version    0.0.3
+    @brief      Scriptable quectel bg77 on a pseudo-terminal, for running the driver on a host
+ */
+
+
+/** Includes */
+#include "bg77_emulator.h"
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+/** Longest a data phase waits for the next byte
+ */
+static const int DATA_TIMEOUT_MS = 10000;
+
+/** How often the idle loop looks for due URCs
+ */
+static const int IDLE_POLL_MS = 20;
+
+/** NMEA epochs: once a second, the first half a second after AT+QGPS=1
+ */
+static const uint64_t NMEA_PERIOD_MS = 1000;
+static const uint64_t NMEA_FIRST_MS = 500;
+
+static bool starts_with(const std::string &s, const char *prefix)
+{
+    return s.compare(0, strlen(prefix), prefix) == 0;
+}
+
+/** Raw pseudo-terminal, the slave kept open so the master never sees it hung up
+    @return master, -1 on failure
+ */
+static int open_terminal(std::string &path, int &slave, int flags)
+{
+    int master = posix_openpt(O_RDWR | O_NOCTTY | flags);
+    if (master < 0 || grantpt(master) != 0 || unlockpt(master) != 0 || ptsname(master) == nullptr)
+    {
+        return -1;
+    }
+    path = ptsname(master);
+    slave = open(path.c_str(), O_RDWR | O_NOCTTY);
+    struct termios tio;
+    if (slave < 0 || tcgetattr(slave, &tio) != 0)
+    {
+        return -1;
+    }
+    cfmakeraw(&tio);
+    tcsetattr(slave, TCSANOW, &tio);
+    return master;
+}
+
+/** NMEA sentence from its body, with the checksum of what is between '$' and '*'
+ */
+static std::string nmea_sentence(const std::string &body)
+{
+    uint8_t sum = 0;
+    for (char c : body)
+    {
+        sum ^= (uint8_t) c;
+    }
+    char tail[8];
+    snprintf(tail, sizeof(tail), "*%02X\r\n", sum);
+    return "$" + body + tail;
+}
+
+/** Degrees to the (d)ddmm.mmmm and hemisphere of NMEA
+ */
+static std::string nmea_coordinate(float degrees, int width, char positive, char negative)
+{
+    float value = fabsf(degrees);
+    int whole = (int) value;
+    char text[24];
+    snprintf(text, sizeof(text), "%0*d%07.4f,%c", width, whole, (value - whole) * 60.0f,
+             degrees < 0 ? negative : positive);
+    return text;
+}
+
+/** Entry of a map keyed by prefix that matches the longest part of command
+ */
+template <typename T>
+static const T *longest_prefix(const std::map<std::string, T> &map, const std::string &command)
+{
+    const T *found = nullptr;
+    size_t found_len = 0;
+    for (const auto &entry : map)
+    {
+        if (entry.first.size() >= found_len && starts_with(command, entry.first.c_str()))
+        {
+            found = &entry.second;
+            found_len = entry.first.size();
+        }
+    }
+    return found;
+}
+
+BG77_EMULATOR::BG77_EMULATOR(uint32_t seed)
+                              : _master(-1), _slave(-1), _gnss_master(-1), _gnss_slave(-1), _random(seed), _timing({ 10, 0 }),
+                                _http_code(200), _http_body("{}"), _http_delay_ms(200),
+                                _fix_delay_ms(0), _latitude(52.5163f), _longitude(13.3777f), _hdop(1.1f),
+                                _ntp_delay_ms(500), _broker_delay_ms(150), _register_delay_ms(0), _response_header(false), _echo(true), _cfun(1), _cfun_at(0),
+                                _cereg_mode(0), _pdp_active(false), _gnss_on(false), _nmea_uart(false), _mqtt_open(false),
+                                _gnss_at(0), _next_handle(1), _commands(0), _posts(0), _uplink_bytes(0)
+{
+    _wake[0] = _wake[1] = -1;
+}
+
+BG77_EMULATOR::~BG77_EMULATOR()
+{
+    stop();
+}
+
+int BG77_EMULATOR::start()
+{
+    // Held open so the master never sees the terminal hung up between two users, and raw
+    // so every byte passes as it is. The GNSS port drops what its reader does not take, as
+    // the module's UART does
+    _master = open_terminal(_port, _slave, 0);
+    _gnss_master = open_terminal(_gnss_port, _gnss_slave, O_NONBLOCK);
+    if (_master < 0 || _gnss_master < 0 || pipe(_wake) != 0)
+    {
+        return -1;
+    }
+    _thread = std::thread(&BG77_EMULATOR::_run, this);
+    _gnss_thread = std::thread(&BG77_EMULATOR::_run_gnss, this);
+    return 0;
+}
+
+void BG77_EMULATOR::stop()
+{
+    if (_thread.joinable())
+    {
+        char stop = 0;
+        (void) !write(_wake[1], &stop, 1);
+        _thread.join();
+        _gnss_thread.join();
+    }
+    for (int *fd : { &_master, &_slave, &_gnss_master, &_gnss_slave, &_wake[0], &_wake[1] })
+    {
+        if (*fd >= 0)
+        {
+            close(*fd);
+            *fd = -1;
+        }
+    }
+}
+
+const char *BG77_EMULATOR::port() const
+{
+    return _port.c_str();
+}
+
+const char *BG77_EMULATOR::gnss_port() const
+{
+    return _gnss_port.c_str();
+}
+
+void BG77_EMULATOR::set_latency(uint32_t latency_ms, uint32_t jitter_ms)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _timing = { latency_ms, jitter_ms };
+}
+
+void BG77_EMULATOR::set_latency(const char *prefix, uint32_t latency_ms, uint32_t jitter_ms)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _timings[prefix] = { latency_ms, jitter_ms };
+}
+
+void BG77_EMULATOR::set_response(const char *prefix, const char *response)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (response == nullptr || *response == '\0')
+    {
+        _responses.erase(prefix);
+    }
+    else
+    {
+        _responses[prefix] = response;
+    }
+}
+
+void BG77_EMULATOR::inject_urc(const char *urc, uint32_t delay_ms)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _schedule(urc, delay_ms);
+}
+
+void BG77_EMULATOR::urc_after(const char *prefix, const char *urc, uint32_t delay_ms)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _triggers.push_back({ prefix, urc, delay_ms });
+}
+
+void BG77_EMULATOR::set_http_response(int code, const char *body, uint32_t delay_ms)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _http_code = code;
+    _http_body = body;
+    _http_delay_ms = delay_ms;
+}
+
+void BG77_EMULATOR::set_fix(uint32_t delay_ms, float latitude, float longitude, float hdop)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _fix_delay_ms = delay_ms;
+    _latitude = latitude;
+    _longitude = longitude;
+    _hdop = hdop;
+}
+
+void BG77_EMULATOR::set_broker_delay(uint32_t delay_ms)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _broker_delay_ms = delay_ms;
+}
+
+void BG77_EMULATOR::set_ntp_delay(uint32_t delay_ms)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _ntp_delay_ms = delay_ms;
+}
+
+void BG77_EMULATOR::set_register_delay(uint32_t delay_ms)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _register_delay_ms = delay_ms;
+}
+
+uint32_t BG77_EMULATOR::commands() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _commands;
+}
+
+uint32_t BG77_EMULATOR::posts() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _posts;
+}
+
+std::string BG77_EMULATOR::last_command() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _last_command;
+}
+
+uint64_t BG77_EMULATOR::uplink_bytes() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _uplink_bytes;
+}
+
+std::string BG77_EMULATOR::last_post() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _last_post;
+}
+
+uint64_t BG77_EMULATOR::_now_ms() const
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void BG77_EMULATOR::_schedule(const std::string &text, uint32_t delay_ms)
+{
+    _urcs.push_back({ _now_ms() + delay_ms, text });
+}
+
+void BG77_EMULATOR::_send_due_urcs()
+{
+    std::vector<std::string> due;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        uint64_t now = _now_ms();
+        for (auto it = _urcs.begin(); it != _urcs.end();)
+        {
+            if (it->due_ms <= now)
+            {
+                due.push_back(it->text);
+                it = _urcs.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+    for (const std::string &text : due)
+    {
+        // The time is read when it is sent, as the module does
+        if (text == "+QNTP")
+        {
+            _line("+QNTP: 0,\"" + _clock(true) + "\"");
+        }
+        else
+        {
+            _line(text);
+        }
+    }
+}
+
+int BG77_EMULATOR::_read_byte(int timeout_ms)
+{
+    if (!_pending.empty())
+    {
+        int c = (uint8_t) _pending[0];
+        _pending.erase(0, 1);
+        return c;
+    }
+    struct pollfd fds[2] = { { _master, POLLIN, 0 }, { _wake[0], POLLIN, 0 } };
+    int ready = poll(fds, 2, timeout_ms);
+    if (ready < 0 && errno != EINTR)
+    {
+        return -2;
+    }
+    if (fds[1].revents)
+    {
+        return -2;
+    }
+    if (ready <= 0 || !(fds[0].revents & POLLIN))
+    {
+        return -1;
+    }
+    char buffer[256];
+    ssize_t got = read(_master, buffer, sizeof(buffer));
+    if (got <= 0)
+    {
+        return -1;
+    }
+    _pending.assign(buffer + 1, got - 1);
+    return (uint8_t) buffer[0];
+}
+
+bool BG77_EMULATOR::_read_data(std::string &data, size_t len, int timeout_ms)
+{
+    data.clear();
+    while (data.size() < len)
+    {
+        int c = _read_byte(timeout_ms);
+        if (c < 0)
+        {
+            return false;
+        }
+        data += (char) c;
+    }
+    return true;
+}
+
+void BG77_EMULATOR::_write(const std::string &text)
+{
+    const char *p = text.data();
+    size_t left = text.size();
+    while (left > 0)
+    {
+        ssize_t put = write(_master, p, left);
+        if (put < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+            {
+                continue;
+            }
+            return;
+        }
+        p += put;
+        left -= put;
+    }
+}
+
+void BG77_EMULATOR::_line(const std::string &text)
+{
+    _write("\r\n" + text + "\r\n");
+}
+
+void BG77_EMULATOR::_run()
+{
+    std::string line;
+    while (true)
+    {
+        int c = _read_byte(IDLE_POLL_MS);
+        if (c == -2)
+        {
+            return;
+        }
+        _send_due_urcs();
+        if (c < 0)
+        {
+            continue;
+        }
+        if (c == '\r')
+        {
+            if (!line.empty())
+            {
+                _respond(line);
+            }
+            line.clear();
+        }
+        else if (c != '\n')
+        {
+            line += (char) c;
+        }
+    }
+}
+
+void BG77_EMULATOR::_run_gnss()
+{
+    uint64_t next = 0;
+    // The wake pipe stays readable once stop() wrote to it
+    struct pollfd wake = { _wake[0], POLLIN, 0 };
+    while (poll(&wake, 1, IDLE_POLL_MS) == 0)
+    {
+        std::string epoch;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            uint64_t now = _now_ms();
+            if (!_gnss_on || !_nmea_uart)
+            {
+                next = 0;
+                continue;
+            }
+            if (next == 0)
+            {
+                next = _gnss_at + NMEA_FIRST_MS;
+            }
+            if (now < next)
+            {
+                continue;
+            }
+            next += NMEA_PERIOD_MS;
+            epoch = _nmea_epoch(now - _gnss_at >= _fix_delay_ms);
+        }
+        (void) !write(_gnss_master, epoch.data(), epoch.size());
+    }
+}
+
+std::string BG77_EMULATOR::_nmea_epoch(bool fixed) const
+{
+    time_t now = time(nullptr);
+    struct tm t;
+    gmtime_r(&now, &t);
+    char utc[16];
+    char date[8];
+    char hdop[8];
+    strftime(utc, sizeof(utc), "%H%M%S.00", &t);
+    strftime(date, sizeof(date), "%d%m%y", &t);
+    snprintf(hdop, sizeof(hdop), "%.1f", _hdop);
+    if (!fixed)
+    {
+        return nmea_sentence(std::string("GPGGA,") + utc + ",,,,,0,00,99.9,,M,,M,,")
+               + nmea_sentence(std::string("GPRMC,") + utc + ",V,,,,,,," + date + ",,,N");
+    }
+    std::string position = nmea_coordinate(_latitude, 2, 'N', 'S') + "," + nmea_coordinate(_longitude, 3, 'E', 'W');
+    return nmea_sentence(std::string("GPGGA,") + utc + "," + position + ",1,08," + hdop + ",34.5,M,47.0,M,,")
+           + nmea_sentence(std::string("GPRMC,") + utc + ",A," + position + ",0.0,0.0," + date + ",,,A");
+}
+
+void BG77_EMULATOR::_answer_delay(const std::string &command)
+{
+    uint32_t delay_ms;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        const timing *t = longest_prefix(_timings, command);
+        if (t == nullptr)
+        {
+            t = &_timing;
+        }
+        delay_ms = t->latency_ms;
+        if (t->jitter_ms > 0)
+        {
+            delay_ms += std::uniform_int_distribution<uint32_t>(0, t->jitter_ms)(_random);
+        }
+    }
+    // URCs that fall due meanwhile come before the answer, as they would from the module
+    uint64_t end = _now_ms() + delay_ms;
+    for (uint64_t now = _now_ms(); now < end; now = _now_ms())
+    {
+        uint64_t step = (end - now < (uint64_t) IDLE_POLL_MS) ? end - now : IDLE_POLL_MS;
+        std::this_thread::sleep_for(std::chrono::milliseconds(step));
+        _send_due_urcs();
+    }
+}
+
+void BG77_EMULATOR::_respond(const std::string &command)
+{
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _commands++;
+        _last_command = command;
+    }
+    if (_echo)
+    {
+        _write(command + "\r");
+    }
+    _answer_delay(command);
+    if (_data_command(command))
+    {
+        _after(command);
+        return;
+    }
+    reply r = _execute(command);
+    for (const std::string &line : r.lines)
+    {
+        _line(line);
+    }
+    _line(r.result);
+    _after(command);
+}
+
+void BG77_EMULATOR::_after(const std::string &command)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (const trigger &t : _triggers)
+    {
+        if (starts_with(command, t.prefix.c_str()))
+        {
+            _schedule(t.urc, t.delay_ms);
+        }
+    }
+}
+
+bool BG77_EMULATOR::_data_command(const std::string &command)
+{
+    unsigned len = 0;
+    unsigned input_s = 0;
+    char name[64];
+    std::string data;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (longest_prefix(_responses, command))
+        {
+            return false;
+        }
+    }
+
+    if (sscanf(command.c_str(), "AT+QHTTPURL=%u", &len) == 1)
+    {
+        _line("CONNECT");
+        if (!_read_data(data, len, DATA_TIMEOUT_MS))
+        {
+            _line("+CME ERROR: 702");
+            return true;
+        }
+        std::lock_guard<std::mutex> lock(_mutex);
+        _http_url = data;
+        _line("OK");
+        return true;
+    }
+    if (sscanf(command.c_str(), "AT+QHTTPPOST=%u,%u", &len, &input_s) >= 1)
+    {
+        if (!_pdp_active)
+        {
+            _line("+CME ERROR: 703");
+            return true;
+        }
+        _line("CONNECT");
+        if (!_read_data(data, len, (input_s ? input_s : 60) * 1000))
+        {
+            // The module gives up on the input and reports it
+            _line("+CME ERROR: 704");
+            return true;
+        }
+        _line("OK");
+        std::lock_guard<std::mutex> lock(_mutex);
+        _posts++;
+        _last_post = data;
+        _uplink_bytes += data.size();
+        _schedule("+QHTTPPOST: 0," + std::to_string(_http_code) + "," + std::to_string(_http_body.size()),
+                  _http_delay_ms);
+        return true;
+    }
+    if (starts_with(command, "AT+QHTTPREAD"))
+    {
+        std::string body;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            body = _http_body;
+            if (_response_header)
+            {
+                body = "HTTP/1.1 " + std::to_string(_http_code) + " OK\r\nContent-Type: application/json\r\n"
+                       "Content-Length: " + std::to_string(_http_body.size()) + "\r\n\r\n" + body;
+            }
+        }
+        _line("CONNECT");
+        _write(body);
+        _line("OK");
+        _line("+QHTTPREAD: 0");
+        return true;
+    }
+    if (sscanf(command.c_str(), "AT+QFUPL=\"UFS:%63[^\"]\",%u", name, &len) == 2)
+    {
+        _line("CONNECT");
+        if (!_read_data(data, len, DATA_TIMEOUT_MS))
+        {
+            _line("+CME ERROR: 409");
+            return true;
+        }
+        unsigned sum = 0;
+        for (size_t i = 0; i < data.size(); i += 2)
+        {
+            sum ^= ((uint8_t) data[i] << 8) | ((i + 1 < data.size()) ? (uint8_t) data[i + 1] : 0);
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _files[name] = data;
+        }
+        char qfupl[40];
+        snprintf(qfupl, sizeof(qfupl), "+QFUPL: %u,%x", len, sum);
+        _line(qfupl);
+        _line("OK");
+        return true;
+    }
+    unsigned msgid = 0;
+    unsigned qos = 0;
+    char topic[80];
+    if (sscanf(command.c_str(), "AT+QMTPUB=0,%u,%u,%*u,\"%79[^\"]\",%u", &msgid, &qos, topic, &len) == 4)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_mqtt_open)
+            {
+                _line("ERROR");
+                return true;
+            }
+        }
+        _write("\r\n> ");
+        if (!_read_data(data, len, DATA_TIMEOUT_MS))
+        {
+            _line("ERROR");
+            return true;
+        }
+        _line("OK");
+        // PUBLISH: fixed header, remaining length, topic, packet ID for QoS 1, payload
+        size_t remaining = 2 + strlen(topic) + (qos ? 2 : 0) + len;
+        size_t length_bytes = (remaining < 128) ? 1 : (remaining < 16384) ? 2 : 3;
+        std::lock_guard<std::mutex> lock(_mutex);
+        _uplink_bytes += 1 + length_bytes + remaining;
+        // QoS 0 is reported once the module sent it, QoS 1 once PUBACK came
+        _schedule("+QMTPUB: 0," + std::to_string(msgid) + ",0", qos ? _broker_delay_ms : 0);
+        return true;
+    }
+    int handle = 0;
+    if (sscanf(command.c_str(), "AT+QFWRITE=%d,%u", &handle, &len) == 2)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_open_files.find(handle) == _open_files.end())
+            {
+                _line("+CME ERROR: 426");
+                return true;
+            }
+        }
+        _line("CONNECT");
+        if (!_read_data(data, len, DATA_TIMEOUT_MS))
+        {
+            _line("+CME ERROR: 409");
+            return true;
+        }
+        size_t total = 0;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            open_file &f = _open_files[handle];
+            std::string &content = _files[f.name];
+            if (content.size() < f.offset + len)
+            {
+                content.resize(f.offset + len);
+            }
+            content.replace(f.offset, len, data);
+            f.offset += len;
+            total = content.size();
+        }
+        _line("+QFWRITE: " + std::to_string(len) + "," + std::to_string(total));
+        _line("OK");
+        return true;
+    }
+    return false;
+}
+
+BG77_EMULATOR::reply BG77_EMULATOR::_execute(const std::string &command)
+{
+    // Commands on one line are separated by ';' outside quotes, all but the first lose "AT"
+    std::vector<std::string> parts;
+    std::string part;
+    bool quoted = false;
+    for (char c : command)
+    {
+        if (c == '"')
+        {
+            quoted = !quoted;
+        }
+        if (c == ';' && !quoted)
+        {
+            parts.push_back(part);
+            part = "AT";
+            continue;
+        }
+        part += c;
+    }
+    parts.push_back(part);
+
+    reply all;
+    all.result = "OK";
+    for (const std::string &p : parts)
+    {
+        reply r;
+        const std::string *scripted;
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            scripted = longest_prefix(_responses, p);
+            if (scripted)
+            {
+                std::string text = *scripted;
+                size_t start = 0;
+                size_t end;
+                while ((end = text.find('\n', start)) != std::string::npos)
+                {
+                    r.lines.push_back(text.substr(start, end - start));
+                    start = end + 1;
+                }
+                r.result = text.substr(start);
+            }
+        }
+        if (!scripted)
+        {
+            r = _model(p);
+        }
+        all.lines.insert(all.lines.end(), r.lines.begin(), r.lines.end());
+        // The module stops at the first command that fails
+        if (r.result != "OK")
+        {
+            all.result = r.result;
+            break;
+        }
+    }
+    return all;
+}
+
+bool BG77_EMULATOR::_registered()
+{
+    return _cfun == 1 && _now_ms() - _cfun_at >= _register_delay_ms;
+}
+
+std::string BG77_EMULATOR::_clock(bool four_digit_year) const
+{
+    time_t now = time(nullptr);
+    struct tm t;
+    gmtime_r(&now, &t);
+    char text[32];
+    strftime(text, sizeof(text), four_digit_year ? "%Y/%m/%d,%H:%M:%S+00" : "%y/%m/%d,%H:%M:%S+00", &t);
+    return text;
+}
+
+BG77_EMULATOR::reply BG77_EMULATOR::_model(const std::string &command)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    reply r;
+    r.result = "OK";
+    const char *c = command.c_str();
+    int n = 0;
+    int value = 0;
+    char name[64];
+
+    if (command == "ATE0" || command == "ATE1")
+    {
+        _echo = (command == "ATE1");
+    }
+    else if (sscanf(c, "AT+CFUN=%d", &n) == 1)
+    {
+        if (_cfun != 1 && n == 1)
+        {
+            _cfun_at = _now_ms();
+            if (_cereg_mode > 0)
+            {
+                _schedule("+CEREG: 1", _register_delay_ms);
+            }
+        }
+        _cfun = n;
+        if (n != 1)
+        {
+            _pdp_active = false;
+        }
+    }
+    else if (command == "AT+CFUN?")
+    {
+        r.lines.push_back("+CFUN: " + std::to_string(_cfun));
+    }
+    else if (command == "AT+CPIN?")
+    {
+        r.lines.push_back("+CPIN: READY");
+    }
+    else if (command == "AT+COPS?")
+    {
+        r.lines.push_back(_registered() ? "+COPS: 0,0,\"Vodafone\",9" : "+COPS: 0");
+    }
+    else if (sscanf(c, "AT+CEREG=%d", &n) == 1)
+    {
+        _cereg_mode = n;
+    }
+    else if (command == "AT+CEREG?")
+    {
+        std::string cereg = "+CEREG: " + std::to_string(_cereg_mode) + "," + (_registered() ? "1" : "2");
+        if (_cereg_mode >= 2 && _registered())
+        {
+            cereg += ",\"1A2B\",\"01A2D001\",9";
+        }
+        if (_cereg_mode >= 4 && _registered())
+        {
+            // Active-Time 1 minute, Periodic-TAU 1 hour
+            cereg += ",,,\"00100001\",\"00100001\"";
+        }
+        r.lines.push_back(cereg);
+    }
+    else if (command == "AT+QCSQ")
+    {
+        r.lines.push_back(_registered() ? "+QCSQ: \"NBIoT\",-72,-95,130,-9" : "+QCSQ: \"NOSERVICE\"");
+    }
+    else if (command == "AT+QNWINFO")
+    {
+        r.lines.push_back(_registered() ? "+QNWINFO: \"NBIoT\",\"23415\",\"LTE BAND 20\",6300" : "+QNWINFO: No Service");
+    }
+    else if (command == "AT+CSQ")
+    {
+        r.lines.push_back(_registered() ? "+CSQ: 20,99" : "+CSQ: 99,99");
+    }
+    else if (command == "AT+QIACT?")
+    {
+        if (_pdp_active)
+        {
+            r.lines.push_back("+QIACT: 1,1,1,\"10.64.1.2\"");
+        }
+    }
+    else if (command == "AT+QIACT=1")
+    {
+        if (_registered())
+        {
+            _pdp_active = true;
+        }
+        else
+        {
+            r.result = "ERROR";
+        }
+    }
+    else if (command == "AT+QIDEACT=1")
+    {
+        _pdp_active = false;
+    }
+    else if (command == "AT+CGDCONT?")
+    {
+        r.lines.push_back("+CGDCONT: 1,\"IP\",\"lpwa.vodafone.iot\",\"0.0.0.0\",0,0,0");
+    }
+    else if (command == "AT+CGPADDR=1")
+    {
+        r.lines.push_back(_pdp_active ? "+CGPADDR: 1,10.64.1.2" : "+CGPADDR: 1");
+    }
+    else if (command == "AT+CGSN")
+    {
+        r.lines.push_back("866425030012345");
+    }
+    else if (command == "AT+CIMI")
+    {
+        r.lines.push_back("234150000012345");
+    }
+    else if (command == "AT+GMI")
+    {
+        r.lines.push_back("Quectel");
+    }
+    else if (command == "AT+GMR" || command == "AT+QGMR")
+    {
+        r.lines.push_back("BG77LAR02A04");
+    }
+    else if (command == "AT+CCLK?")
+    {
+        r.lines.push_back("+CCLK: \"" + _clock(false) + "\"");
+    }
+    else if (starts_with(command, "AT+QNTP="))
+    {
+        if (_pdp_active)
+        {
+            _schedule("+QNTP", _ntp_delay_ms);
+        }
+        else
+        {
+            r.result = "+CME ERROR: 561";
+        }
+    }
+    else if (command == "AT+QGPS=1")
+    {
+        if (_gnss_on)
+        {
+            r.result = "+CME ERROR: 504";
+        }
+        _gnss_on = true;
+        _gnss_at = _now_ms();
+    }
+    else if (starts_with(command, "AT+QGPSCFG=\"outport\","))
+    {
+        _nmea_uart = (command == "AT+QGPSCFG=\"outport\",\"uartnmea\"");
+    }
+    else if (command == "AT+QGPSEND")
+    {
+        if (!_gnss_on)
+        {
+            r.result = "+CME ERROR: 505";
+        }
+        _gnss_on = false;
+    }
+    else if (starts_with(command, "AT+QGPSLOC"))
+    {
+        if (!_gnss_on)
+        {
+            r.result = "+CME ERROR: 505";
+        }
+        else if (_now_ms() - _gnss_at < _fix_delay_ms)
+        {
+            r.result = "+CME ERROR: 516";
+        }
+        else
+        {
+            time_t now = time(nullptr);
+            struct tm t;
+            gmtime_r(&now, &t);
+            char loc[128];
+            snprintf(loc, sizeof(loc), "+QGPSLOC: %02d%02d%02d.0,%.5f,%.5f,%.1f,34.5,3,0.00,0.0,0.0,%02d%02d%02d,08",
+                     t.tm_hour, t.tm_min, t.tm_sec, _latitude, _longitude, _hdop,
+                     t.tm_mday, t.tm_mon + 1, t.tm_year % 100);
+            r.lines.push_back(loc);
+        }
+    }
+    else if (sscanf(c, "AT+QFLST=\"UFS:%63[^\"]\"", name) == 1)
+    {
+        auto it = _files.find(name);
+        if (it == _files.end())
+        {
+            r.result = "+CME ERROR: 405";
+        }
+        else
+        {
+            r.lines.push_back("+QFLST: \"UFS:" + it->first + "\"," + std::to_string(it->second.size()));
+        }
+    }
+    else if (sscanf(c, "AT+QFDEL=\"UFS:%63[^\"]\"", name) == 1)
+    {
+        if (_files.erase(name) == 0)
+        {
+            r.result = "+CME ERROR: 405";
+        }
+    }
+    else if (sscanf(c, "AT+QFOPEN=\"UFS:%63[^\"]\",%d", name, &n) >= 1)
+    {
+        // Mode 0 creates or opens, 1 creates or truncates, 2 opens read only
+        if (n == 2 && _files.find(name) == _files.end())
+        {
+            r.result = "+CME ERROR: 405";
+        }
+        else
+        {
+            if (n == 1)
+            {
+                _files[name].clear();
+            }
+            else
+            {
+                _files[name];
+            }
+            int handle = _next_handle++;
+            _open_files[handle] = { name, 0 };
+            r.lines.push_back("+QFOPEN: " + std::to_string(handle));
+        }
+    }
+    else if (sscanf(c, "AT+QFSEEK=%d,%d", &n, &value) == 2)
+    {
+        auto it = _open_files.find(n);
+        if (it == _open_files.end())
+        {
+            r.result = "+CME ERROR: 426";
+        }
+        else
+        {
+            it->second.offset = value;
+        }
+    }
+    else if (sscanf(c, "AT+QFCLOSE=%d", &n) == 1)
+    {
+        if (_open_files.erase(n) == 0)
+        {
+            r.result = "+CME ERROR: 426";
+        }
+    }
+    else if (starts_with(command, "AT+QMTOPEN=0,"))
+    {
+        if (!_pdp_active)
+        {
+            r.result = "ERROR";
+        }
+        else
+        {
+            _schedule(_mqtt_open ? "+QMTOPEN: 0,2" : "+QMTOPEN: 0,0", _broker_delay_ms);
+            _mqtt_open = true;
+        }
+    }
+    else if (starts_with(command, "AT+QMTCONN=0,"))
+    {
+        // CONNACK accepted
+        _schedule("+QMTCONN: 0,0,0", _broker_delay_ms);
+    }
+    else if (command == "AT+QMTDISC=0")
+    {
+        _mqtt_open = false;
+        _schedule("+QMTDISC: 0,0", 0);
+    }
+    else if (starts_with(command, "AT+QHTTPGET"))
+    {
+        _schedule("+QHTTPGET: 0," + std::to_string(_http_code) + "," + std::to_string(_http_body.size()),
+                  _http_delay_ms);
+    }
+    else if (sscanf(c, "AT+QHTTPPOSTFILE=\"UFS:%63[^\"]\"", name) == 1)
+    {
+        _posts++;
+        _last_post = _files[name];
+        _uplink_bytes += _last_post.size();
+        _schedule("+QHTTPPOSTFILE: 0," + std::to_string(_http_code) + "," + std::to_string(_http_body.size()),
+                  _http_delay_ms);
+    }
+    else if (sscanf(c, "AT+QHTTPCFG=\"responseheader\",%d", &n) == 1)
+    {
+        _response_header = (n == 1);
+    }
+    else if (command == "AT+QPOWD")
+    {
+        _schedule("POWERED DOWN", 0);
+    }
+    // Everything else the module takes without comment
+    return r;
+}
@@ -0,0 +1,235 @@
+/**
+    @file    bg77_emulator.h
+    @version 0.0.3
+    @brief   Scriptable quectel bg77 on a pseudo-terminal, for running the driver on a host
+ */
+
+#ifndef BG77_EMULATOR_H
+#define BG77_EMULATOR_H
+
+/** Define to prevent recursive inclusion
+ */
+#pragma once
+
+/** Includes
+ */
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+/** Answers the AT commands the driver uses the way the module does, with a configurable
+    response time. Commands it has no model for are answered OK. State the driver depends
+    on is kept: functionality, registration, context 1, the GNSS session, HTTP URL, files
+    on UFS with their open handles, the MQTT
+    connection and the echo. Replies and URCs can be scripted per command prefix. A second
+    pseudo-terminal is the GNSS port, streaming NMEA while GNSS is on.
+
+    Example code
+    BG77_EMULATOR emulator;
+    emulator.set_latency(20, 5);
+    emulator.start();
+    POSIX_SERIAL serial(emulator.port());
+    POSIX_SERIAL gnss(emulator.gnss_port());
+    QUECTEL_BG77 modem(&serial, NC, &gnss);
+    modem.tcpip_startup("lpwa.vodafone.iot");
+ */
+class BG77_EMULATOR
+{
+    public:
+        BG77_EMULATOR(uint32_t seed = 1);
+        ~BG77_EMULATOR();
+
+        /** Open the pseudo-terminals and start answering
+            @return 0 on success, -1 if no pseudo-terminal could be opened
+         */
+        int start();
+
+        /** Stop answering and close the pseudo-terminals
+         */
+        void stop();
+
+        /** @return path of the terminal the driver opens, e.g. /dev/pts/3
+         */
+        const char *port() const;
+
+        /** @return path of the GNSS port. Once a second while GNSS is on and AT+QGPSCFG 
+                    "outport" is "uartnmea" it sends the GGA and RMC of an epoch, without a
+                    position until the fix delay is over. Bytes nobody reads are dropped
+         */
+        const char *gnss_port() const;
+
+        /** Time from a command to its final result code: latency plus up to jitter
+            @param latency_ms. Fixed part
+            @param jitter_ms. Uniform random part, repeatable for a seed
+         */
+        void set_latency(uint32_t latency_ms, uint32_t jitter_ms);
+
+        /** Response time of the commands starting with a prefix, e.g. "AT+COPS"
+         */
+        void set_latency(const char *prefix, uint32_t latency_ms, uint32_t jitter_ms);
+
+        /** Replace the answer to the commands starting with a prefix. Lines are separated by
+            '\n' and the last one is the result code, e.g. "+CME ERROR: 516" or
+            "+QCSQ: \"NBIoT\",-70,-95,130,-9\nOK". An empty answer restores the model
+         */
+        void set_response(const char *prefix, const char *response);
+
+        /** Send an unsolicited result code, e.g. "+CEREG: 5"
+            @param delay_ms. From now
+         */
+        void inject_urc(const char *urc, uint32_t delay_ms = 0);
+
+        /** Send an URC every time a command starting with prefix was answered
+         */
+        void urc_after(const char *prefix, const char *urc, uint32_t delay_ms);
+
+        /** Answer of the HTTP server to posts and gets
+            @param code. HTTP status
+            @param body. Response body
+            @param delay_ms. From the end of the request to +QHTTPPOST / +QHTTPGET
+         */
+        void set_http_response(int code, const char *body, uint32_t delay_ms = 200);
+
+        /** Time from AT+QGPS=1 until AT+QGPSLOC and the NMEA have a fix, and the fix
+         */
+        void set_fix(uint32_t delay_ms, float latitude, float longitude, float hdop);
+
+        /** Time from a packet to the MQTT broker to its answer, +QMTCONN, +QMTPUB, ...
+         */
+        void set_broker_delay(uint32_t delay_ms);
+
+        /** Time from AT+QNTP to +QNTP
+         */
+        void set_ntp_delay(uint32_t delay_ms);
+
+        /** Time from AT+CFUN=1 until the module is registered
+         */
+        void set_register_delay(uint32_t delay_ms);
+
+        /** Counters
+         */
+        uint32_t commands() const;
+        uint32_t posts() const;
+
+        /** Bytes the module sent to servers for the messages: HTTP requests and MQTT 
+            PUBLISH packets, without TCP/IP headers
+         */
+        uint64_t uplink_bytes() const;
+
+        /** Body of the last HTTP post, the data of AT+QHTTPPOST or the file of
+            AT+QHTTPPOSTFILE
+         */
+        std::string last_post() const;
+
+        /** Last command line received, without the "\r"
+         */
+        std::string last_command() const;
+
+    private:
+        struct reply
+        {
+            std::vector<std::string>    lines;
+            std::string                 result;
+        };
+
+        struct urc
+        {
+            uint64_t        due_ms;
+            std::string     text;
+        };
+
+        struct trigger
+        {
+            std::string     prefix;
+            std::string     urc;
+            uint32_t        delay_ms;
+        };
+
+        struct open_file
+        {
+            std::string     name;
+            size_t          offset;
+        };
+
+        struct timing
+        {
+            uint32_t    latency_ms;
+            uint32_t    jitter_ms;
+        };
+
+        void _run();
+        void _run_gnss();
+        std::string _nmea_epoch(bool fixed) const;
+        int _read_byte(int timeout_ms);
+        bool _read_data(std::string &data, size_t len, int timeout_ms);
+        void _write(const std::string &text);
+        void _line(const std::string &text);
+        void _respond(const std::string &command);
+        void _answer_delay(const std::string &command);
+        bool _data_command(const std::string &command);
+        reply _execute(const std::string &command);
+        reply _model(const std::string &command);
+        void _after(const std::string &command);
+        void _schedule(const std::string &text, uint32_t delay_ms);
+        void _send_due_urcs();
+        bool _registered();
+        uint64_t _now_ms() const;
+        std::string _clock(bool four_digit_year) const;
+
+        int                             _master;
+        int                             _slave;
+        int                             _wake[2];
+        std::string                     _port;
+        std::thread                     _thread;
+        int                             _gnss_master;
+        int                             _gnss_slave;
+        std::string                     _gnss_port;
+        std::thread                     _gnss_thread;
+        mutable std::mutex              _mutex;
+        std::mt19937                    _random;
+
+        timing                          _timing;
+        std::map<std::string, timing>   _timings;
+        std::map<std::string, std::string> _responses;
+        std::vector<urc>                _urcs;
+        std::vector<trigger>            _triggers;
+
+        int                             _http_code;
+        std::string                     _http_body;
+        uint32_t                        _http_delay_ms;
+        std::string                     _http_url;
+        uint32_t                        _fix_delay_ms;
+        float                           _latitude;
+        float                           _longitude;
+        float                           _hdop;
+        uint32_t                        _ntp_delay_ms;
+        uint32_t                        _broker_delay_ms;
+        uint32_t                        _register_delay_ms;
+        bool                            _response_header;
+
+        bool                            _echo;
+        int                             _cfun;
+        uint64_t                        _cfun_at;
+        int                             _cereg_mode;
+        bool                            _pdp_active;
+        bool                            _gnss_on;
+        bool                            _nmea_uart;
+        bool                            _mqtt_open;
+        uint64_t                        _gnss_at;
+        std::map<std::string, std::string> _files;
+        std::map<int, open_file>        _open_files;
+        int                             _next_handle;
+
+        uint32_t                        _commands;
+        uint32_t                        _posts;
+        uint64_t                        _uplink_bytes;
+        std::string                     _last_command;
+        std::string                     _last_post;
+        std::string                     _pending;
+};
+
+#endif
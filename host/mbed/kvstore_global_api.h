@@ -0,0 +1,37 @@
+/**
+    @file    kvstore_global_api.h
+    @version 0.0.3
+    @brief   Linux stand-in for the mbed KVStore global API, kept in memory
+ */
+
+#ifndef HOST_KVSTORE_GLOBAL_API_H
+#define HOST_KVSTORE_GLOBAL_API_H
+
+/** Define to prevent recursive inclusion
+ */
+#pragma once
+
+/** Includes
+ */
+#include <cstddef>
+#include <cstdint>
+
+#define MBED_SUCCESS 0
+#define MBED_ERROR_ITEM_NOT_FOUND (-1)
+
+typedef struct info
+{
+    size_t      size;
+    uint32_t    flags;
+} kv_info_t;
+
+int kv_set(const char *key, const void *buffer, size_t size, uint32_t create_flags);
+int kv_get(const char *key, void *buffer, size_t buffer_size, size_t *actual_size);
+int kv_get_info(const char *key, kv_info_t *info);
+int kv_remove(const char *key);
+
+/** Forget every key, as a board with a wiped flash
+ */
+void kv_reset_all();
+
+#endif
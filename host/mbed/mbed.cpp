@@ -0,0 +1,87 @@
+/**
+    @file       mbed.cpp
+    @version    0.0.3
+    @brief      Linux stand-in for the parts of mbed OS the quectel bg77 driver uses
+ */
+
+
+/** Includes */
+#include "mbed.h"
+#include "kvstore_global_api.h"
+#include <vector>
+
+
+/** Every FileHandle that receives data notifies, waiters check their own handle
+ */
+static std::mutex poll_mutex;
+static std::condition_variable poll_cv;
+
+void host_poll_notify()
+{
+    std::lock_guard<std::mutex> lock(poll_mutex);
+    poll_cv.notify_all();
+}
+
+bool host_poll_readable(FileHandle *fh, int timeout_ms)
+{
+    std::unique_lock<std::mutex> lock(poll_mutex);
+    if (timeout_ms < 0)
+    {
+        poll_cv.wait(lock, [fh]() { return fh->readable(); });
+        return true;
+    }
+    return poll_cv.wait_for(lock, std::chrono::milliseconds(timeout_ms), [fh]() { return fh->readable(); });
+}
+
+static std::mutex kv_mutex;
+static std::map<std::string, std::vector<uint8_t>> kv_store;
+
+int kv_set(const char *key, const void *buffer, size_t size, uint32_t create_flags)
+{
+    std::lock_guard<std::mutex> lock(kv_mutex);
+    const uint8_t *bytes = static_cast<const uint8_t *>(buffer);
+    kv_store[key].assign(bytes, bytes + size);
+    return MBED_SUCCESS;
+}
+
+int kv_get(const char *key, void *buffer, size_t buffer_size, size_t *actual_size)
+{
+    std::lock_guard<std::mutex> lock(kv_mutex);
+    auto it = kv_store.find(key);
+    if (it == kv_store.end())
+    {
+        return MBED_ERROR_ITEM_NOT_FOUND;
+    }
+    size_t size = (it->second.size() < buffer_size) ? it->second.size() : buffer_size;
+    memcpy(buffer, it->second.data(), size);
+    if (actual_size)
+    {
+        *actual_size = size;
+    }
+    return MBED_SUCCESS;
+}
+
+int kv_get_info(const char *key, kv_info_t *info)
+{
+    std::lock_guard<std::mutex> lock(kv_mutex);
+    auto it = kv_store.find(key);
+    if (it == kv_store.end())
+    {
+        return MBED_ERROR_ITEM_NOT_FOUND;
+    }
+    info->size = it->second.size();
+    info->flags = 0;
+    return MBED_SUCCESS;
+}
+
+int kv_remove(const char *key)
+{
+    std::lock_guard<std::mutex> lock(kv_mutex);
+    return (kv_store.erase(key) > 0) ? MBED_SUCCESS : MBED_ERROR_ITEM_NOT_FOUND;
+}
+
+void kv_reset_all()
+{
+    std::lock_guard<std::mutex> lock(kv_mutex);
+    kv_store.clear();
+}
@@ -0,0 +1,583 @@
+/**
+    @file    mbed.h
+    @version 0.0.3
+    @brief   Linux stand-in for the parts of mbed OS the quectel bg77 driver uses, so the
+             driver builds and runs on a host against the emulator in bg77_emulator.h
+ */
+
+#ifndef HOST_MBED_H
+#define HOST_MBED_H
+
+/** Define to prevent recursive inclusion
+ */
+#pragma once
+
+/** Includes
+ */
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <cstdarg>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <poll.h>
+#include <strings.h>
+#include <sys/types.h>
+
+using namespace std::chrono_literals;
+
+/** Pins mean nothing on a host, the driver runs over a FileHandle
+ */
+typedef int PinName;
+static const PinName NC = -1;
+
+#define MBED_ASSERT(expr) do { if (!(expr)) { fprintf(stderr, "MBED_ASSERT %s at %s:%d\n", #expr, __FILE__, __LINE__); abort(); } } while (0)
+#define MBED_SUCCESS 0
+
+typedef int osPriority;
+static const osPriority osPriorityNormal = 24;
+static const osPriority osPriorityAboveNormal = 32;
+#define EVENTS_EVENT_SIZE 64
+
+/** Callback, mbed::Callback on top of std::function
+ */
+template <typename F> class Callback;
+
+template <typename R, typename... A> class Callback<R(A...)>
+{
+    public:
+        Callback() {}
+        Callback(std::nullptr_t) {}
+        Callback(R (*f)(A...))
+        {
+            if (f)
+            {
+                _f = f;
+            }
+        }
+        template <typename T, typename U>
+        Callback(U *obj, R (T::*method)(A...)) : _f([obj, method](A... a) { return (obj->*method)(a...); }) {}
+        template <typename T, typename U>
+        Callback(const U *obj, R (T::*method)(A...) const) : _f([obj, method](A... a) { return (obj->*method)(a...); }) {}
+        template <typename L, typename = typename std::enable_if<
+                      !std::is_same<typename std::decay<L>::type, Callback>::value
+                      && !std::is_pointer<typename std::decay<L>::type>::value>::type>
+        Callback(L l) : _f(l) {}
+
+        R operator()(A... a) const { return _f(a...); }
+        R call(A... a) const { return _f(a...); }
+        explicit operator bool() const { return static_cast<bool>(_f); }
+
+    private:
+        std::function<R(A...)> _f;
+};
+
+template <typename T, typename U, typename R, typename... A>
+Callback<R(A...)> callback(U *obj, R (T::*method)(A...))
+{
+    return Callback<R(A...)>(obj, method);
+}
+
+template <typename R, typename... A>
+Callback<R(A...)> callback(R (*f)(A...))
+{
+    return Callback<R(A...)>(f);
+}
+
+namespace mbed
+{
+    template <typename F> using Callback = ::Callback<F>;
+}
+
+/** Kernel clock, milliseconds since the process started
+ */
+namespace Kernel
+{
+    struct Clock
+    {
+        typedef std::chrono::milliseconds           duration;
+        typedef duration::rep                       rep;
+        typedef duration::period                    period;
+        typedef std::chrono::time_point<Clock>      time_point;
+        static const bool is_steady = true;
+
+        static time_point now()
+        {
+            static const auto start = std::chrono::steady_clock::now();
+            return time_point(std::chrono::duration_cast<duration>(std::chrono::steady_clock::now() - start));
+        }
+    };
+}
+
+namespace ThisThread
+{
+    template <typename Rep, typename Period>
+    void sleep_for(std::chrono::duration<Rep, Period> d)
+    {
+        std::this_thread::sleep_for(d);
+    }
+
+    inline void sleep_until(Kernel::Clock::time_point t)
+    {
+        sleep_for(t - Kernel::Clock::now());
+    }
+}
+
+/** Recursive, as rtos::Mutex
+ */
+class Mutex
+{
+    public:
+        void lock() { _m.lock(); }
+        void unlock() { _m.unlock(); }
+        bool trylock() { return _m.try_lock(); }
+
+    private:
+        std::recursive_mutex _m;
+};
+
+class Thread
+{
+    public:
+        Thread(osPriority priority = osPriorityNormal, uint32_t stack_size = 0, unsigned char *stack_mem = nullptr,
+               const char *name = nullptr) {}
+        ~Thread() { join(); }
+
+        int start(Callback<void()> task)
+        {
+            _thread = std::thread([task]() { task(); });
+            return 0;
+        }
+
+        int join()
+        {
+            if (_thread.joinable())
+            {
+                _thread.join();
+            }
+            return 0;
+        }
+
+    private:
+        std::thread _thread;
+};
+
+class EventFlags
+{
+    public:
+        uint32_t set(uint32_t flags) { return _flags.fetch_or(flags) | flags; }
+        uint32_t clear(uint32_t flags = 0x7fffffff) { return _flags.fetch_and(~flags); }
+        uint32_t get() const { return _flags.load(); }
+
+    private:
+        std::atomic<uint32_t> _flags{0};
+};
+
+/** Event queue with one dispatching thread, as the driver uses it
+ */
+class EventQueue
+{
+    public:
+        EventQueue(unsigned size = 0) : _next_id(1), _break(false) {}
+
+        template <typename T, typename U, typename... A>
+        int call(U *obj, void (T::*method)(A...))
+        {
+            return _post(Kernel::Clock::now(), [obj, method]() { (obj->*method)(); });
+        }
+
+        template <typename F>
+        int call(F f)
+        {
+            return _post(Kernel::Clock::now(), std::function<void()>(f));
+        }
+
+        template <typename Rep, typename Period, typename T, typename U>
+        int call_in(std::chrono::duration<Rep, Period> delay, U *obj, void (T::*method)())
+        {
+            return _post(Kernel::Clock::now() + std::chrono::duration_cast<Kernel::Clock::duration>(delay),
+                         [obj, method]() { (obj->*method)(); });
+        }
+
+        bool cancel(int id)
+        {
+            std::lock_guard<std::mutex> lock(_m);
+            return _events.erase(id) > 0;
+        }
+
+        void dispatch_forever()
+        {
+            std::unique_lock<std::mutex> lock(_m);
+            while (!_break)
+            {
+                auto next = _events.end();
+                for (auto it = _events.begin(); it != _events.end(); ++it)
+                {
+                    if (next == _events.end() || it->second.when < next->second.when)
+                    {
+                        next = it;
+                    }
+                }
+                if (next == _events.end())
+                {
+                    _cv.wait(lock);
+                    continue;
+                }
+                if (next->second.when > Kernel::Clock::now())
+                {
+                    _cv.wait_for(lock, next->second.when - Kernel::Clock::now());
+                    continue;
+                }
+                std::function<void()> f = next->second.f;
+                _events.erase(next);
+                lock.unlock();
+                f();
+                lock.lock();
+            }
+            _break = false;
+        }
+
+        void break_dispatch()
+        {
+            std::lock_guard<std::mutex> lock(_m);
+            _break = true;
+            _cv.notify_all();
+        }
+
+    private:
+        struct event
+        {
+            Kernel::Clock::time_point   when;
+            std::function<void()>       f;
+        };
+
+        int _post(Kernel::Clock::time_point when, std::function<void()> f)
+        {
+            std::lock_guard<std::mutex> lock(_m);
+            int id = _next_id++;
+            // Ids in order of posting keep events due at once in order
+            _events[id] = { when, f };
+            _cv.notify_all();
+            return id;
+        }
+
+        std::mutex                  _m;
+        std::condition_variable     _cv;
+        std::map<int, event>        _events;
+        int                         _next_id;
+        bool                        _break;
+};
+
+class DigitalOut
+{
+    public:
+        DigitalOut(PinName pin, int value = 0) : _value(value) {}
+        void write(int value) { _value = value; }
+        int read() { return _value; }
+        DigitalOut &operator=(int value) { write(value); return *this; }
+        operator int() { return _value; }
+
+    private:
+        int _value;
+};
+
+/** Wakes poll_readable() when any FileHandle has data
+ */
+void host_poll_notify();
+
+/** Wait until fh is readable or timeout_ms passed, -1 waits for ever
+    @return true if it is readable
+ */
+class FileHandle;
+bool host_poll_readable(FileHandle *fh, int timeout_ms);
+
+class FileHandle
+{
+    public:
+        virtual ~FileHandle() {}
+        virtual ssize_t read(void *buffer, size_t size) = 0;
+        virtual ssize_t write(const void *buffer, size_t size) = 0;
+        virtual short poll(short events) const { return POLLIN | POLLOUT; }
+        bool readable() const { return (poll(POLLIN) & POLLIN) != 0; }
+        bool writable() const { return (poll(POLLOUT) & POLLOUT) != 0; }
+        virtual void sigio(Callback<void()> func) {}
+        virtual int set_blocking(bool blocking) { return 0; }
+        virtual int close() { return 0; }
+};
+
+namespace mbed
+{
+    using ::FileHandle;
+}
+
+/** The host build runs the driver over a FileHandle, see PosixSerial. A BufferedSerial
+    is a port with nothing on the other end
+ */
+class BufferedSerial : public FileHandle
+{
+    public:
+        BufferedSerial(PinName tx, PinName rx, int baud = 9600) {}
+        ssize_t read(void *buffer, size_t size) override { return -EAGAIN; }
+        ssize_t write(const void *buffer, size_t size) override { return size; }
+        short poll(short events) const override { return POLLOUT; }
+        void set_baud(int baud) {}
+};
+
+/** The subset of mbed's ATCmdParser the driver uses: it reads responses itself with getc()
+ */
+class ATCmdParser
+{
+    public:
+        ATCmdParser(FileHandle *fh, const char *output_delimiter = "\r", int buffer_size = 256, int timeout = 8000,
+                    bool debug = false)
+                    : _fh(fh), _buffer_size(buffer_size), _timeout(timeout)
+        {
+            set_delimiter(output_delimiter);
+        }
+
+        void set_timeout(int timeout) { _timeout = timeout; }
+        void set_delimiter(const char *output_delimiter) { _delimiter = output_delimiter; }
+        void debug_on(uint8_t on) {}
+
+        int putc(char c) { return (_fh->write(&c, 1) == 1) ? c : -1; }
+
+        int getc()
+        {
+            char c;
+            if (!host_poll_readable(_fh, _timeout) || _fh->read(&c, 1) != 1)
+            {
+                return -1;
+            }
+            return (uint8_t) c;
+        }
+
+        int write(const char *data, int size)
+        {
+            return (_fh->write(data, size) == size) ? size : -1;
+        }
+
+        int read(char *data, int size)
+        {
+            for (int i = 0; i < size; i++)
+            {
+                int c = getc();
+                if (c < 0)
+                {
+                    return -1;
+                }
+                data[i] = c;
+            }
+            return size;
+        }
+
+        /** Formats into a buffer of buffer_size bytes as mbed does. A command that does not
+            fit would overrun that buffer on the target, here it aborts
+         */
+        bool vsend(const char *command, va_list args)
+        {
+            char buffer[_MAX_BUFFER];
+            int len = vsnprintf(buffer, sizeof(buffer), command, args);
+            if (len < 0 || len >= _buffer_size)
+            {
+                fprintf(stderr, "ATCmdParser: %d byte command overruns the %d byte buffer\n", len, _buffer_size);
+                ::abort();
+            }
+            return write(buffer, len) == len && write(_delimiter.c_str(), _delimiter.size()) == (int) _delimiter.size();
+        }
+
+        bool send(const char *command, ...)
+        {
+            va_list args;
+            va_start(args, command);
+            bool sent = vsend(command, args);
+            va_end(args);
+            return sent;
+        }
+
+        void flush()
+        {
+            char c;
+            while (_fh->readable() && _fh->read(&c, 1) == 1)
+            {
+            }
+        }
+
+        void abort() {}
+
+    private:
+        static const int _MAX_BUFFER = 4096;
+
+        FileHandle    *_fh;
+        int            _buffer_size;
+        int            _timeout;
+        std::string    _delimiter;
+};
+
+/** Atomics of mbed_atomic.h
+ */
+inline bool core_util_atomic_exchange_bool(volatile bool *p, bool v)
+{
+    return __atomic_exchange_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+inline void core_util_atomic_store_bool(volatile bool *p, bool v)
+{
+    __atomic_store_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+inline bool core_util_atomic_load_bool(const volatile bool *p)
+{
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+inline uint32_t core_util_atomic_load_u32(const volatile uint32_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+inline void core_util_atomic_store_u32(volatile uint32_t *p, uint32_t v)
+{
+    __atomic_store_n(p, v, __ATOMIC_SEQ_CST);
+}
+
+/** The host clock is not set by the driver, time() keeps the system time
+ */
+inline void set_time(time_t t) {}
+
+/** Network stack types of nsapi, enough for QUECTEL_BG77_CELLULAR
+ */
+typedef int nsapi_error_t;
+typedef int nsapi_size_or_error_t;
+typedef unsigned nsapi_size_t;
+typedef void *nsapi_socket_t;
+
+enum nsapi_protocol_t
+{
+    NSAPI_TCP,
+    NSAPI_UDP
+};
+
+enum
+{
+    NSAPI_ERROR_OK              = 0,
+    NSAPI_ERROR_WOULD_BLOCK     = -3001,
+    NSAPI_ERROR_UNSUPPORTED     = -3002,
+    NSAPI_ERROR_PARAMETER       = -3003,
+    NSAPI_ERROR_NO_CONNECTION   = -3004,
+    NSAPI_ERROR_NO_SOCKET       = -3005,
+    NSAPI_ERROR_NO_ADDRESS      = -3006,
+    NSAPI_ERROR_NO_MEMORY       = -3007,
+    NSAPI_ERROR_DEVICE_ERROR    = -3012,
+    NSAPI_ERROR_IS_CONNECTED    = -3015,
+    NSAPI_ERROR_TIMEOUT         = -3017
+};
+
+enum nsapi_connection_status_t
+{
+    NSAPI_STATUS_LOCAL_UP,
+    NSAPI_STATUS_GLOBAL_UP,
+    NSAPI_STATUS_DISCONNECTED,
+    NSAPI_STATUS_CONNECTING
+};
+
+enum nsapi_version_t
+{
+    NSAPI_UNSPEC,
+    NSAPI_IPv4,
+    NSAPI_IPv6
+};
+
+class SocketAddress
+{
+    public:
+        SocketAddress(const char *ip = nullptr, uint16_t port = 0) : _port(port)
+        {
+            set_ip_address(ip);
+        }
+
+        bool set_ip_address(const char *ip)
+        {
+            _ip = ip ? ip : "";
+            return true;
+        }
+
+        const char *get_ip_address() const { return _ip.empty() ? nullptr : _ip.c_str(); }
+        void set_port(uint16_t port) { _port = port; }
+        uint16_t get_port() const { return _port; }
+        nsapi_version_t get_ip_version() const { return _ip.empty() ? NSAPI_UNSPEC : NSAPI_IPv4; }
+        explicit operator bool() const { return !_ip.empty(); }
+
+    private:
+        std::string _ip;
+        uint16_t    _port;
+};
+
+class NetworkStack
+{
+    public:
+        virtual ~NetworkStack() {}
+        virtual nsapi_error_t get_ip_address(SocketAddress *address) { return NSAPI_ERROR_UNSUPPORTED; }
+        virtual nsapi_error_t gethostbyname(const char *host, SocketAddress *address,
+                                            nsapi_version_t version = NSAPI_UNSPEC, const char *interface_name = nullptr)
+        {
+            address->set_ip_address(host);
+            return NSAPI_ERROR_OK;
+        }
+
+    protected:
+        virtual nsapi_error_t socket_open(nsapi_socket_t *handle, nsapi_protocol_t proto) = 0;
+        virtual nsapi_error_t socket_close(nsapi_socket_t handle) = 0;
+        virtual nsapi_error_t socket_bind(nsapi_socket_t handle, const SocketAddress &address) = 0;
+        virtual nsapi_error_t socket_listen(nsapi_socket_t handle, int backlog) = 0;
+        virtual nsapi_error_t socket_connect(nsapi_socket_t handle, const SocketAddress &address) = 0;
+        virtual nsapi_error_t socket_accept(nsapi_socket_t server, nsapi_socket_t *handle, SocketAddress *address = 0) = 0;
+        virtual nsapi_size_or_error_t socket_send(nsapi_socket_t handle, const void *data, nsapi_size_t size) = 0;
+        virtual nsapi_size_or_error_t socket_recv(nsapi_socket_t handle, void *data, nsapi_size_t size) = 0;
+        virtual nsapi_size_or_error_t socket_sendto(nsapi_socket_t handle, const SocketAddress &address,
+                                                    const void *data, nsapi_size_t size) = 0;
+        virtual nsapi_size_or_error_t socket_recvfrom(nsapi_socket_t handle, SocketAddress *address,
+                                                      void *data, nsapi_size_t size) = 0;
+        virtual void socket_attach(nsapi_socket_t handle, void (*callback)(void *), void *data) = 0;
+};
+
+class NetworkInterface
+{
+    public:
+        virtual ~NetworkInterface() {}
+        virtual nsapi_error_t connect() = 0;
+        virtual nsapi_error_t disconnect() = 0;
+        virtual nsapi_error_t get_ip_address(SocketAddress *address) { return NSAPI_ERROR_UNSUPPORTED; }
+        virtual nsapi_error_t get_netmask(SocketAddress *address) { return NSAPI_ERROR_UNSUPPORTED; }
+        virtual nsapi_error_t get_gateway(SocketAddress *address) { return NSAPI_ERROR_UNSUPPORTED; }
+        virtual nsapi_connection_status_t get_connection_status() const { return NSAPI_STATUS_DISCONNECTED; }
+
+    protected:
+        virtual NetworkStack *get_stack() = 0;
+};
+
+class CellularInterface : public NetworkInterface
+{
+    public:
+        virtual void set_credentials(const char *apn, const char *uname = 0, const char *pwd = 0) = 0;
+        virtual void set_plmn(const char *plmn) = 0;
+        virtual void set_sim_pin(const char *sim_pin) = 0;
+        virtual nsapi_error_t connect(const char *sim_pin, const char *apn = 0, const char *uname = 0,
+                                      const char *pwd = 0) = 0;
+        nsapi_error_t connect() override = 0;
+        nsapi_error_t disconnect() override = 0;
+        virtual bool is_connected() = 0;
+};
+
+#endif
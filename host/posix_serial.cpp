@@ -0,0 +1,157 @@
+/**
+    @file       posix_serial.cpp
+    @version    0.0.3
+    @brief      FileHandle over a POSIX tty, the host's BufferedSerial
+ */
+
+
+/** Includes */
+#include "posix_serial.h"
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+
+POSIX_SERIAL::POSIX_SERIAL(const char *path) : _blocking(true)
+{
+    _wake[0] = _wake[1] = -1;
+    _fd = ::open(path, O_RDWR | O_NOCTTY);
+    if (_fd < 0)
+    {
+        return;
+    }
+    struct termios tio;
+    if (tcgetattr(_fd, &tio) == 0)
+    {
+        cfmakeraw(&tio);
+        tcsetattr(_fd, TCSANOW, &tio);
+    }
+    if (pipe(_wake) != 0)
+    {
+        ::close(_fd);
+        _fd = -1;
+        return;
+    }
+    _thread = std::thread(&POSIX_SERIAL::_reader, this);
+}
+
+POSIX_SERIAL::~POSIX_SERIAL()
+{
+    if (_thread.joinable())
+    {
+        // Any byte on the pipe stops the reader
+        char stop = 0;
+        (void) !::write(_wake[1], &stop, 1);
+        _thread.join();
+    }
+    if (_fd >= 0)
+    {
+        ::close(_fd);
+        ::close(_wake[0]);
+        ::close(_wake[1]);
+    }
+}
+
+bool POSIX_SERIAL::is_open() const
+{
+    return _fd >= 0;
+}
+
+void POSIX_SERIAL::_reader()
+{
+    char buffer[256];
+    while (true)
+    {
+        struct pollfd fds[2] = { { _fd, POLLIN, 0 }, { _wake[0], POLLIN, 0 } };
+        if (::poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+        if (fds[1].revents)
+        {
+            return;
+        }
+        ssize_t got = ::read(_fd, buffer, sizeof(buffer));
+        if (got <= 0)
+        {
+            // The other end closed, nothing more will come
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _rx.insert(_rx.end(), buffer, buffer + got);
+        }
+        _cv.notify_all();
+        host_poll_notify();
+        // Held while the handler runs, so it is not called once sigio() replaced it
+        std::lock_guard<std::mutex> lock(_sigio_mutex);
+        if (_sigio)
+        {
+            _sigio();
+        }
+    }
+}
+
+ssize_t POSIX_SERIAL::read(void *buffer, size_t size)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_rx.empty())
+    {
+        if (!_blocking)
+        {
+            return -EAGAIN;
+        }
+        _cv.wait(lock, [this]() { return !_rx.empty(); });
+    }
+    size_t n = 0;
+    char *out = static_cast<char *>(buffer);
+    while (n < size && !_rx.empty())
+    {
+        out[n++] = _rx.front();
+        _rx.pop_front();
+    }
+    return n;
+}
+
+ssize_t POSIX_SERIAL::write(const void *buffer, size_t size)
+{
+    const char *p = static_cast<const char *>(buffer);
+    size_t left = size;
+    while (left > 0)
+    {
+        ssize_t put = ::write(_fd, p, left);
+        if (put < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+            {
+                continue;
+            }
+            return -errno;
+        }
+        p += put;
+        left -= put;
+    }
+    return size;
+}
+
+short POSIX_SERIAL::poll(short events) const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    return (_rx.empty() ? 0 : POLLIN) | POLLOUT;
+}
+
+void POSIX_SERIAL::sigio(Callback<void()> func)
+{
+    std::lock_guard<std::mutex> lock(_sigio_mutex);
+    _sigio = func;
+}
+
+int POSIX_SERIAL::set_blocking(bool blocking)
+{
+    _blocking = blocking;
+    return 0;
+}
@@ -0,0 +1,58 @@
+/**
+    @file    posix_serial.h
+    @version 0.0.3
+    @brief   FileHandle over a POSIX tty, the host's BufferedSerial
+ */
+
+#ifndef POSIX_SERIAL_H
+#define POSIX_SERIAL_H
+
+/** Define to prevent recursive inclusion
+ */
+#pragma once
+
+/** Includes
+ */
+#include <mbed.h>
+
+/** A tty opened raw. A reader thread buffers what arrives and calls the sigio handler,
+    as the receive interrupt of a BufferedSerial does
+
+    Example code
+    POSIX_SERIAL serial("/dev/pts/3");
+    QUECTEL_BG77 modem(&serial, NC);
+ */
+class POSIX_SERIAL : public FileHandle
+{
+    public:
+        /** Open the tty
+            @param path. e.g. the port of BG77_EMULATOR
+         */
+        POSIX_SERIAL(const char *path);
+        ~POSIX_SERIAL();
+
+        /** @return true if the tty is open
+         */
+        bool is_open() const;
+
+        ssize_t read(void *buffer, size_t size) override;
+        ssize_t write(const void *buffer, size_t size) override;
+        short poll(short events) const override;
+        void sigio(Callback<void()> func) override;
+        int set_blocking(bool blocking) override;
+
+    private:
+        void _reader();
+
+        int                         _fd;
+        int                         _wake[2];
+        bool                        _blocking;
+        std::thread                 _thread;
+        mutable std::mutex          _mutex;
+        std::mutex                  _sigio_mutex;
+        std::condition_variable     _cv;
+        std::deque<char>            _rx;
+        Callback<void()>            _sigio;
+};
+
+#endif
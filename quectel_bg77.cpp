@@ -10,32 +10,344 @@
 
 /** Includes */
 #include "quectel_bg77.h"
+#include "kvstore_global_api.h"
+#include <cctype>
+#include <cstdarg>
 #include <cstdint>
 #include <string>
 
 
-QUECTEL_BG77::QUECTEL_BG77(PinName txu, PinName rxu, PinName pwkey, int baud) 
-                                :_pwkey(pwkey) 
+/** URCs the driver recognises. A line with one of these prefixes is an URC unless the command
+    in flight asked for it as its response, e.g. +CPIN: READY for AT+CPIN?
+ */
+static const struct
+{
+    const char          *prefix;
+    QUECTEL_BG77::urc_t  type;
+} urc_table[] =
+{
+    { "+CEREG:",        QUECTEL_BG77::URC_CEREG         },
+    { "+QIND:",         QUECTEL_BG77::URC_QIND          },
+    { "+QHTTPPOST:",    QUECTEL_BG77::URC_QHTTPPOST     },
+    { "+QHTTPREAD:",    QUECTEL_BG77::URC_QHTTPREAD     },
+    { "+QHTTPPOSTFILE:", QUECTEL_BG77::URC_QHTTPPOSTFILE },
+    { "+QHTTPGET:",     QUECTEL_BG77::URC_QHTTPGET      },
+    { "+QNTP:",         QUECTEL_BG77::URC_QNTP          },
+    { "+QGPSURC:",      QUECTEL_BG77::URC_QGPSURC       },
+    { "+CPIN:",         QUECTEL_BG77::URC_CPIN          },
+    { "RDY",            QUECTEL_BG77::URC_RDY           },
+    { "POWERED DOWN",   QUECTEL_BG77::URC_POWERED_DOWN  },
+    { "+QIOPEN:",       QUECTEL_BG77::URC_QIOPEN        },
+    { "+QIURC:",        QUECTEL_BG77::URC_QIURC         },
+    { "+QMTOPEN:",      QUECTEL_BG77::URC_QMTOPEN       },
+    { "+QMTCONN:",      QUECTEL_BG77::URC_QMTCONN       },
+    { "+QMTDISC:",      QUECTEL_BG77::URC_QMTDISC       },
+    { "+QMTSUB:",       QUECTEL_BG77::URC_QMTSUB        },
+    { "+QMTPUB:",       QUECTEL_BG77::URC_QMTPUB        },
+    { "+QMTRECV:",      QUECTEL_BG77::URC_QMTRECV       },
+    { "+QMTSTAT:",      QUECTEL_BG77::URC_QMTSTAT       },
+    { "+CTZE:",         QUECTEL_BG77::URC_CTZE          },
+    { "+CTZV:",         QUECTEL_BG77::URC_CTZV          },
+};
+
+/** Maximum response time of each command, from the BG77 AT commands manuals. The deadline
+    covers the whole response up to the final result code. A command matches the longest 
+    entry it starts with, provided the entry is not followed by more of a command name
+ */
+static constexpr struct
+{
+    const char  *command;
+    uint32_t     max_ms;
+} at_timeouts[] =
+{
+    { "AT",             300     },
+    { "ATE",            300     },
+    { "ATI",            300     },
+    { "AT&F",           300     },
+    { "AT+GMR",         300     },
+    { "AT+CGSN",        300     },
+    { "AT+CIMI",        300     },
+    { "AT+CPIN",        5000    },
+    { "AT+CFUN",        15000   },
+    { "AT+COPS",        180000  },
+    { "AT+COPS?",       300     },
+    { "AT+COPS=?",      180000  },
+    { "AT+CEREG",       300     },
+    { "AT+CEDRXS",      300     },
+    { "AT+CPSMS",       300     },
+    { "AT+CTZU",        300     },
+    { "AT+CTZR",        300     },
+    { "AT+CCLK",        300     },
+    { "AT+CGDCONT",     300     },
+    { "AT+QCSQ",        300     },
+    { "AT+QNWINFO",     300     },
+    { "AT+QCFG",        300     },
+    { "AT+QCFGEXT",     300     },
+    { "AT+QSCLK",       300     },
+    { "AT+QPOWD",       300     },
+    { "AT+QICSGP",      300     },
+    { "AT+QIACT",       150000  },
+    { "AT+QIACT?",      300     },
+    { "AT+QICFG",       300     },
+    { "AT+QIOPEN",      150000  },
+    { "AT+QISEND",      5000    },
+    { "AT+QIRD",        300     },
+    { "AT+QICLOSE",     10000   },
+    { "AT+QPING",       300     },
+    { "AT+QMTCFG",      300     },
+    { "AT+QMTOPEN",     300     },
+    { "AT+QMTCONN",     300     },
+    { "AT+QMTDISC",     300     },
+    { "AT+QMTSUB",      300     },
+    { "AT+QMTPUB",      15000   },
+    { "AT+QMTRECV",     300     },
+    { "AT+QNTP",        125000  },
+    { "AT+QHTTPCFG",    300     },
+    { "AT+QHTTPURL",    5000    },
+    { "AT+QHTTPPOST",   80000   },
+    { "AT+QHTTPREAD",   80000   },
+    { "AT+QHTTPPOSTFILE", 80000 },
+    { "AT+QHTTPGET",    80000   },
+    { "AT+QFOPEN",      300     },
+    { "AT+QFWRITE",     5000    },
+    { "AT+QFSEEK",      300     },
+    { "AT+QFCLOSE",     300     },
+    { "AT+QFDEL",       300     },
+    { "AT+QFUPL",       5000    },
+    { "AT+QFLST",       300     },
+    { "AT+QSSLCFG",     300     },
+    { "AT+QFOTADL",     300     },
+    { "AT+QGPS",        300     },
+    { "AT+QGPSCFG",     300     },
+    { "AT+QGPSLOC",     300     },
+    { "AT+QGPSEND",     300     },
+    { "AT+QGPSXTRA",    300     },
+    { "AT+QGPSXTRADATA", 300    },
+    { "AT+QGPSXTRATIME", 300    },
+};
+
+/** Time the enclosing method as one span
+ */
+#if QUECTEL_BG77_STATS
+#define BG77_SPAN(span) _span_timer span_timer(this, span)
+#else
+#define BG77_SPAN(span)
+#endif
+
+/** Timeout of commands that are not in the table
+ */
+static const int DEFAULT_TIMEOUT = 12500;
+
+/** Adaptive deadlines: upper edge of the first latency bucket, samples needed before the
+    deadline is trusted, and the floor below which it is never set
+ */
+static const uint32_t LATENCY_BUCKET_MS = 25;
+static const int ADAPTIVE_MIN_SAMPLES = 8;
+static const uint32_t ADAPTIVE_MIN_MS = 100;
+
+/** KVStore key of the configuration shadow, and its layout version
+ */
+static const char *const CONFIG_KEY = "/kv/bg77_cfg";
+static const uint32_t CONFIG_VERSION = 6;
+
+/** Attach: polls per stage before giving up, and the first poll interval, doubled on every
+    poll. URCs advance the attach before the poll is due
+ */
+static const int ATTACH_MAX_TRIES = 8;
+static const int ATTACH_BACKOFF_MS = 1000;
+
+/** Stacks: the URC thread only reads lines and dispatches them. The work thread runs 
+    command sequences, scanf and KVStore writes for the attach, and reads downlink messages
+ */
+static const uint32_t URC_STACK_SIZE = 2048;
+static const uint32_t WORK_STACK_SIZE = 6144;
+
+/** How long the URC thread waits for the rest of a line once the UART is readable
+ */
+static const int URC_IDLE_TIMEOUT = 50;
+
+/** UFS file a compressed post is staged in, and the width of its Content-Length placeholder
+ */
+static const char *const POST_FILE = "bg77_post.bin";
+static const int CONTENT_LENGTH_WIDTH = 10;
+
+/** Attempts at one range of a download before http_download() gives up
+ */
+static const int DOWNLOAD_TRIES = 3;
+
+/** Time the module takes to report the outcome of AT+QIOPEN
+ */
+static const int SOCKET_OPEN_TIMEOUT = 150000;
+
+/** MQTT: time for +QMTOPEN, and for the broker to answer a packet (<pkt_timeout> plus margin)
+ */
+static const int MQTT_OPEN_TIMEOUT = 75000;
+static const int MQTT_PACKET_TIMEOUT = 20000;
+
+/** FOTA download, upgrade and reboot can take minutes between indications
+ */
+static const int FOTA_TIMEOUT = 300000;
+
+/** GNSS port, and the wait for a fix from it
+ */
+static const int GNSS_BAUD = 115200;
+static const uint32_t GNSS_FIX_TIMEOUT_S = 18;
+
+/** parse_latlon() is done once hdop is this good. A fix less than this old makes the next
+    start a hot one
+ */
+static const float GNSS_MAX_HDOP = 2.0f;
+static const int GNSS_HOT_WINDOW_S = 2 * 3600;
+
+/** XTRA: renewed when it has less than a day left, and the name of an uploaded file. 
+    Times before 2020 are taken for a clock that was never set
+ */
+static const uint32_t XTRA_REFRESH_S = 24 * 3600;
+static const char *const XTRA_FILE = "xtra2.bin";
+static const time_t VALID_TIME = 1577836800;
+
+/** Time service: error of a fresh NTP or NITZ time (the clocks count whole seconds), RTC
+    drift before and after it was learned, the least run it is learned over and its limit
+ */
+static const uint32_t RTC_NTP_ERROR_MS = 1000;
+static const uint32_t RTC_NITZ_ERROR_MS = 2000;
+static const uint32_t RTC_PPM = 50;
+static const uint32_t RTC_PPM_TRAINED = 25;
+static const int64_t RTC_LEARN_S = 24 * 3600;
+static const int32_t RTC_PPM_LIMIT = 500;
+
+QUECTEL_BG77::QUECTEL_BG77(PinName txu, PinName rxu, PinName pwkey, int baud, PinName gnss_rxu) 
+                                :_pwkey(pwkey), _urc_thread(osPriorityAboveNormal, URC_STACK_SIZE, nullptr, "bg77_urc"),
+                                 _urc_queue(8 * EVENTS_EVENT_SIZE),
+                                 _work_thread(osPriorityNormal, WORK_STACK_SIZE, nullptr, "bg77_work"),
+                                 _work_queue(4 * EVENTS_EVENT_SIZE)
 {
 	_serial = new BufferedSerial(txu, rxu, baud);
-	_parser = new ATCmdParser(_serial);
-	_parser->set_delimiter("\r");
-	_parser->set_timeout(12500); 
-    _parser->flush();
+	_fh = _serial;
+    _init();
+    if (gnss_rxu != NC)
+    {
+        // Output only, nothing is sent to the GNSS port
+        _gps_serial = new BufferedSerial(NC, gnss_rxu, GNSS_BAUD);
+        _gnss_open(_gps_serial);
+    }
+}
+
+QUECTEL_BG77::QUECTEL_BG77(FileHandle *fh, PinName pwkey, FileHandle *gnss_fh) 
+                                :_pwkey(pwkey), _urc_thread(osPriorityAboveNormal, URC_STACK_SIZE, nullptr, "bg77_urc"),
+                                 _urc_queue(8 * EVENTS_EVENT_SIZE),
+                                 _work_thread(osPriorityNormal, WORK_STACK_SIZE, nullptr, "bg77_work"),
+                                 _work_queue(4 * EVENTS_EVENT_SIZE)
+{
+	_serial = nullptr;
+	_fh = fh;
+    _init();
+    if (gnss_fh)
+    {
+        _gnss_open(gnss_fh);
+    }
 }
 
 QUECTEL_BG77::~QUECTEL_BG77()
 {
+    _fh->sigio(nullptr);
+    if (_gnss_fh)
+    {
+        _gnss_fh->sigio(nullptr);
+    }
+    _work_queue.break_dispatch();
+    _work_thread.join();
+    _urc_queue.break_dispatch();
+    _urc_thread.join();
 	delete _serial;
+	delete _gps_serial;
 	delete _parser;
 }
 
+void QUECTEL_BG77::_init()
+{
+    _lock_depth = 0;
+    _urc_pending = false;
+    _gps_serial = nullptr;
+    _gnss_fh = nullptr;
+    _gnss_pending = false;
+    _nmea_reset = false;
+    _fix_cached = false;
+    _xtra_expires = 0;
+    for (int i = 0; i < RF_JOBS; i++)
+    {
+        _rf_jobs[i].used = false;
+    }
+    _rf_owner = -1;
+    // No LTE activity yet, a GNSS job has no quiet period to wait for
+    _rf_since = Kernel::Clock::time_point();
+    _rf_wwan_end = Kernel::Clock::time_point();
+    memset(&_rf_metrics, 0, sizeof(_rf_metrics));
+    _time_synced = false;
+    _time_sync_utc = 0;
+    _time_sync_error_ms = 0;
+    _time_source = TIME_NONE;
+    _time_tz = 0;
+    _rtc_ppm = 0;
+    _rtc_trained = false;
+    _nitz_seen = false;
+    _iso_time[0] = '\0';
+    memset(&_ttff_metrics, 0, sizeof(_ttff_metrics));
+    _adaptive = false;
+    _cmd_index = -1;
+    _cmd_pending = false;
+    _cmd_name[0] = '\0';
+    memset(_latency_hist, 0, sizeof(_latency_hist));
+    _config_state = CONFIG_UNKNOWN;
+    _config_dirty = false;
+    _edrx_chosen = false;
+    _attach_state = ATTACH_IDLE;
+    _attach_timer = 0;
+    for (int i = 0; i < SOCKET_COUNT; i++)
+    {
+        _sockets[i].open = false;
+        _sockets[i].connected = false;
+    }
+    _sockets_ready = false;
+    _mqtt_connected = false;
+    _mqtt_msgid = 0;
+    _mqtt_rx_pending = 0;
+    _mqtt_rx_scheduled = false;
+    _mqtt_acked = 0;
+    _mqtt_failed = 0;
+    _mqtt_first_id = 0;
+    _mqtt_last_id = 0;
+    _nidd_open = false;
+    _nidd_scheduled = false;
+    _ssl_enabled = false;
+    _http_keep_alive = false;
+    memset(&_ssl_metrics, 0, sizeof(_ssl_metrics));
+    _attach_tries = 0;
+    _attach_radio = false;
+    memset(&_attach_metrics, 0, sizeof(_attach_metrics));
+    memset(&_config, 0, sizeof(_config));
+#if QUECTEL_BG77_STATS
+    _stats_slot = AT_COMMANDS;
+    _stats_failed = false;
+    memset(_cmd_stats, 0, sizeof(_cmd_stats));
+    memset(_span_stats, 0, sizeof(_span_stats));
+#endif
+    memset(_urc_payload, 0, sizeof(_urc_payload));
+
+	_parser = new ATCmdParser(_fh);
+	_parser->set_delimiter("\r");
+	_set_timeout(DEFAULT_TIMEOUT); 
+    _parser->flush();
+
+    _urc_thread.start(callback(&_urc_queue, &EventQueue::dispatch_forever));
+    _work_thread.start(callback(&_work_queue, &EventQueue::dispatch_forever));
+    _fh->sigio(callback(this, &QUECTEL_BG77::_sigio));
+}
+
 void QUECTEL_BG77::_modem_on()
 {
     mutex_lock();
-    _parser->set_timeout(1000);
-    _parser->send("AT");
-	if (!_parser->recv("OK"))
+	if (_command("AT") != Q_SUCCESS)
 	{
         // Modem is not already on, so power key it
         _pwkey = 0;
@@ -48,320 +360,3198 @@ void QUECTEL_BG77::_modem_on()
     mutex_unlock();
 }
 
-void QUECTEL_BG77::mutex_lock()
+int QUECTEL_BG77::_find_command(const char *command)
 {
-    _smutex.lock();
-    _parser->flush();
+    static_assert(sizeof(at_timeouts) / sizeof(at_timeouts[0]) == AT_COMMANDS,
+                  "AT_COMMANDS must match the at_timeouts table");
+    int found = -1;
+    size_t found_len = 0;
+    for (int i = 0; i < AT_COMMANDS; i++)
+    {
+        size_t len = strlen(at_timeouts[i].command);
+        if (len <= found_len || strncmp(command, at_timeouts[i].command, len) != 0)
+        {
+            continue;
+        }
+        // command is at least len long here, so its next character can be read
+        char next = command[len];
+        if (!isalpha((unsigned char) next) && next != '+' && next != '&')
+        {
+            found = i;
+            found_len = len;
+        }
+    }
+    return found;
 }
 
-void QUECTEL_BG77::mutex_unlock()
+int QUECTEL_BG77::_command_timeout(int index)
 {
-	_smutex.unlock();
+    if (index < 0)
+    {
+        return DEFAULT_TIMEOUT;
+    }
+    uint32_t deadline = at_timeouts[index].max_ms;
+    if (_adaptive)
+    {
+        // Twice the 95th percentile of what was seen, never above the manual's maximum
+        const uint8_t *hist = _latency_hist[index];
+        int total = 0;
+        for (int b = 0; b < LATENCY_BUCKETS; b++)
+        {
+            total += hist[b];
+        }
+        if (total >= ADAPTIVE_MIN_SAMPLES)
+        {
+            int seen = 0;
+            uint32_t edge = LATENCY_BUCKET_MS;
+            for (int b = 0; b < LATENCY_BUCKETS - 1; b++, edge *= 2)
+            {
+                seen += hist[b];
+                if (seen * 100 >= total * 95)
+                {
+                    break;
+                }
+            }
+            uint32_t adaptive = 2 * edge;
+            if (adaptive < ADAPTIVE_MIN_MS)
+            {
+                adaptive = ADAPTIVE_MIN_MS;
+            }
+            if (adaptive < deadline)
+            {
+                deadline = adaptive;
+            }
+        }
+    }
+    return deadline;
 }
 
-int QUECTEL_BG77::at()
+void QUECTEL_BG77::_record_latency(int index, uint32_t elapsed_ms)
 {
-    int status = 0;
-    mutex_lock();
-	_parser->send("AT");
-	if (!_parser->recv("OK"))
-	{
-		status = Q_FAILURE;	
-	}
-    mutex_unlock();
-	return (status);
+    uint8_t *hist = _latency_hist[index];
+    int b = 0;
+    for (uint32_t edge = LATENCY_BUCKET_MS; b < LATENCY_BUCKETS - 1 && elapsed_ms >= edge; edge *= 2)
+    {
+        b++;
+    }
+    if (hist[b] == UINT8_MAX)
+    {
+        // Age the history so the deadline follows the network conditions of today
+        for (int i = 0; i < LATENCY_BUCKETS; i++)
+        {
+            hist[i] /= 2;
+        }
+    }
+    hist[b]++;
 }
 
-int QUECTEL_BG77::echo_te_off()
+#if QUECTEL_BG77_STATS
+QUECTEL_BG77::_span_timer::_span_timer(QUECTEL_BG77 *modem, span_t span) 
+                                :_modem(modem), _span(span), _start(Kernel::Clock::now())
 {
-    int status = 0;
-    mutex_lock();
-	_parser->send("ATE0"); 
-	if (!_parser->recv("OK"))
-	{
-		status = Q_FAILURE;
-	}
-    mutex_unlock();
-	return (status);
 }
 
-int QUECTEL_BG77::ping(const char *url)
+QUECTEL_BG77::_span_timer::~_span_timer()
 {
-    int status = 0;
-    mutex_lock();
-    _parser->send("AT+QPING=1,\"%s\",10,10",url); 
-    mutex_unlock();
-	return (status);
+    uint32_t elapsed_ms = (Kernel::Clock::now() - _start).count();
+    span_stats &stats = _modem->_span_stats[_span];
+    stats.count++;
+    stats.total_ms += elapsed_ms;
+    if (elapsed_ms > stats.max_ms)
+    {
+        stats.max_ms = elapsed_ms;
+    }
 }
 
-int QUECTEL_BG77::manufacturer_id()
+int QUECTEL_BG77::command_stats_count()
 {
-    int status = -1;
-    mutex_lock();
-	_parser->send("ATI");
-    mutex_unlock();
-	return (status);
+    return AT_COMMANDS + 1;
 }
 
-int QUECTEL_BG77::firmware_ver()
-{   
-    int status = 0;
-    mutex_lock();
-	_parser->send("AT+GMR");
-    if (_parser->scanf("BG77LAR02A02") 
-        && _parser->recv("OK"))
-    {
-        status = 2;
-    }
-    _parser->send("AT+GMR");
-    if (_parser->recv("BG77LAR02A04") 
-        && _parser->recv("OK"))
+const char *QUECTEL_BG77::get_command_stats(int index, command_stats &stats)
+{
+    if (index < 0 || index > AT_COMMANDS)
     {
-        status = 1;
+        return nullptr;
     }
+    mutex_lock();
+    stats = _cmd_stats[index];
     mutex_unlock();
-	return status;
+    return (index < AT_COMMANDS) ? at_timeouts[index].command : "other";
 }
 
-int QUECTEL_BG77::update_firmware(const char *url_bin_file)
+void QUECTEL_BG77::get_span_stats(span_t span, span_stats &stats)
 {
     mutex_lock();
-    int error_code = -1;
-	_parser->send("AT+QFOTADL=%s", url_bin_file);
-    while(!_parser->recv("+QIND: \"FOTA\",\"END\",%d",error_code))
-    {
-        if(error_code == 0) //todo: works?
-        {
-            break;
-        }
-        _parser->flush();
-    }
+    stats = _span_stats[span];
     mutex_unlock();
-    return (0);
 }
 
-
-int QUECTEL_BG77::cfun(int mode)
+void QUECTEL_BG77::reset_stats()
 {
-    int status = 0;
     mutex_lock();
-	_parser->send("AT+CFUN=%d,0", mode);
-	if (!_parser->recv("OK"))
-	{
-		status = Q_FAILURE;	
-	}
+    memset(_cmd_stats, 0, sizeof(_cmd_stats));
+    memset(_span_stats, 0, sizeof(_span_stats));
     mutex_unlock();
-	return (status);
 }
 
+/** Append little endian integers to the dump
+ */
+static uint8_t *put_u16(uint8_t *p, uint16_t v)
+{
+    p[0] = v;
+    p[1] = v >> 8;
+    return p + 2;
+}
 
-int QUECTEL_BG77::band_config()
+static uint8_t *put_u32(uint8_t *p, uint32_t v)
 {
-    int  status = Q_SUCCESS;
-    mutex_lock();
-    _parser->send("AT+QCFG=\"band\",0,0,0x80000"); //band 20 we can have 
-    if(!_parser->recv("OK"))
+    p[0] = v;
+    p[1] = v >> 8;
+    p[2] = v >> 16;
+    p[3] = v >> 24;
+    return p + 4;
+}
+
+size_t QUECTEL_BG77::dump_stats(uint8_t *buffer, size_t len)
+{
+    const size_t header = 6;
+    const size_t per_command = 6 * 4 + LATENCY_BUCKETS * 2;
+    const size_t per_span = 3 * 4;
+    size_t needed = header + (AT_COMMANDS + 1) * per_command + SPAN_COUNT * per_span;
+    if (buffer == nullptr || len < needed)
     {
-        mutex_unlock();
-        status = Q_FAILURE;
+        return needed;
     }
 
-    _parser->send("AT+QCFG=\"nb1/bandprior\",14"); //band 20
-    if(!_parser->recv("OK"))
+    mutex_lock();
+    uint8_t *p = buffer;
+    *p++ = 'B';
+    *p++ = '7';
+    *p++ = 1;                       // format version
+    *p++ = AT_COMMANDS + 1;
+    *p++ = LATENCY_BUCKETS;
+    *p++ = SPAN_COUNT;
+    for (int i = 0; i <= AT_COMMANDS; i++)
     {
-        mutex_unlock();
-         status = Q_FAILURE;
+        const command_stats &stats = _cmd_stats[i];
+        p = put_u32(p, stats.calls);
+        p = put_u32(p, stats.ok);
+        p = put_u32(p, stats.failed);
+        p = put_u32(p, stats.retries);
+        p = put_u32(p, stats.bytes_sent);
+        p = put_u32(p, stats.bytes_received);
+        for (int b = 0; b < LATENCY_BUCKETS; b++)
+        {
+            p = put_u16(p, stats.latency_hist[b]);
+        }
     }
-
-    _parser->send("AT+QCFG=\"iotopmode\",1,1"); //configure network to be searched/ nbiot, take effect immediately
-    if(!_parser->recv("OK"))
+    for (int i = 0; i < SPAN_COUNT; i++)
     {
-        mutex_unlock();
-        status = Q_FAILURE;
+        p = put_u32(p, _span_stats[i].count);
+        p = put_u32(p, _span_stats[i].total_ms);
+        p = put_u32(p, _span_stats[i].max_ms);
     }
-
     mutex_unlock();
-    return Q_SUCCESS;
+    return p - buffer;
 }
+#endif
 
-int QUECTEL_BG77::scan_sequence(int scanseq)
+void QUECTEL_BG77::set_adaptive_timeouts(bool enable)
 {
-    int status = 0;
     mutex_lock();
-    _parser->send("AT+QCFG=\"nwscanseq\",0%d,1",scanseq);
-    //rtos::ThisThread::sleep_for(300ms);
-    if(!_parser->recv("OK"))
-    {
-        status = Q_FAILURE;
-    }
+    _adaptive = enable;
     mutex_unlock();
-    return (status);
 }
 
-int QUECTEL_BG77::qcfg_configuration(const char *instruction, int scanmode)
+void QUECTEL_BG77::_begin_command(const char *command, int timeout_ms, size_t len)
 {
-    int status = 0;
-    mutex_lock();
-    _parser->send("(AT+QCFG=\"%s\",%d,1)",instruction, scanmode);
-    if(!_parser->recv("OK"))
+    _cmd_index = _find_command(command);
+    _cmd_pending = true;
+    // "AT+CEREG?" answers with "+CEREG: ", the name ends at the first character no name has
+    size_t name_len = 0;
+    const char *name = (strncmp(command, "AT", 2) == 0) ? command + 2 : command;
+    while (name_len + 1 < sizeof(_cmd_name) && (isalnum((uint8_t) name[name_len]) || name[name_len] == '+'))
     {
-        status = -1;
+        _cmd_name[name_len] = name[name_len];
+        name_len++;
     }
-    mutex_unlock();
-    return (status);
+    _cmd_name[name_len] = '\0';
+    _set_timeout((timeout_ms > 0) ? timeout_ms : _command_timeout(_cmd_index));
+    _cmd_sent = Kernel::Clock::now();
+
+#if QUECTEL_BG77_STATS
+    int slot = (_cmd_index >= 0) ? _cmd_index : AT_COMMANDS;
+    command_stats &stats = _cmd_stats[slot];
+    stats.calls++;
+    stats.bytes_sent += len + 1;
+    if (slot == _stats_slot && _stats_failed)
+    {
+        stats.retries++;
+    }
+    _stats_slot = slot;
+#endif
 }
 
-int QUECTEL_BG77::reset_band_config()
+bool QUECTEL_BG77::_vsend(const char *command, va_list args)
 {
-    int status = 0;
-    mutex_lock();
-    _parser->send("AT&F0");
-    //rtos::ThisThread::sleep_for(300ms);
-	if (!_parser->recv("OK"))
-	{
-		status = Q_FAILURE;	
-	}
-    mutex_unlock();
-	return (status);
+    size_t len = 0;
+#if QUECTEL_BG77_STATS
+    va_list length_args;
+    va_copy(length_args, args);
+    len = vsnprintf(nullptr, 0, command, length_args);
+    va_end(length_args);
+#endif
+    _begin_command(command, 0, len);
+    return _parser->vsend(command, args);
 }
 
-int QUECTEL_BG77::creg()
+bool QUECTEL_BG77::_send_line(const char *line, int timeout_ms)
 {
-    int status = 0;
-    mutex_lock();
-    _parser->send("AT+CEREG?");
-    if (!_parser->recv("+CEREG: 0,5"))
+    _begin_command(line, timeout_ms, strlen(line));
+    return _parser->send("%s", line);
+}
+
+/** FNV-1a of a command line, 0 is kept for "not known"
+ */
+static uint32_t config_hash(const char *line)
+{
+    uint32_t hash = 2166136261u;
+    for (; *line; line++)
     {
-        //ThisThread::sleep_for(1s);
-        _parser->send("AT+CEREG=1");
-        if (!_parser->recv("OK"))
-        {
-            return Q_FAILURE;
-        }
+        hash = (hash ^ (uint8_t) *line) * 16777619u;
     }
-    mutex_unlock();
-    return (status);
+    return hash ? hash : 1;
 }
 
-int QUECTEL_BG77::csq(const char *apn)
+/** FNV-1a of a block of data, files uploaded to UFS, 0 is kept for "not known"
+ */
+static uint32_t config_hash_bytes(const char *data, size_t len)
 {
-    int status = 0;
-    int cereg_n = -1;
-    int ceregStatus = -1;
-    mutex_lock();
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ (uint8_t) data[i]) * 16777619u;
+    }
+    return hash ? hash : 1;
+}
 
-    //configure PDP context with QICSGP (vodafone APN)
-    _parser->send("AT+QICSGP=1,1,\"%s\"",apn);
-    //rtos::ThisThread::sleep_for(300ms);
-    if (!_parser->recv("OK"))
+void QUECTEL_BG77::_config_load()
+{
+    char    line[LINE_LEN];
+    char    imei[sizeof(_config.imei)] = "";
+    char    firmware[sizeof(_config.firmware)] = "";
+    size_t  actual = 0;
+
+    _config_state = CONFIG_INVALID;
+    _config_dirty = false;
+    if (kv_get(CONFIG_KEY, &_config, sizeof(_config), &actual) != MBED_SUCCESS 
+        || actual != sizeof(_config) || _config.version != CONFIG_VERSION)
     {
-        mutex_unlock();
-        status = Q_FAILURE;
+        memset(&_config, 0, sizeof(_config));
+        _config.version = CONFIG_VERSION;
     }
-    
-    activate_pdp();
-    _parser->set_timeout(5000);
-    for (int i = 0; i < 5; i++)
+
+    // One query for both halves of the key: the IMEI line, then the revision line
+    _send_line("AT+CGSN;+GMR", 0);
+    Kernel::Clock::time_point deadline = Kernel::Clock::now() + std::chrono::milliseconds(_timeout);
+    while (Kernel::Clock::now() < deadline)
     {
-        status = 0;
-        _parser->send("AT+QCSQ");
-        if (!(_parser->recv("+QCSQ: \"NBIoT\"") && _parser->recv("OK")))
+        _parser->set_timeout((deadline - Kernel::Clock::now()).count());
+        if (_read_line(line, sizeof(line)) < 0 || strcmp(line, "ERROR") == 0)
         {
-            continue;
-            status = -1;	
+            break;
         }
-        status = qnwinfo();
-        status = creg();
-        if (status == 0)
+        if (strcmp(line, "OK") == 0)
         {
+            _config_state = CONFIG_VALID;
             break;
         }
+        if (strlen(line) == 15 && strspn(line, "0123456789") == 15)
+        {
+            strcpy(imei, line);
+        }
+        else if (strncmp(line, "BG77", 4) == 0)
+        {
+            strncpy(firmware, line, sizeof(firmware) - 1);
+        }
+        else
+        {
+            _dispatch_urc(line);
+        }
     }
+    _parser->set_timeout(_timeout);
+    _end_command(_config_state == CONFIG_VALID ? AT_OK : AT_ERROR);
 
-    mutex_unlock();
-    return (status);
+    if (_config_state != CONFIG_VALID || imei[0] == '\0' || firmware[0] == '\0')
+    {
+        // Without the identity nothing can be trusted, write everything
+        _config_state = CONFIG_INVALID;
+        return;
+    }
+    if (strcmp(imei, _config.imei) != 0 || strcmp(firmware, _config.firmware) != 0)
+    {
+        // Another module or another firmware, what it has stored is unknown
+        memset(_config.applied, 0, sizeof(_config.applied));
+        strcpy(_config.imei, imei);
+        strcpy(_config.firmware, firmware);
+        _config_dirty = true;
+    }
 }
 
-
-int QUECTEL_BG77::qnwinfo()
+bool QUECTEL_BG77::_config_cached(uint8_t item, const char *line)
 {
-    mutex_lock();
-    int status = 0;
-    _parser->send("AT+QNWINFO");
-    if (!(_parser->recv("+QNWINFO: \"NBIoT\"") && _parser->recv("OK")))
+    if (item == CFG_NONE || item >= CFG_COUNT)
     {
-        status = Q_FAILURE;	
+        return false;
     }
-    mutex_unlock();
-    return (status);
+    if (_config_state == CONFIG_UNKNOWN)
+    {
+        _config_load();
+    }
+    return (_config_state == CONFIG_VALID && _config.applied[item] == config_hash(line));
 }
 
-/* Note: the IMEI can be used to identify ME
-*/
-int QUECTEL_BG77::imei()
+bool QUECTEL_BG77::_config_known(uint8_t item)
 {
-    int     status = 0;
-    char    imei[15+1];
-    int     str_size; 
-    mutex_lock();
-	_parser->send("AT+CGSN");
-    if (_parser->recv("%15[^\n]\nOK\n", imei))
+    if (item == CFG_NONE || item >= CFG_COUNT)
     {
-        status = Q_FAILURE;
+        return false;
     }
-    mutex_unlock();
-	return (status);
+    if (_config_state == CONFIG_UNKNOWN)
+    {
+        _config_load();
+    }
+    return (_config_state == CONFIG_VALID && _config.applied[item] != 0);
 }
 
-int QUECTEL_BG77::imsi()
+void QUECTEL_BG77::_config_applied(uint8_t item, const char *line)
 {
-    int     status = 0;
-    char    imsi[16]; //type string without double quotes
-    mutex_lock();
-	_parser->send("AT+CIMI");
-    if (_parser->recv("%15[^\n]\nOK\n", imsi))
+    if (item == CFG_NONE || item >= CFG_COUNT || _config_state != CONFIG_VALID)
     {
-        status = Q_FAILURE;
+        return;
+    }
+    uint32_t hash = config_hash(line);
+    if (_config.applied[item] != hash)
+    {
+        _config.applied[item] = hash;
+        _config_dirty = true;
     }
-    mutex_unlock();
-	return (status);
 }
 
-int QUECTEL_BG77::query_sim()
+void QUECTEL_BG77::_config_save()
+{
+    if (_config_dirty && _config_state == CONFIG_VALID)
+    {
+        kv_set(CONFIG_KEY, &_config, sizeof(_config), 0);
+        _config_dirty = false;
+    }
+}
+
+int QUECTEL_BG77::_config_command(config_t item, const char *command, ...)
+{
+    char line[SEQUENCE_LINE_LEN];
+    va_list args;
+    va_start(args, command);
+    vsnprintf(line, sizeof(line), command, args);
+    va_end(args);
+
+    if (_config_cached(item, line))
+    {
+        return Q_SUCCESS;
+    }
+    at_response resp;
+    if (!_send_line(line, 0) || _match(resp) != AT_OK)
+    {
+        return Q_FAILURE;
+    }
+    _config_applied(item, line);
+    _config_save();
+    return Q_SUCCESS;
+}
+
+void QUECTEL_BG77::invalidate_config_cache()
+{
+    mutex_lock();
+    memset(_config.applied, 0, sizeof(_config.applied));
+    _config_dirty = false;
+    _config_state = CONFIG_UNKNOWN;
+    kv_remove(CONFIG_KEY);
+    mutex_unlock();
+}
+
+int QUECTEL_BG77::_run_step(const at_step &step)
+{
+    at_response resp;
+    int count = step.expect ? 1 : 0;
+    if (!_send_line(step.command, step.timeout_ms) 
+        || _match(resp, &step.expect, count) != AT_OK 
+        || (step.expect && resp.match != 0))
+    {
+        return Q_FAILURE;
+    }
+    _config_applied(step.config, step.command);
+    return Q_SUCCESS;
+}
+
+int QUECTEL_BG77::run_sequence(const at_step *steps, size_t count, int *results)
+{
+    int     status = Q_SUCCESS;
+    size_t  unchained = 0;
+    char    line[SEQUENCE_LINE_LEN];
+
+    mutex_lock();
+    size_t i = 0;
+    while (i < count)
+    {
+        // The module already holds this setting
+        if (_config_cached(steps[i].config, steps[i].command))
+        {
+            if (results)
+            {
+                results[i] = Q_SUCCESS;
+            }
+            i++;
+            continue;
+        }
+
+        // Put as many of the following plain OK steps on one line as fit
+        size_t end = i;
+        size_t len = 0;
+        int timeout_ms = 0;
+        while (i >= unchained && end < count && steps[end].chain && steps[end].expect == nullptr)
+        {
+            if (end > i && _config_cached(steps[end].config, steps[end].command))
+            {
+                break;
+            }
+            // Only the first command keeps its "AT"
+            const char *command = steps[end].command + ((end > i) ? 2 : 0);
+            size_t command_len = strlen(command);
+            if (len + command_len + 2 > sizeof(line))
+            {
+                break;
+            }
+            if (end > i)
+            {
+                line[len++] = ';';
+            }
+            memcpy(line + len, command, command_len);
+            len += command_len;
+            timeout_ms += (steps[end].timeout_ms > 0) ? steps[end].timeout_ms 
+                                                      : _command_timeout(_find_command(steps[end].command));
+            end++;
+        }
+        line[len] = '\0';
+
+        if (end - i >= 2)
+        {
+            at_response resp;
+            if (_send_line(line, timeout_ms) && _match(resp) == AT_OK)
+            {
+                for (; i < end; i++)
+                {
+                    _config_applied(steps[i].config, steps[i].command);
+                    if (results)
+                    {
+                        results[i] = Q_SUCCESS;
+                    }
+                }
+                continue;
+            }
+            // The module stops at the failing command, run them one by one to find it
+            unchained = end;
+        }
+
+        int result = _run_step(steps[i]);
+        if (results)
+        {
+            results[i] = result;
+        }
+        i++;
+        if (result != Q_SUCCESS)
+        {
+            status = Q_FAILURE;
+            if (steps[i - 1].policy == STEP_STOP)
+            {
+                break;
+            }
+        }
+    }
+    for (; results && i < count; i++)
+    {
+        results[i] = Q_FAILURE;
+    }
+    _config_save();
+    mutex_unlock();
+    return (status);
+}
+
+void QUECTEL_BG77::_end_command(int result)
+{
+    uint32_t elapsed_ms = (Kernel::Clock::now() - _cmd_sent).count();
+    if (_cmd_index >= 0)
+    {
+        _record_latency(_cmd_index, elapsed_ms);
+    }
+
+#if QUECTEL_BG77_STATS
+    static_assert(sizeof(command_stats::latency_hist) / sizeof(uint16_t) == LATENCY_BUCKETS,
+                  "command_stats buckets must match LATENCY_BUCKETS");
+    command_stats &stats = _cmd_stats[_stats_slot];
+    _stats_failed = (result != AT_OK && result != AT_CONNECT);
+    if (_stats_failed)
+    {
+        stats.failed++;
+    }
+    else
+    {
+        stats.ok++;
+    }
+    int b = 0;
+    for (uint32_t edge = LATENCY_BUCKET_MS; b < LATENCY_BUCKETS - 1 && elapsed_ms >= edge; edge *= 2)
+    {
+        b++;
+    }
+    if (stats.latency_hist[b] < UINT16_MAX)
+    {
+        stats.latency_hist[b]++;
+    }
+#endif
+
+    _cmd_pending = false;
+}
+
+bool QUECTEL_BG77::_write(const void *data, size_t len)
+{
+#if QUECTEL_BG77_STATS
+    _cmd_stats[_stats_slot].bytes_sent += len;
+#endif
+    return _parser->write((const char *) data, len) == (int) len;
+}
+
+int QUECTEL_BG77::_getc()
+{
+    int c = _parser->getc();
+#if QUECTEL_BG77_STATS
+    if (c >= 0)
+    {
+        _cmd_stats[_stats_slot].bytes_received++;
+    }
+#endif
+    return c;
+}
+
+bool QUECTEL_BG77::_send(const char *command, ...)
+{
+    va_list args;
+    va_start(args, command);
+    bool sent = _vsend(command, args);
+    va_end(args);
+    return sent;
+}
+
+int QUECTEL_BG77::_command(const char *command, ...)
+{
+    at_response resp;
+    va_list args;
+    va_start(args, command);
+    bool sent = _vsend(command, args);
+    va_end(args);
+    if (!sent || _match(resp) != AT_OK)
+    {
+        return Q_FAILURE;
+    }
+    return Q_SUCCESS;
+}
+
+int QUECTEL_BG77::_match(at_response &resp, const char *const *patterns, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    int result = _vmatch(resp, patterns, count, nullptr, &args);
+    va_end(args);
+    return result;
+}
+
+int QUECTEL_BG77::_match_lines(at_response &resp, const char *const *prefixes, int count, char (*lines)[LINE_LEN])
+{
+    for (int i = 0; i < count; i++)
+    {
+        lines[i][0] = '\0';
+    }
+    return _vmatch(resp, prefixes, count, lines, nullptr);
+}
+
+int QUECTEL_BG77::_vmatch(at_response &resp, const char *const *patterns, int count, char (*lines)[LINE_LEN], 
+                          va_list *args)
+{
+    char line[LINE_LEN];
+    resp.result = AT_TIMEOUT;
+    resp.match = -1;
+    resp.fields = 0;
+    resp.cme_error = 0;
+    resp.line[0] = '\0';
+
+    Kernel::Clock::time_point deadline = _cmd_sent + std::chrono::milliseconds(_timeout);
+    if (!_cmd_pending)
+    {
+        deadline = Kernel::Clock::now() + std::chrono::milliseconds(_timeout);
+    }
+    while (true)
+    {
+        Kernel::Clock::duration left = deadline - Kernel::Clock::now();
+        if (left <= 0ms)
+        {
+            break;
+        }
+        _parser->set_timeout(left.count());
+        int len = _read_line(line, sizeof(line));
+        if (len < 0)
+        {
+            break;
+        }
+        if (len == 0)
+        {
+            continue;
+        }
+
+        // Replies to a chained query, each prefix keeps its own line
+        if (lines != nullptr)
+        {
+            int i = 0;
+            while (i < count && !(lines[i][0] == '\0' && strncmp(line, patterns[i], strlen(patterns[i])) == 0))
+            {
+                i++;
+            }
+            if (i < count)
+            {
+                strcpy(lines[i], line);
+                if (resp.match < 0)
+                {
+                    resp.match = i;
+                }
+                continue;
+            }
+        }
+        // Information response, first match wins
+        else if (resp.match < 0)
+        {
+            for (int i = 0; i < count; i++)
+            {
+                const char *conversion = strchr(patterns[i], '%');
+                size_t prefix_len = conversion ? (size_t)(conversion - patterns[i]) : strlen(patterns[i]);
+                if (strncmp(line, patterns[i], prefix_len) != 0)
+                {
+                    continue;
+                }
+                va_list fields;
+                va_copy(fields, *args);
+                int converted = vsscanf(line, patterns[i], fields);
+                va_end(fields);
+                // A pattern without literal prefix has to convert something to count as a match
+                if (prefix_len == 0 && converted < 1)
+                {
+                    continue;
+                }
+                resp.match = i;
+                resp.fields = (converted > 0) ? converted : 0;
+                strcpy(resp.line, line);
+                break;
+            }
+            if (resp.match >= 0)
+            {
+                continue;
+            }
+        }
+
+        // Final result codes
+        if (strcmp(line, "OK") == 0)
+        {
+            resp.result = AT_OK;
+            break;
+        }
+        if (strncmp(line, "CONNECT", 7) == 0)
+        {
+            resp.result = AT_CONNECT;
+            break;
+        }
+        if (strcmp(line, "ERROR") == 0 || strcmp(line, "SEND FAIL") == 0)
+        {
+            resp.result = AT_ERROR;
+            break;
+        }
+        // AT+QISEND ends with its own result codes
+        if (strcmp(line, "SEND OK") == 0)
+        {
+            resp.result = AT_OK;
+            break;
+        }
+        if (sscanf(line, "+CME ERROR: %d", &resp.cme_error) == 1 
+            || sscanf(line, "+CMS ERROR: %d", &resp.cme_error) == 1)
+        {
+            resp.result = AT_CME_ERROR;
+            break;
+        }
+
+        // Anything else is an URC or the echo of the command
+        _dispatch_urc(line);
+    }
+    _parser->set_timeout(_timeout);
+
+    if (_cmd_pending)
+    {
+        // Only the response to the command itself, not data phases after CONNECT
+        _end_command(resp.result);
+    }
+    return resp.result;
+}
+
+void QUECTEL_BG77::mutex_lock()
+{
+    _smutex.lock();
+    if (_lock_depth++ == 0)
+    {
+        // Nothing is in flight, so whatever is waiting is either an URC or a stale response
+        _process_urcs();
+    }
+}
+
+void QUECTEL_BG77::mutex_unlock()
+{
+    _lock_depth--;
+	_smutex.unlock();
+}
+
+void QUECTEL_BG77::attach_urc(urc_t type, Callback<void(const char *)> handler)
+{
+    mutex_lock();
+    _urc_handlers[type] = handler;
+    mutex_unlock();
+}
+
+void QUECTEL_BG77::_set_timeout(int timeout_ms)
+{
+    _timeout = timeout_ms;
+    _parser->set_timeout(timeout_ms);
+}
+
+int QUECTEL_BG77::_read_line(char *line, size_t len)
+{
+    size_t i = 0;
+    while (true)
+    {
+        int c = _getc();
+        if (c < 0)
+        {
+            line[i] = '\0';
+            return -1;
+        }
+        if (c == '\r')
+        {
+            continue;
+        }
+        if (c == '\n')
+        {
+            line[i] = '\0';
+            return i;
+        }
+        if (i + 1 < len)
+        {
+            line[i++] = c;
+        }
+    }
+}
+
+bool QUECTEL_BG77::_dispatch_urc(const char *line)
+{
+    for (size_t i = 0; i < sizeof(urc_table) / sizeof(urc_table[0]); i++)
+    {
+        size_t prefix_len = strlen(urc_table[i].prefix);
+        if (strncmp(line, urc_table[i].prefix, prefix_len) == 0)
+        {
+            const char *payload = line + prefix_len;
+            while (*payload == ' ')
+            {
+                payload++;
+            }
+            size_t name_len = strlen(_cmd_name);
+            bool solicited = _cmd_pending && name_len > 1 && strncmp(line, _cmd_name, name_len) == 0 
+                             && line[name_len] == ':';
+            _handle_urc(urc_table[i].type, payload, solicited);
+            return true;
+        }
+    }
+    return false;
+}
+
+void QUECTEL_BG77::_handle_urc(urc_t type, const char *payload, bool solicited)
+{
+    strncpy(_urc_payload[type], payload, LINE_LEN - 1);
+    _urc_payload[type][LINE_LEN - 1] = '\0';
+    _urc_flags.set(1UL << type);
+    if (type == URC_RDY)
+    {
+        // The module booted with its default priority
+        _rf_owner = -1;
+    }
+    if (type == URC_CTZE || type == URC_CTZV)
+    {
+        // NITZ set the module clock, AT+CCLK? is good for a while
+        _time_tz = atoi(payload + (*payload == '"')) * 15;
+        _nitz_at = Kernel::Clock::now();
+        _nitz_seen = true;
+    }
+    if ((type == URC_CPIN || type == URC_CEREG) && !solicited && _attach_timer != 0)
+    {
+        // The attach is waiting for exactly this, advance it now rather than at its next poll
+        _work_queue.cancel(_attach_timer);
+        _attach_timer = _work_queue.call(this, &QUECTEL_BG77::_attach_step);
+    }
+    if (type == URC_QIURC)
+    {
+        // "recv",<id> / "closed",<id> / "pdpdeact",<contextID>
+        int id = -1;
+        const char *comma = strchr(payload, ',');
+        if (comma != nullptr)
+        {
+            id = atoi(comma + 1);
+        }
+        if (strncmp(payload, "\"pdpdeact\"", 10) == 0)
+        {
+            for (int i = 0; i < SOCKET_COUNT; i++)
+            {
+                _sockets[i].connected = false;
+                if (_sockets[i].open && _sockets[i].event)
+                {
+                    _sockets[i].event();
+                }
+            }
+        }
+        else if (id >= 0 && id < SOCKET_COUNT && _sockets[id].open)
+        {
+            if (strncmp(payload, "\"closed\"", 8) == 0)
+            {
+                _sockets[id].connected = false;
+            }
+            if (_sockets[id].event)
+            {
+                _sockets[id].event();
+            }
+        }
+    }
+    if (type == URC_QMTPUB)
+    {
+        // <client_idx>,<msgID>,<result>: 0 acknowledged, 1 retransmitted, 2 failed
+        int msgid = -1;
+        int result = -1;
+        // QoS 0 messages all have ID 0
+        if (sscanf(payload, "%*d,%d,%d", &msgid, &result) == 2 
+            && (msgid == 0 || (msgid >= _mqtt_first_id && msgid <= _mqtt_last_id)))
+        {
+            if (result == 0)
+            {
+                _mqtt_acked++;
+            }
+            else if (result == 2)
+            {
+                _mqtt_failed++;
+            }
+        }
+    }
+    if (type == URC_QMTRECV)
+    {
+        // <client_idx>,<recv_id>: a message is waiting in that buffer
+        int buffer = -1;
+        if (sscanf(payload, "%*d,%d", &buffer) == 1 && buffer >= 0 && buffer < 32)
+        {
+            _mqtt_rx_pending |= 1UL << buffer;
+            if (!_mqtt_rx_scheduled)
+            {
+                _mqtt_rx_scheduled = true;
+                _work_queue.call(this, &QUECTEL_BG77::_mqtt_deliver);
+            }
+        }
+    }
+    if (type == URC_QIND && strncmp(payload, "\"nipd", 5) == 0 && _nidd_open && !_nidd_scheduled)
+    {
+        // Downlink data is waiting, it is read outside of whatever command is in flight
+        _nidd_scheduled = true;
+        _work_queue.call(this, &QUECTEL_BG77::_nidd_deliver);
+    }
+    if (type == URC_QMTSTAT)
+    {
+        _mqtt_connected = false;
+        if (_mqtt_status)
+        {
+            int err = -1;
+            sscanf(payload, "%*d,%d", &err);
+            _mqtt_status(err);
+        }
+    }
+    if (_urc_handlers[type])
+    {
+        _urc_handlers[type](_urc_payload[type]);
+    }
+}
+
+bool QUECTEL_BG77::_prompt()
+{
+    char line[LINE_LEN];
+    size_t i = 0;
+    int c;
+    while ((c = _getc()) >= 0)
+    {
+        if (c == '>' && i == 0)
+        {
+            // The prompt is "> " with no line end
+            _getc();
+            return true;
+        }
+        if (c == '\r')
+        {
+            continue;
+        }
+        if (c != '\n')
+        {
+            if (i + 1 < sizeof(line))
+            {
+                line[i++] = c;
+            }
+            continue;
+        }
+        line[i] = '\0';
+        i = 0;
+        if (strcmp(line, "ERROR") == 0 || strncmp(line, "+CME ERROR:", 11) == 0)
+        {
+            break;
+        }
+        _dispatch_urc(line);
+    }
+    _end_command(AT_ERROR);
+    return false;
+}
+
+void QUECTEL_BG77::_process_urcs()
+{
+    char line[LINE_LEN];
+    _parser->set_timeout(URC_IDLE_TIMEOUT);
+    while (_fh->readable())
+    {
+        if (_read_line(line, sizeof(line)) > 0)
+        {
+            _dispatch_urc(line);
+        }
+    }
+    _parser->set_timeout(_timeout);
+}
+
+void QUECTEL_BG77::_arm_urc(urc_t type)
+{
+    _urc_flags.clear(1UL << type);
+}
+
+bool QUECTEL_BG77::_wait_urc(urc_t type, int timeout_ms)
+{
+    char line[LINE_LEN];
+    bool arrived = true;
+    Kernel::Clock::time_point deadline = Kernel::Clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (!(_urc_flags.get() & (1UL << type)))
+    {
+        Kernel::Clock::duration left = deadline - Kernel::Clock::now();
+        if (left <= 0ms)
+        {
+            arrived = false;
+            break;
+        }
+        _parser->set_timeout(left.count());
+        if (_read_line(line, sizeof(line)) > 0)
+        {
+            _dispatch_urc(line);
+        }
+    }
+    _parser->set_timeout(_timeout);
+    return arrived;
+}
+
+void QUECTEL_BG77::_sigio()
+{
+    if (!core_util_atomic_exchange_bool(&_urc_pending, true))
+    {
+        _urc_queue.call(this, &QUECTEL_BG77::_urc_event);
+    }
+}
+
+void QUECTEL_BG77::_urc_event()
+{
+    core_util_atomic_store_bool(&_urc_pending, false);
+    // Taking the lock drains the UART
+    mutex_lock();
+    mutex_unlock();
+}
+
+void QUECTEL_BG77::_gnss_open(FileHandle *fh)
+{
+    _gnss_fh = fh;
+    _gnss_fh->set_blocking(false);
+    _gnss_fh->sigio(callback(this, &QUECTEL_BG77::_gnss_sigio));
+}
+
+void QUECTEL_BG77::_gnss_sigio()
+{
+    if (!core_util_atomic_exchange_bool(&_gnss_pending, true))
+    {
+        _urc_queue.call(this, &QUECTEL_BG77::_gnss_event);
+    }
+}
+
+void QUECTEL_BG77::_gnss_event()
+{
+    char buffer[64];
+    ssize_t got;
+    // Cleared first, bytes that come while draining schedule the next event
+    core_util_atomic_store_bool(&_gnss_pending, false);
+    // The parser is only touched from this thread, a reset asked for by gnss_start() included
+    if (core_util_atomic_exchange_bool(&_nmea_reset, false))
+    {
+        _nmea.reset();
+    }
+    while ((got = _gnss_fh->read(buffer, sizeof(buffer))) > 0)
+    {
+        for (ssize_t i = 0; i < got; i++)
+        {
+            _nmea.feed(buffer[i]);
+        }
+    }
+}
+
+int QUECTEL_BG77::at()
+{
+    int status = 0;
+    mutex_lock();
+	status = _command("AT");
+    mutex_unlock();
+	return (status);
+}
+
+int QUECTEL_BG77::echo_te_off()
+{
+    int status = 0;
+    mutex_lock();
+	status = _command("ATE0"); 
+    mutex_unlock();
+	return (status);
+}
+
+int QUECTEL_BG77::ping(const char *url)
+{
+    int status = 0;
+    mutex_lock();
+    status = _command("AT+QPING=1,\"%s\",10,10",url); 
+    mutex_unlock();
+	return (status);
+}
+
+int QUECTEL_BG77::manufacturer_id()
+{
+    int status = -1;
+    mutex_lock();
+	status = _command("ATI");
+    mutex_unlock();
+	return (status);
+}
+
+int QUECTEL_BG77::firmware_ver()
+{   
+    static const char *const revisions[] = { "BG77LAR02A02", "BG77LAR02A04" };
+    int status = 0;
+    at_response resp;
+    mutex_lock();
+	_send("AT+GMR");
+    if (_match(resp, revisions, 2) == AT_OK)
+    {
+        status = (resp.match == 0) ? 2 : (resp.match == 1) ? 1 : 0;
+    }
+    mutex_unlock();
+	return status;
+}
+
+int QUECTEL_BG77::update_firmware(const char *url_bin_file)
+{
+    mutex_lock();
+    int error_code = -1;
+    _arm_urc(URC_QIND);
+	if (_command("AT+QFOTADL=%s", url_bin_file) == Q_SUCCESS)
+    {
+        // Progress is reported as +QIND: "FOTA",... URCs, wait for the final one
+        while (_wait_urc(URC_QIND, FOTA_TIMEOUT))
+        {
+            if (sscanf(_urc_payload[URC_QIND], "\"FOTA\",\"END\",%d", &error_code) == 1)
+            {
+                break;
+            }
+            _arm_urc(URC_QIND);
+        }
+    }
+    if (error_code == 0)
+    {
+        // New firmware, settings may have been migrated or reset
+        invalidate_config_cache();
+    }
+    mutex_unlock();
+    return (error_code == 0 ? Q_SUCCESS : Q_FAILURE);
+}
+
+
+int QUECTEL_BG77::cfun(int mode)
+{
+    int status = 0;
+    mutex_lock();
+	status = _command("AT+CFUN=%d,0", mode);
+    mutex_unlock();
+	return (status);
+}
+
+
+int QUECTEL_BG77::band_config()
+{
+    static const at_step steps[] =
+    {
+        { "AT+QCFG=\"band\",0,0,0x80000",    nullptr, 0, STEP_CONTINUE, true, CFG_BAND },         //band 20 we can have 
+        { "AT+QCFG=\"nb1/bandprior\",14",    nullptr, 0, STEP_CONTINUE, true, CFG_BANDPRIOR },    //band 20
+        { "AT+QCFG=\"iotopmode\",1,1",       nullptr, 0, STEP_CONTINUE, true, CFG_IOTOPMODE },    //configure network to be searched/ nbiot, take effect immediately
+    };
+    return run_sequence(steps, sizeof(steps) / sizeof(steps[0]));
+}
+
+int QUECTEL_BG77::scan_sequence(int scanseq)
+{
+    int status = 0;
+    mutex_lock();
+    status = _command("AT+QCFG=\"nwscanseq\",0%d,1",scanseq);
+    mutex_unlock();
+    return (status);
+}
+
+int QUECTEL_BG77::qcfg_configuration(const char *instruction, int scanmode)
+{
+    int status = 0;
+    mutex_lock();
+    status = _command("AT+QCFG=\"%s\",%d,1",instruction, scanmode);
+    mutex_unlock();
+    return (status);
+}
+
+int QUECTEL_BG77::reset_band_config()
+{
+    int status = 0;
+    mutex_lock();
+    status = _command("AT&F0");
+    // Factory defaults are back, whatever the shadow says
+    invalidate_config_cache();
+    mutex_unlock();
+	return (status);
+}
+
+int QUECTEL_BG77::creg()
+{
+    static const char *const cereg[] = { "+CEREG: %d,%d" };
+    int status = 0;
+    int n = -1;
+    int stat = -1;
+    at_response resp;
+    mutex_lock();
+    _send("AT+CEREG?");
+    // 1: registered home network, 5: registered roaming
+    if (!(_match(resp, cereg, 1, &n, &stat) == AT_OK && resp.fields == 2 && (stat == 1 || stat == 5)))
+    {
+        status = _command("AT+CEREG=1");
+    }
+    mutex_unlock();
+    return (status);
+}
+
+int QUECTEL_BG77::csq(const char *apn)
+{
+    BG77_SPAN(SPAN_CSQ);
+    static const char *const qcsq[] = { "+QCSQ: \"NBIoT\"" };
+    int status = 0;
+    at_response resp;
+    mutex_lock();
+
+    //configure PDP context with QICSGP (vodafone APN)
+    if (_config_command(CFG_APN, "AT+QICSGP=1,1,\"%s\"",apn) != Q_SUCCESS)
+    {
+        status = Q_FAILURE;
+    }
+    
+    activate_pdp();
+    for (int i = 0; i < 5; i++)
+    {
+        status = 0;
+        _send("AT+QCSQ");
+        if (!(_match(resp, qcsq, 1) == AT_OK && resp.match == 0))
+        {
+            status = Q_FAILURE;
+            continue;
+        }
+        status = qnwinfo();
+        status = creg();
+        if (status == 0)
+        {
+            break;
+        }
+    }
+
+    mutex_unlock();
+    return (status);
+}
+
+
+int QUECTEL_BG77::get_signal(signal_metrics &metrics)
+{
+    static const char *const qcsq[] = { "+QCSQ: \"%*[^\"]\",%d,%d,%d,%d" };
+    int status = 0;
+    at_response resp;
+    mutex_lock();
+    _send("AT+QCSQ");
+    if (!(_match(resp, qcsq, 1, &metrics.rssi, &metrics.rsrp, &metrics.sinr, &metrics.rsrq) == AT_OK 
+          && resp.fields == 4))
+    {
+        status = Q_FAILURE;
+    }
+    mutex_unlock();
+    return (status);
+}
+
+int QUECTEL_BG77::qnwinfo()
+{
+    static const char *const qnwinfo[] = { "+QNWINFO: \"NBIoT\"" };
+    int status = 0;
+    at_response resp;
+    mutex_lock();
+    _send("AT+QNWINFO");
+    if (!(_match(resp, qnwinfo, 1) == AT_OK && resp.match == 0))
+    {
+        status = Q_FAILURE;	
+    }
+    mutex_unlock();
+    return (status);
+}
+int QUECTEL_BG77::imei()
+{
+    static const char *const digits[] = { "%15[0-9]" };
+    int     status = 0;
+    char    imei[15+1];
+    at_response resp;
+    mutex_lock();
+	_send("AT+CGSN");
+    if (!(_match(resp, digits, 1, imei) == AT_OK && resp.match == 0))
+    {
+        status = Q_FAILURE;
+    }
+    mutex_unlock();
+	return (status);
+}
+
+int QUECTEL_BG77::imsi()
+{
+    static const char *const digits[] = { "%15[0-9]" };
+    int     status = 0;
+    char    imsi[16]; //type string without double quotes
+    at_response resp;
+    mutex_lock();
+	_send("AT+CIMI");
+    if (!(_match(resp, digits, 1, imsi) == AT_OK && resp.match == 0))
+    {
+        status = Q_FAILURE;
+    }
+    mutex_unlock();
+	return (status);
+}
+
+int QUECTEL_BG77::query_sim()
+{
+    static const char *const ready[] = { "+CPIN: READY" };
+    int status = 0;
+    at_response resp;
+    mutex_lock();
+    _send("AT+CPIN?");
+    if (!(_match(resp, ready, 1) == AT_OK && resp.match == 0))
+    {
+        status = Q_FAILURE;
+    }
+    mutex_unlock();
+	return (status);
+}
+
+int QUECTEL_BG77::enter_psm(int mode)
+{
+    char psm_enter[32];
+    sprintf(psm_enter, "AT+QCFG=\"psm/enter\",%d", mode);
+    at_step steps[4];
+    size_t count = 0;
+    mutex_lock();
+    steps[count++] = { "AT+QCFGEXT=\"attm2mfeat\"",   nullptr, 0, STEP_CONTINUE, true };
+    // The default eDRX goes through the shadow like set_edrx(), which it must not undo
+    if (!_edrx_chosen && !_config_known(CFG_EDRX))
+    {
+        steps[count++] = { "AT+CEDRXS=1,5,\"1111\"",  nullptr, 0, STEP_CONTINUE, true, CFG_EDRX };
+    }
+    steps[count++] = { psm_enter,                      nullptr, 0, STEP_CONTINUE, true };
+    steps[count++] = { "AT+QSCLK=1",                   nullptr, 0, STEP_CONTINUE, true };
+    int status = run_sequence(steps, count);
+    mutex_unlock();
+    return status;
+}
+
+int QUECTEL_BG77::disable_psm()
+{
+    int status = 0;
+    mutex_lock();
+    status = _config_command(CFG_PSM, "AT+CPSMS=0");
+    mutex_unlock();
+	return (status);
+}
+
+/** Binary string of the low bits of a value, as the timers of AT+CPSMS and AT+CEDRXS take them
+ */
+static char *bit_string(char *buffer, uint8_t value, int bits)
+{
+    for (int i = 0; i < bits; i++)
+    {
+        buffer[i] = (value & (1 << (bits - 1 - i))) ? '1' : '0';
+    }
+    buffer[bits] = '\0';
+    return buffer;
+}
+
+/** Value of the quoted binary string in a comma separated field of an information response
+    @param line. The response, e.g. +CEREG: 4,1,"1A2B","01A2B3C4",9,,,"00100100","01000111"
+    @param index. Field index, 0 is the first field after the ':'
+    @return the value, -1 if the field is missing or empty
+ */
+static int bit_field(const char *line, int index)
+{
+    const char *p = strchr(line, ':');
+    for (int i = 0; p != nullptr && i < index; i++)
+    {
+        p = strchr(p + 1, ',');
+    }
+    if (p == nullptr || *++p != '"' || p[1] < '0' || p[1] > '1')
+    {
+        return -1;
+    }
+    return (int)strtol(p + 1, nullptr, 2);
+}
+
+int QUECTEL_BG77::set_psm_timers(uint32_t tau_s, uint32_t active_s)
+{
+    char tau[9];
+    char active[9];
+    int status = 0;
+    mutex_lock();
+    status = _config_command(CFG_PSM, "AT+CPSMS=1,,,\"%s\",\"%s\"", 
+                             bit_string(tau, gprs_timer3(tau_s), 8), bit_string(active, gprs_timer2(active_s), 8));
+    mutex_unlock();
+    return (status);
+}
+
+int QUECTEL_BG77::set_edrx(act_t act, uint32_t cycle_ms, uint32_t window_ms)
+{
+    char cycle[5];
+    char ptw[5];
+    int status = 0;
+    mutex_lock();
+    bit_string(cycle, edrx_value(cycle_ms, act), 4);
+    if (window_ms == 0)
+    {
+        status = _config_command(CFG_EDRX, "AT+CEDRXS=1,%d,\"%s\"", act, cycle);
+    }
+    else
+    {
+        status = _config_command(CFG_EDRX, "AT+QEDRXCFG=1,%d,\"%s\",\"%s\"", act, cycle, 
+                                 bit_string(ptw, ptw_value(window_ms, act), 4));
+    }
+    if (status == Q_SUCCESS)
+    {
+        _edrx_chosen = true;
+    }
+    mutex_unlock();
+    return (status);
+}
+
+int QUECTEL_BG77::get_granted_timers(granted_timers &timers)
+{
+    static const char *const cereg[] = { "+CEREG: %d,%d" };
+    static const char *const cedrxrdp[] = { "+CEDRXRDP: %d" };
+    int status = 0;
+    int mode = -1;
+    int n = -1;
+    int stat = -1;
+    int act = 0;
+    at_response resp;
+    timers.tau_s = UINT32_MAX;
+    timers.active_s = UINT32_MAX;
+    timers.edrx_ms = 0;
+    timers.ptw_ms = 0;
+    mutex_lock();
+    // <n> 4 adds the granted <Active-Time> and <Periodic-TAU> as fields 7 and 8
+    if (!_send("AT+CEREG?") || _match(resp, cereg, 1, &mode, &stat) != AT_OK || resp.fields != 2)
+    {
+        status = Q_FAILURE;
+    }
+    else if ((mode != 4 && _command("AT+CEREG=4") != Q_SUCCESS) || !_send("AT+CEREG?") 
+        || _match(resp, cereg, 1, &n, &stat) != AT_OK || resp.fields != 2 || !(stat == 1 || stat == 5))
+    {
+        status = Q_FAILURE;
+    }
+    else
+    {
+        int active = bit_field(resp.line, 7);
+        int tau = bit_field(resp.line, 8);
+        if (active >= 0)
+        {
+            timers.active_s = gprs_timer2_seconds(active);
+        }
+        if (tau >= 0)
+        {
+            timers.tau_s = gprs_timer3_seconds(tau);
+        }
+        // +CEDRXRDP: <AcT>,<requested eDRX>,<granted eDRX>,<PTW>, <AcT> 0 when eDRX is not used
+        if (_send("AT+CEDRXRDP") && _match(resp, cedrxrdp, 1, &act) == AT_OK && resp.fields == 1
+            && (act == ACT_CATM || act == ACT_NBIOT))
+        {
+            int cycle = bit_field(resp.line, 2);
+            int ptw = bit_field(resp.line, 3);
+            if (cycle >= 0 && ptw >= 0)
+            {
+                timers.edrx_ms = edrx_ms(cycle, (act_t)act);
+                timers.ptw_ms = ptw_ms(ptw, (act_t)act);
+            }
+        }
+    }
+    // Put the registration URCs back in the format the application asked for
+    if (mode >= 0 && mode != 4 && _command("AT+CEREG=%d", mode) != Q_SUCCESS)
+    {
+        status = Q_FAILURE;
+    }
+    mutex_unlock();
+    return (status);
+}
+
+int QUECTEL_BG77::enable_autoconnect()
+{
+    int  status = -1;
+    mutex_lock();
+    status = _command("AT+COPS=0");
+    mutex_unlock();
+	return (status);
+}
+
+int QUECTEL_BG77::auto_zone_update()
+{
+    int status = 0;
+    mutex_lock();
+	status = _command("AT+CTZU=3"); 
+    // Report NITZ updates, +CTZE: <tz>,<dst>,<time>
+    if (status == Q_SUCCESS)
+    {
+        status = _command("AT+CTZR=2");
+    }
+    mutex_unlock();
+	return (status);
+}
+
+int QUECTEL_BG77::tcpip_startup(const char *apn)
+{
+    BG77_SPAN(SPAN_TCPIP_STARTUP);
+    int status = 0;
+ 
+    mutex_lock();
+	bool rf = (rf_select(RF_WWAN) == Q_SUCCESS);
+    // The steps of attach() in order, each retried with its backoff until it took: the last
+    // try decides, the steps after a failed one are not run
+    for (int step = 0; step < 4 && status == Q_SUCCESS; step++)
+    {
+        for (int tries = 1; ; tries++)
+        {
+            status = (step == 0) ? cfun(1) 
+                   : (step == 1) ? band_config() 
+                   : (step == 2) ? query_sim() 
+                   : csq(apn);
+            if (status == Q_SUCCESS || tries >= ATTACH_MAX_TRIES)
+            {
+                break;
+            }
+            // Other users of the module get their turn meanwhile
+            mutex_unlock();
+            ThisThread::sleep_for(std::chrono::milliseconds(ATTACH_BACKOFF_MS << (tries - 1)));
+            mutex_lock();
+        }
+    }
+    if (!rf)
+    {
+        status = Q_FAILURE;
+    }
+    mutex_unlock();
+    
+	return (status);
+}
+
+int QUECTEL_BG77::resume(const char *apn, bool *warm)
+{
+    BG77_SPAN(SPAN_RESUME);
+    static const char *const state[] = { "+CEREG: ", "+QIACT: 1,", "+CPIN: " };
+    static const char *const queries[] = { "AT+CEREG?", "AT+QIACT?", "AT+CPIN?" };
+    char lines[3][LINE_LEN];
+    int stat = -1;
+    int active = 0;
+    bool survived = false;
+    int status = 0;
+    at_response resp;
+    mutex_lock();
+    // The line gets the deadlines of all its commands, as run_sequence() gives chained steps
+    int timeout_ms = 0;
+    for (size_t i = 0; i < sizeof(queries) / sizeof(queries[0]); i++)
+    {
+        timeout_ms += _command_timeout(_find_command(queries[i]));
+    }
+    // One round trip tells what survived the sleep: registration, context 1 and the SIM
+    if (_send_line("AT+CEREG?;+QIACT?;+CPIN?", timeout_ms) && _match_lines(resp, state, 3, lines) == AT_OK)
+    {
+        survived = sscanf(lines[0], "+CEREG: %*d,%d", &stat) == 1 && (stat == 1 || stat == 5)
+                && sscanf(lines[1], "+QIACT: 1,%d", &active) == 1 && active == 1
+                && strcmp(lines[2], "+CPIN: READY") == 0;
+    }
+    if (!survived)
+    {
+        status = tcpip_startup(apn);
+    }
+    mutex_unlock();
+    if (warm != nullptr)
+    {
+        *warm = survived;
+    }
+    return (status);
+}
+
+int QUECTEL_BG77::attach(const char *apn, Callback<void(int)> done)
+{
+    mutex_lock();
+    if (_attach_state >= ATTACH_SIM && _attach_state <= ATTACH_PDP)
+    {
+        mutex_unlock();
+        return Q_FAILURE;
+    }
+    strncpy(_attach_apn, apn, sizeof(_attach_apn) - 1);
+    _attach_apn[sizeof(_attach_apn) - 1] = '\0';
+    _attach_done = done;
+    memset(&_attach_metrics, 0, sizeof(_attach_metrics));
+    _attach_start = Kernel::Clock::now();
+    _attach_radio = false;
+    _attach_enter(ATTACH_SIM);
+    _attach_timer = _work_queue.call(this, &QUECTEL_BG77::_attach_step);
+    // Read under the lock, the first step clears it as soon as the lock is released
+    int status = (_attach_timer != 0) ? Q_SUCCESS : Q_FAILURE;
+    if (status != Q_SUCCESS)
+    {
+        _attach_state = ATTACH_IDLE;
+    }
+    mutex_unlock();
+    return status;
+}
+
+QUECTEL_BG77::attach_state_t QUECTEL_BG77::attach_state()
+{
+    mutex_lock();
+    attach_state_t state = _attach_state;
+    mutex_unlock();
+    return state;
+}
+
+void QUECTEL_BG77::get_attach_metrics(attach_metrics &metrics)
+{
+    mutex_lock();
+    metrics = _attach_metrics;
+    mutex_unlock();
+}
+
+void QUECTEL_BG77::_attach_enter(attach_state_t state)
+{
+    Kernel::Clock::time_point now = Kernel::Clock::now();
+    if (_attach_state >= ATTACH_SIM && _attach_state <= ATTACH_PDP)
+    {
+        _attach_metrics.stage_ms[_attach_state - ATTACH_SIM] = (now - _attach_stage_start).count();
+    }
+    _attach_state = state;
+    _attach_stage_start = now;
+    _attach_tries = 0;
+}
+
+void QUECTEL_BG77::_attach_retry()
+{
+    if (++_attach_tries >= ATTACH_MAX_TRIES)
+    {
+        _attach_finish(Q_FAILURE);
+        return;
+    }
+    _attach_metrics.retries++;
+    _attach_timer = _work_queue.call_in(std::chrono::milliseconds(ATTACH_BACKOFF_MS << (_attach_tries - 1)), 
+                                        this, &QUECTEL_BG77::_attach_step);
+}
+
+void QUECTEL_BG77::_attach_finish(int result)
+{
+    _attach_enter(result == Q_SUCCESS ? ATTACH_DONE : ATTACH_FAILED);
+    _attach_metrics.total_ms = (Kernel::Clock::now() - _attach_start).count();
+    _attach_metrics.result = result;
+    _attach_timer = 0;
+    if (_attach_done)
+    {
+        _attach_done(result);
+    }
+}
+
+void QUECTEL_BG77::_attach_step()
+{
+    static const char *const cereg[] = { "+CEREG: %d,%d" };
+    static const char *const qiact[] = { "+QIACT: 1,1" };
+    at_response resp;
+    int n = -1;
+    int stat = -1;
+
+    mutex_lock();
+    _work_queue.cancel(_attach_timer);
+    _attach_timer = 0;
+
+    if (_attach_state == ATTACH_SIM)
+    {
+        // Both are retried until they took, from then on only the SIM is polled
+        if (!_attach_radio && (cfun(1) != Q_SUCCESS || band_config() != Q_SUCCESS))
+        {
+            _attach_retry();
+        }
+        else
+        {
+            _attach_radio = true;
+            if (query_sim() != Q_SUCCESS)
+            {
+                // +CPIN: READY wakes us up early
+                _attach_retry();
+            }
+            else
+            {
+                _attach_enter(ATTACH_REGISTER);
+            }
+        }
+    }
+
+    if (_attach_state == ATTACH_REGISTER)
+    {
+        if (_attach_tries == 0)
+        {
+            // Report registration changes as +CEREG: <stat>
+            _command("AT+CEREG=1");
+        }
+        _send("AT+CEREG?");
+        if (_match(resp, cereg, 1, &n, &stat) == AT_OK && resp.fields == 2 && (stat == 1 || stat == 5))
+        {
+            _attach_enter(ATTACH_PDP);
+        }
+        else
+        {
+            _attach_retry();
+        }
+    }
+
+    if (_attach_state == ATTACH_PDP)
+    {
+        if (_config_command(CFG_APN, "AT+QICSGP=1,1,\"%s\"", _attach_apn) == Q_SUCCESS
+            && ((_send("AT+QIACT?") && _match(resp, qiact, 1) == AT_OK && resp.match == 0) 
+                || _command("AT+QIACT=1") == Q_SUCCESS))
+        {
+            _attach_finish(Q_SUCCESS);
+        }
+        else
+        {
+            _attach_retry();
+        }
+    }
+    mutex_unlock();
+}
+
+int QUECTEL_BG77::socket_open(socket_type_t type, const char *host, uint16_t port)
+{
+    int id = 0;
+    int opened = -1;
+    int err = -1;
+    if (type == SOCKET_TCP && (host == nullptr || strlen(host) > SOCKET_HOST_LEN))
+    {
+        return Q_FAILURE;
+    }
+    mutex_lock();
+    while (id < SOCKET_COUNT && _sockets[id].open)
+    {
+        id++;
+    }
+    // Payloads as they are, not hex, both ways
+    if (!_sockets_ready && _command("AT+QICFG=\"dataformat\",0,0") == Q_SUCCESS)
+    {
+        _sockets_ready = true;
+    }
+    if (id == SOCKET_COUNT || !_sockets_ready)
+    {
+        mutex_unlock();
+        return Q_FAILURE;
+    }
+
+    _arm_urc(URC_QIOPEN);
+    int status = (type == SOCKET_TCP) 
+               ? _command("AT+QIOPEN=1,%d,\"TCP\",\"%s\",%u,0,0", id, host, port)
+               : _command("AT+QIOPEN=1,%d,\"UDP SERVICE\",\"127.0.0.1\",0,%u,0", id, port);
+    // OK only means the module took it, +QIOPEN: <connectID>,<err> tells how it went
+    if (!(status == Q_SUCCESS && _wait_urc(URC_QIOPEN, SOCKET_OPEN_TIMEOUT)
+          && sscanf(_urc_payload[URC_QIOPEN], "%d,%d", &opened, &err) == 2 && opened == id && err == 0))
+    {
+        mutex_unlock();
+        return Q_FAILURE;
+    }
+    _sockets[id].open = true;
+    _sockets[id].connected = true;
+    mutex_unlock();
+    return id;
+}
+
+int QUECTEL_BG77::socket_send(int id, const void *data, size_t len, const char *host, uint16_t port)
+{
+    int status = 0;
+    at_response resp;
+    if (id < 0 || id >= SOCKET_COUNT || len > SOCKET_MTU || (host != nullptr && strlen(host) > SOCKET_HOST_LEN))
+    {
+        return Q_FAILURE;
+    }
+    mutex_lock();
+    if (!_sockets[id].open || !_sockets[id].connected)
+    {
+        status = Q_FAILURE;
+    }
+    else
+    {
+        bool sent = (host != nullptr) ? _send("AT+QISEND=%d,%u,\"%s\",%u", id, (unsigned) len, host, port)
+                                      : _send("AT+QISEND=%d,%u", id, (unsigned) len);
+        if (!(sent && _prompt() && _write(data, len) && _match(resp) == AT_OK))
+        {
+            status = Q_FAILURE;
+        }
+    }
+    mutex_unlock();
+    return (status);
+}
+
+int QUECTEL_BG77::socket_recv(int id, void *data, size_t len, char *host, uint16_t *port)
+{
+    char line[LINE_LEN];
+    char remote[16] = "";
+    unsigned remote_port = 0;
+    int  length = -1;
+    at_response resp;
+    if (id < 0 || id >= SOCKET_COUNT)
+    {
+        return Q_FAILURE;
+    }
+    if (len > SOCKET_MTU)
+    {
+        len = SOCKET_MTU;
+    }
+    mutex_lock();
+    if (!_sockets[id].open || !_send("AT+QIRD=%d,%u", id, (unsigned) len))
+    {
+        mutex_unlock();
+        return Q_FAILURE;
+    }
+    // +QIRD: <read_actual_length>[,"<remoteIP>",<remote_port>], then that many bytes of payload
+    while (length < 0)
+    {
+        if (_read_line(line, sizeof(line)) < 0 || strcmp(line, "ERROR") == 0 
+            || strncmp(line, "+CME ERROR:", 11) == 0)
+        {
+            _end_command(AT_ERROR);
+            mutex_unlock();
+            return Q_FAILURE;
+        }
+        if (sscanf(line, "+QIRD: %d,\"%15[^\"]\",%u", &length, remote, &remote_port) < 1)
+        {
+            length = -1;
+            _dispatch_urc(line);
+        }
+    }
+    uint8_t *bytes = (uint8_t *) data;
+    for (int i = 0; i < length; i++)
+    {
+        int c = _getc();
+        if (c < 0)
+        {
+            length = Q_FAILURE;
+            break;
+        }
+        bytes[i] = c;
+    }
+    if (_match(resp) != AT_OK)
+    {
+        length = Q_FAILURE;
+    }
+    mutex_unlock();
+    if (host != nullptr)
+    {
+        strcpy(host, remote);
+    }
+    if (port != nullptr)
+    {
+        *port = remote_port;
+    }
+    return length;
+}
+
+int QUECTEL_BG77::socket_close(int id)
+{
+    int status = 0;
+    if (id < 0 || id >= SOCKET_COUNT)
+    {
+        return Q_FAILURE;
+    }
+    mutex_lock();
+    status = _command("AT+QICLOSE=%d", id);
+    _sockets[id].open = false;
+    _sockets[id].connected = false;
+    _sockets[id].event = nullptr;
+    mutex_unlock();
+    return (status);
+}
+
+bool QUECTEL_BG77::socket_connected(int id)
+{
+    return id >= 0 && id < SOCKET_COUNT && _sockets[id].open && _sockets[id].connected;
+}
+
+void QUECTEL_BG77::socket_attach(int id, Callback<void()> event)
+{
+    if (id < 0 || id >= SOCKET_COUNT)
+    {
+        return;
+    }
+    mutex_lock();
+    _sockets[id].event = event;
+    mutex_unlock();
+}
+
+int QUECTEL_BG77::mqtt_connect(const mqtt_config &config)
+{
+    char session[32];
+    char keepalive[32];
+    int  client = -1;
+    int  result = -1;
+    int  code = -1;
+    if (config.host == nullptr || strlen(config.host) > MQTT_HOST_LEN
+        || config.client_id == nullptr || strlen(config.client_id) > MQTT_CLIENT_ID_LEN
+        || (config.user != nullptr && strlen(config.user) > MQTT_USER_LEN)
+        || (config.password != nullptr && strlen(config.password) > MQTT_PASSWORD_LEN))
+    {
+        return Q_FAILURE;
+    }
+    mutex_lock();
+    if (_mqtt_connected)
+    {
+        mutex_unlock();
+        return Q_SUCCESS;
+    }
+    // Messages wait in the module's buffers until read, so a long payload never has to fit a URC line
+    sprintf(session, "AT+QMTCFG=\"session\",0,%d", config.clean_session ? 1 : 0);
+    sprintf(keepalive, "AT+QMTCFG=\"keepalive\",0,%u", config.keepalive_s);
+    const at_step steps[] =
+    {
+        { "AT+QMTCFG=\"pdpcid\",0,1",      nullptr, 0, STEP_STOP, true },
+        { session,                          nullptr, 0, STEP_STOP, true },
+        { keepalive,                        nullptr, 0, STEP_STOP, true },
+        { "AT+QMTCFG=\"recv/mode\",0,1,1", nullptr, 0, STEP_STOP, true },
+    };
+    int status = run_sequence(steps, sizeof(steps) / sizeof(steps[0]));
+
+    // +QMTOPEN: <client_idx>,<result>, 2 is an identifier already open from before a sleep
+    _arm_urc(URC_QMTOPEN);
+    if (!(status == Q_SUCCESS && _command("AT+QMTOPEN=0,\"%s\",%u", config.host, config.port) == Q_SUCCESS
+          && _wait_urc(URC_QMTOPEN, MQTT_OPEN_TIMEOUT) 
+          && sscanf(_urc_payload[URC_QMTOPEN], "%d,%d", &client, &result) == 2 && (result == 0 || result == 2)))
+    {
+        mutex_unlock();
+        return Q_FAILURE;
+    }
+
+    // +QMTCONN: <client_idx>,<result>,<ret_code>, ret_code 0 is CONNACK accepted
+    _arm_urc(URC_QMTCONN);
+    bool sent = (config.user != nullptr) 
+              ? _command("AT+QMTCONN=0,\"%s\",\"%s\",\"%s\"", config.client_id, config.user, 
+                         config.password ? config.password : "") == Q_SUCCESS
+              : _command("AT+QMTCONN=0,\"%s\"", config.client_id) == Q_SUCCESS;
+    if (!(sent && _wait_urc(URC_QMTCONN, MQTT_PACKET_TIMEOUT)
+          && sscanf(_urc_payload[URC_QMTCONN], "%d,%d,%d", &client, &result, &code) == 3 && result == 0 && code == 0))
+    {
+        status = Q_FAILURE;
+    }
+    _mqtt_connected = (status == Q_SUCCESS);
+    mutex_unlock();
+    return (status);
+}
+
+int QUECTEL_BG77::mqtt_disconnect()
+{
+    int status = 0;
+    mutex_lock();
+    _arm_urc(URC_QMTDISC);
+    if (!(_command("AT+QMTDISC=0") == Q_SUCCESS && _wait_urc(URC_QMTDISC, MQTT_PACKET_TIMEOUT)))
+    {
+        status = Q_FAILURE;
+    }
+    _mqtt_connected = false;
+    mutex_unlock();
+    return (status);
+}
+
+bool QUECTEL_BG77::mqtt_connected()
+{
+    return _mqtt_connected;
+}
+
+int QUECTEL_BG77::mqtt_subscribe(const char *topic, int qos)
+{
+    int client = -1;
+    int msgid = -1;
+    int result = -1;
+    int granted = -1;
+    int status = 0;
+    if (topic == nullptr || strlen(topic) > MQTT_TOPIC_LEN)
+    {
+        return Q_FAILURE;
+    }
+    mutex_lock();
+    _mqtt_msgid = (_mqtt_msgid % UINT16_MAX) + 1;
+    // +QMTSUB: <client_idx>,<msgID>,<result>,<granted QoS>, 128 is refused
+    _arm_urc(URC_QMTSUB);
+    if (!(_command("AT+QMTSUB=0,%u,\"%s\",%d", _mqtt_msgid, topic, qos) == Q_SUCCESS
+          && _wait_urc(URC_QMTSUB, MQTT_PACKET_TIMEOUT)
+          && sscanf(_urc_payload[URC_QMTSUB], "%d,%d,%d,%d", &client, &msgid, &result, &granted) == 4
+          && result == 0 && granted != 128))
+    {
+        status = Q_FAILURE;
+    }
+    mutex_unlock();
+    return (status);
+}
+
+int QUECTEL_BG77::mqtt_publish(const mqtt_message *messages, size_t count)
+{
+    BG77_SPAN(SPAN_MQTT_PUBLISH);
+    at_response resp;
+    size_t sent = 0;
+    if (count > MQTT_BATCH)
+    {
+        return Q_FAILURE;
+    }
+    // The whole batch is checked before the first AT+QMTPUB goes out
+    for (size_t i = 0; i < count; i++)
+    {
+        if (messages[i].topic == nullptr || strlen(messages[i].topic) > MQTT_TOPIC_LEN || messages[i].qos > 1
+            || messages[i].len > MQTT_PAYLOAD_LEN || (messages[i].payload == nullptr && messages[i].len > 0))
+        {
+            return Q_FAILURE;
+        }
+    }
+    mutex_lock();
+    // Message IDs of the batch are consecutive so the acknowledgements can be counted
+    if (_mqtt_msgid > UINT16_MAX - MQTT_BATCH)
+    {
+        _mqtt_msgid = 0;
+    }
+    _mqtt_first_id = _mqtt_msgid + 1;
+    _mqtt_last_id = _mqtt_msgid + count;
+    _mqtt_acked = 0;
+    _mqtt_failed = 0;
+    for (size_t i = 0; i < count && _mqtt_connected; i++)
+    {
+        // QoS 0 messages have no ID
+        uint16_t msgid = messages[i].qos ? ++_mqtt_msgid : 0;
+        if (!_send("AT+QMTPUB=0,%u,%d,%d,\"%s\",%u", msgid, messages[i].qos, messages[i].retain ? 1 : 0, 
+                      messages[i].topic, (unsigned) messages[i].len)
+            || !_prompt() || !_write(messages[i].payload, messages[i].len) || _match(resp) != AT_OK)
+        {
+            break;
+        }
+        sent++;
+    }
+
+    // The broker answers in the background, collect what the batch is owed
+    Kernel::Clock::time_point deadline = Kernel::Clock::now() + std::chrono::milliseconds(MQTT_PACKET_TIMEOUT);
+    while (_mqtt_acked + _mqtt_failed < sent)
+    {
+        Kernel::Clock::duration left = deadline - Kernel::Clock::now();
+        _arm_urc(URC_QMTPUB);
+        if (left <= 0ms || !_wait_urc(URC_QMTPUB, left.count()))
+        {
+            break;
+        }
+    }
+    int acked = _mqtt_acked;
+    mutex_unlock();
+    return (acked > 0) ? acked : Q_FAILURE;
+}
+
+void QUECTEL_BG77::mqtt_attach(Callback<void(const char *, const uint8_t *, size_t)> received, 
+                               Callback<void(int)> status)
+{
+    mutex_lock();
+    _mqtt_received = received;
+    _mqtt_status = status;
+    mutex_unlock();
+}
+
+int QUECTEL_BG77::_mqtt_read(int buffer, char *topic, uint8_t *payload)
+{
+    char line[LINE_LEN];
+    size_t i = 0;
+    int commas = 0;
+    bool quoted = false;
+    unsigned len = 0;
+    at_response resp;
+
+    // +QMTRECV: <client_idx>,<msgID>,"<topic>",<payload_len>,"<payload>"
+    // The payload is read by its length, it may hold quotes and line ends
+    _send("AT+QMTRECV=0,%d", buffer);
+    while (true)
+    {
+        int c = _getc();
+        if (c < 0)
+        {
+            _end_command(AT_TIMEOUT);
+            return Q_FAILURE;
+        }
+        if (c == '\r')
+        {
+            continue;
+        }
+        if (c == '\n')
+        {
+            line[i] = '\0';
+            i = 0;
+            commas = 0;
+            quoted = false;
+            if (strcmp(line, "OK") == 0 || strcmp(line, "ERROR") == 0 || strncmp(line, "+CME ERROR:", 11) == 0)
+            {
+                // An empty buffer answers with OK alone
+                _end_command(AT_ERROR);
+                return Q_FAILURE;
+            }
+            _dispatch_urc(line);
+            continue;
+        }
+        if (i + 1 < sizeof(line))
+        {
+            line[i++] = c;
+        }
+        if (c == '"')
+        {
+            quoted = !quoted;
+        }
+        else if (c == ',' && !quoted)
+        {
+            commas++;
+        }
+        // The quote that opens the payload
+        if (commas == 4 && c == '"' && strncmp(line, "+QMTRECV:", 9) == 0)
+        {
+            break;
+        }
+    }
+    line[i] = '\0';
+    if (sscanf(line, "+QMTRECV: %*d,%*d,\"%64[^\"]\",%u,", topic, &len) != 2 || len > MQTT_PAYLOAD_LEN)
+    {
+        _match(resp);
+        return Q_FAILURE;
+    }
+    for (unsigned n = 0; n < len; n++)
+    {
+        int c = _getc();
+        if (c < 0)
+        {
+            _end_command(AT_TIMEOUT);
+            return Q_FAILURE;
+        }
+        payload[n] = c;
+    }
+    // The closing quote, then OK
+    if (_match(resp) != AT_OK)
+    {
+        return Q_FAILURE;
+    }
+    return len;
+}
+
+void QUECTEL_BG77::_mqtt_deliver()
+{
+    mutex_lock();
+    _mqtt_rx_scheduled = false;
+    while (_mqtt_rx_pending != 0)
+    {
+        int buffer = 0;
+        while (!(_mqtt_rx_pending & (1UL << buffer)))
+        {
+            buffer++;
+        }
+        _mqtt_rx_pending &= ~(1UL << buffer);
+        int len = _mqtt_read(buffer, _mqtt_topic, _mqtt_payload);
+        if (len >= 0 && _mqtt_received)
+        {
+            _mqtt_received(_mqtt_topic, _mqtt_payload, len);
+        }
+    }
+    mutex_unlock();
+}
+
+/** Hex digit of a nibble, and nibble of a hex digit (-1 if it is none)
+ */
+static char hex_digit(uint8_t nibble)
+{
+    return "0123456789ABCDEF"[nibble & 0x0F];
+}
+
+static int hex_value(int c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    c = toupper(c);
+    return (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+}
+
+int QUECTEL_BG77::nidd_open(const char *apn, int cid)
+{
+    int status = 0;
+    mutex_lock();
+    if (_config_command((cid == 1) ? CFG_PDP : CFG_NONE, "AT+CGDCONT=%d,\"Non-IP\",\"%s\"", cid, apn) != Q_SUCCESS
+        || _command("AT+QCFGEXT=\"nipdcfg\",0,\"%s\"", apn) != Q_SUCCESS
+        || _command("AT+QCFGEXT=\"nipd\",1") != Q_SUCCESS)
+    {
+        status = Q_FAILURE;
+    }
+    _nidd_open = (status == Q_SUCCESS);
+    mutex_unlock();
+    return (status);
+}
+
+int QUECTEL_BG77::nidd_close()
+{
+    int status = 0;
+    mutex_lock();
+    status = _command("AT+QCFGEXT=\"nipd\",0");
+    _nidd_open = false;
+    mutex_unlock();
+    return (status);
+}
+
+int QUECTEL_BG77::nidd_send(uint8_t channel, const void *data, size_t len)
+{
+    static const char prefix[] = "AT+QCFGEXT=\"nipds\",1,\"";
+    const uint8_t *bytes = (const uint8_t *) data;
+    char hex[64];
+    char suffix[16];
+    size_t n = 0;
+    at_response resp;
+
+    if (len + 1 > NIDD_MTU)
+    {
+        return Q_FAILURE;
+    }
+    mutex_lock();
+    if (!_nidd_open)
+    {
+        mutex_unlock();
+        return Q_FAILURE;
+    }
+    // The hex frame is longer than the parser's line buffer, so the line is written in pieces
+    _begin_command(prefix, 0, sizeof(prefix) - 1 + 2 * (len + 1) + 6);
+    bool written = _write(prefix, sizeof(prefix) - 1);
+    hex[n++] = hex_digit(channel >> 4);
+    hex[n++] = hex_digit(channel);
+    for (size_t i = 0; i < len && written; i++)
+    {
+        hex[n++] = hex_digit(bytes[i] >> 4);
+        hex[n++] = hex_digit(bytes[i]);
+        if (n == sizeof(hex))
+        {
+            written = _write(hex, n);
+            n = 0;
+        }
+    }
+    int suffix_len = snprintf(suffix, sizeof(suffix), "\",%u\r", (unsigned)(len + 1));
+    if (!(written && _write(hex, n) && _write(suffix, suffix_len) && _match(resp) == AT_OK))
+    {
+        mutex_unlock();
+        return Q_FAILURE;
+    }
+    mutex_unlock();
+    return Q_SUCCESS;
+}
+
+void QUECTEL_BG77::nidd_attach(Callback<void(uint8_t, const uint8_t *, size_t)> received)
+{
+    mutex_lock();
+    _nidd_received = received;
+    mutex_unlock();
+}
+
+int QUECTEL_BG77::_nidd_read(uint8_t *frame, size_t size)
+{
+    static const char header[] = "+QCFGEXT: \"nipdr\",";
+    char line[LINE_LEN];
+    size_t i = 0;
+    unsigned len = 0;
+    at_response resp;
+
+    // +QCFGEXT: "nipdr",<length>,<hex data>, read by its length as it outgrows a line
+    _send("AT+QCFGEXT=\"nipdr\",%u,1", (unsigned) size);
+    while (true)
+    {
+        int c = _getc();
+        if (c < 0)
+        {
+            _end_command(AT_TIMEOUT);
+            return Q_FAILURE;
+        }
+        if (c == '\r')
+        {
+            continue;
+        }
+        if (c == '\n')
+        {
+            line[i] = '\0';
+            i = 0;
+            if (strcmp(line, "OK") == 0 || strcmp(line, "ERROR") == 0 || strncmp(line, "+CME ERROR:", 11) == 0)
+            {
+                _end_command(strcmp(line, "OK") == 0 ? AT_OK : AT_ERROR);
+                return (line[0] == 'O') ? 0 : Q_FAILURE;
+            }
+            // +QCFGEXT: "nipdr",0 when nothing is waiting
+            if (strncmp(line, header, sizeof(header) - 1) != 0)
+            {
+                _dispatch_urc(line);
+            }
+            continue;
+        }
+        if (i + 1 < sizeof(line))
+        {
+            line[i++] = c;
+        }
+        line[i] = '\0';
+        if (c == ',' && strncmp(line, header, sizeof(header) - 1) == 0 && i > sizeof(header) - 1)
+        {
+            break;
+        }
+    }
+    if (sscanf(line + sizeof(header) - 1, "%u", &len) != 1 || len > size)
+    {
+        _match(resp);
+        return Q_FAILURE;
+    }
+    for (unsigned n = 0; n < len; )
+    {
+        int c = _getc();
+        if (c < 0)
+        {
+            _end_command(AT_TIMEOUT);
+            return Q_FAILURE;
+        }
+        // The data may be quoted
+        if (c == '"' || c == ' ')
+        {
+            continue;
+        }
+        int high = hex_value(c);
+        int low = hex_value(_getc());
+        if (high < 0 || low < 0)
+        {
+            _match(resp);
+            return Q_FAILURE;
+        }
+        frame[n++] = high << 4 | low;
+    }
+    if (_match(resp) != AT_OK)
+    {
+        return Q_FAILURE;
+    }
+    return len;
+}
+
+void QUECTEL_BG77::_nidd_deliver()
+{
+    mutex_lock();
+    _nidd_scheduled = false;
+    int len;
+    while ((len = _nidd_read(_nidd_frame, sizeof(_nidd_frame))) > 0)
+    {
+        if (_nidd_received)
+        {
+            _nidd_received(_nidd_frame[0], _nidd_frame + 1, len - 1);
+        }
+    }
+    mutex_unlock();
+}
+
+int QUECTEL_BG77::ip_address(char *ip, size_t len)
+{
+    static const char *const qiact[] = { "+QIACT: 1,1,%*d,\"%39[^\"]\"" };
+    char address[40];
+    int status = 0;
+    at_response resp;
+    mutex_lock();
+    _send("AT+QIACT?");
+    if (!(_match(resp, qiact, 1, address) == AT_OK && resp.fields == 1) || strlen(address) >= len)
+    {
+        status = Q_FAILURE;
+    }
+    else
+    {
+        strcpy(ip, address);
+    }
+    mutex_unlock();
+    return (status);
+}
+
+int QUECTEL_BG77::configure_http_server()
+{
+    int status = 0;
+    mutex_lock();
+	status = _command("AT+QHTTPCFG=\"contextid\",1");
+    mutex_unlock();
+	return (status);
+}
+
+int QUECTEL_BG77::_file_upload(config_t item, const char *name, const char *data, size_t len)
+{
+    static const char *const qflst[] = { "+QFLST: \"%*[^\"]\",%u" };
+    static const char *const qfupl[] = { "+QFUPL: %u" };
+    char key[SEQUENCE_LINE_LEN];
+    unsigned size = 0;
+    at_response resp;
+
+    // The shadow keys the file by its name, length and content
+    snprintf(key, sizeof(key), "AT+QFUPL=\"UFS:%s\",%u,%08lx", name, (unsigned) len, 
+             (unsigned long) config_hash_bytes(data, len));
+    // The shadow alone is not enough, the file system is wiped by a module firmware update
+    _send("AT+QFLST=\"UFS:%s\"", name);
+    bool listed = (_match(resp, qflst, 1, &size) == AT_OK && resp.match == 0 && size == len);
+    if (listed && _config_cached(item, key))
+    {
+        return Q_SUCCESS;
+    }
+
+    _command("AT+QFDEL=\"UFS:%s\"", name);
+    _send("AT+QFUPL=\"UFS:%s\",%u,10", name, (unsigned) len);
+    if (_match(resp) != AT_CONNECT || !_write(data, len) 
+        || _match(resp, qfupl, 1, &size) != AT_OK || resp.fields != 1 || size != len)
+    {
+        return Q_FAILURE;
+    }
+    _config_applied(item, key);
+    _config_save();
+    return Q_SUCCESS;
+}
+
+int QUECTEL_BG77::ssl_setup(const ssl_config &config)
+{
+    char seclevel[32];
+    char session[40];
+    int status = 0;
+    mutex_lock();
+    // 0 no authentication, 1 server, 2 server and client
+    int level = config.ca_cert ? (config.client_cert ? 2 : 1) : 0;
+    if ((config.ca_cert && _file_upload(CFG_CA_CERT, "bg77_ca.pem", config.ca_cert, config.ca_len) != Q_SUCCESS)
+        || (config.client_cert && _file_upload(CFG_CLIENT_CERT, "bg77_cc.pem", config.client_cert, config.client_len) != Q_SUCCESS)
+        || (config.client_key && _file_upload(CFG_CLIENT_KEY, "bg77_ck.pem", config.client_key, config.key_len) != Q_SUCCESS))
+    {
+        mutex_unlock();
+        return Q_FAILURE;
+    }
+    sprintf(seclevel, "AT+QSSLCFG=\"seclevel\",1,%d", level);
+    sprintf(session, "AT+QSSLCFG=\"session_cache\",1,%d", config.session_cache ? 1 : 0);
+    // Certificate steps only for the certificates there are
+    at_step steps[8];
+    size_t count = 0;
+    steps[count++] = { "AT+QSSLCFG=\"sslversion\",1,4",        nullptr, 0, STEP_STOP, true, CFG_NONE };
+    steps[count++] = { "AT+QSSLCFG=\"ciphersuite\",1,0xFFFF",  nullptr, 0, STEP_STOP, true, CFG_NONE };
+    steps[count++] = { seclevel,                                 nullptr, 0, STEP_STOP, true, CFG_NONE };
+    if (config.ca_cert)
+    {
+        steps[count++] = { "AT+QSSLCFG=\"cacert\",1,\"UFS:bg77_ca.pem\"", nullptr, 0, STEP_STOP, true, CFG_NONE };
+    }
+    if (config.client_cert)
+    {
+        steps[count++] = { "AT+QSSLCFG=\"clientcert\",1,\"UFS:bg77_cc.pem\"", nullptr, 0, STEP_STOP, true, CFG_NONE };
+    }
+    if (config.client_key)
+    {
+        steps[count++] = { "AT+QSSLCFG=\"clientkey\",1,\"UFS:bg77_ck.pem\"", nullptr, 0, STEP_STOP, true, CFG_NONE };
+    }
+    steps[count++] = { session,                                  nullptr, 0, STEP_STOP, true, CFG_NONE };
+    steps[count++] = { "AT+QHTTPCFG=\"sslctxid\",1",            nullptr, 0, STEP_STOP, true, CFG_NONE };
+    status = run_sequence(steps, count);
+    _ssl_enabled = (status == Q_SUCCESS);
+    _http_keep_alive = config.keep_alive;
+    memset(&_ssl_metrics, 0, sizeof(_ssl_metrics));
+    mutex_unlock();
+    return (status);
+}
+
+void QUECTEL_BG77::get_ssl_metrics(ssl_metrics &metrics)
+{
+    mutex_lock();
+    metrics = _ssl_metrics;
+    mutex_unlock();
+}
+
+int QUECTEL_BG77::request_http_header()
+{
+    int status = 0;
+    mutex_lock();
+	status = _command("AT+QHTTPCFG=\"requestheader\",1");
+    mutex_unlock();
+	return (status);
+}
+
+int QUECTEL_BG77::response_http_header()
+{
+    int status = 0;
+    mutex_lock();
+	status = _command("AT+QHTTPCFG=\"responseheader\",1");
+    mutex_unlock();
+	return (status);
+}
+
+int QUECTEL_BG77::set_http_url(const char *url_m)
+{
+    int status = 0;
+    at_response resp;
+    mutex_lock();
+    request_http_header();
+    _send("AT+QHTTPURL=%d,80",strlen(url_m));
+	if (_match(resp) != AT_CONNECT)
+	{
+		status = Q_FAILURE;	
+	}
+    else
+    {
+        _write(url_m, strlen(url_m));
+        if (_match(resp) != AT_OK)
+        {
+            status = Q_FAILURE;	
+        }
+    }
+    mutex_unlock();
+	return (status);
+}
+
+bool QUECTEL_BG77::send_http_post(const char* http_header, uint8_t *http_body, size_t body_len, const char *stateStr)
+{
+    http_fragment body = { http_body, body_len };
+    return send_http_post(http_header, &body, 1, stateStr);
+}
+
+/** The answer of our server to a post, {"info":[{"src":{"asset_id":"..."},"isSafe":true}]}
+ */
+struct safe_answer
+{
+    char                            asset_id[25];
+    bool                            is_safe;
+    QUECTEL_BG77_JSON::field        fields[2];
+    QUECTEL_BG77::http_response     response;
+
+    safe_answer() : is_safe(true)
+    {
+        fields[0] = { "info.src.asset_id", QUECTEL_BG77_JSON::JSON_STRING, asset_id, sizeof(asset_id), false };
+        fields[1] = { "info.isSafe", QUECTEL_BG77_JSON::JSON_BOOL, &is_safe, sizeof(is_safe), false };
+        response = { 0, 0, fields, 2 };
+    }
+
+    /** If for any reason the post failed assume it is safe
+     */
+    bool safe(int status) const
+    {
+        return (status != QUECTEL_BG77::Q_SUCCESS || !fields[1].found || is_safe);
+    }
+};
+
+bool QUECTEL_BG77::send_http_post(const char* http_header, const http_fragment *fragments, size_t count, const char *stateStr)
+{
+    safe_answer answer;
+    return answer.safe(http_post(http_header, fragments, count, answer.response));
+}
+
+int QUECTEL_BG77::http_post(const char* http_header, const http_fragment *fragments, size_t count, http_response &response,
+                            const char *content_type)
+{
+    char type_field[48];
+    BG77_SPAN(SPAN_SEND_HTTP_POST);
+    size_t body_len = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        body_len += fragments[i].len;
+    }
+
+    const char *fields[] = { type_field };
+    snprintf(type_field, sizeof(type_field), "Content-Type: %s", content_type ? content_type : "");
+
+    response.http_code = 0;
+    response.content_length = 0;
+    mutex_lock();
+    int status = _http_post_begin(http_header, body_len, fields, content_type ? 1 : 0);
+    if (status == Q_SUCCESS)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            if (!_write(fragments[i].data, fragments[i].len))
+            {
+                status = Q_FAILURE;
+            }
+        }
+        status = _http_post_end(status, response);
+    }
+    mutex_unlock();
+    return status;
+}
+
+bool QUECTEL_BG77::send_http_post(const char* http_header, Callback<ssize_t(uint8_t *, size_t)> body_source, 
+                                  size_t body_len, const char *stateStr)
+{
+    BG77_SPAN(SPAN_SEND_HTTP_POST);
+    safe_answer answer;
+    uint8_t     chunk[64];
+    size_t      sent = 0;
+
+    mutex_lock();
+    int status = _http_post_begin(http_header, body_len);
+    bool connected = (status == Q_SUCCESS);
+    while (connected && sent < body_len)
+    {
+        size_t  want = (body_len - sent < sizeof(chunk)) ? body_len - sent : sizeof(chunk);
+        ssize_t got = body_source(chunk, want);
+        if (got <= 0)
+        {
+            // Content-Length is already on the wire, the modem will time the input out
+            status = Q_FAILURE;
+            break;
+        }
+        if (!_write(chunk, got))
+        {
+            status = Q_FAILURE;
+            break;
+        }
+        sent += got;
+    }
+    if (connected)
+    {
+        status = _http_post_end(status, answer.response);
+    }
+    mutex_unlock();
+    return answer.safe(status);
+}
+
+size_t QUECTEL_BG77::_http_header(const char *http_header, const char *const *fields, size_t field_count, bool write)
+{
+    size_t total = 0;
+    bool inserted = (field_count == 0);
+    const char *line = http_header;
+    while (*line)
+    {
+        const char *end = strstr(line, "\r\n");
+        size_t len = end ? (size_t)(end - line) + 2 : strlen(line);
+        // The fields go in front of the unterminated "Content-Length: " the header ends with
+        if (end == nullptr && !inserted)
+        {
+            for (size_t i = 0; i < field_count; i++)
+            {
+                if (write)
+                {
+                    _write(fields[i], strlen(fields[i]));
+                    _write("\r\n", 2);
+                }
+                total += strlen(fields[i]) + 2;
+            }
+            inserted = true;
+        }
+        bool replaced = false;
+        for (size_t i = 0; i < field_count && end != nullptr; i++)
+        {
+            const char *colon = strchr(fields[i], ':');
+            size_t name_len = colon ? (size_t)(colon - fields[i]) + 1 : 0;
+            if (name_len > 0 && strncasecmp(line, fields[i], name_len) == 0)
+            {
+                replaced = true;
+            }
+        }
+        if (!replaced)
+        {
+            if (write)
+            {
+                _write(line, len);
+            }
+            total += len;
+        }
+        line += len;
+    }
+    return total;
+}
+
+int QUECTEL_BG77::_http_post_begin(const char *http_header, size_t body_len, const char *const *fields, 
+                                   size_t field_count)
 {
     int status = 0;
+    at_response resp;
+
+    char contentLength[16];
+    sprintf(contentLength, "%u\r\n\r\n", (unsigned) body_len); 
+
+    // Connection: keep-alive goes with the caller's fields
+    const char *all[4];
+    size_t count = 0;
+    for (size_t i = 0; i < field_count && count < 3; i++)
+    {
+        all[count++] = fields[i];
+    }
+    if (_http_keep_alive)
+    {
+        all[count++] = "Connection: keep-alive";
+    }
+
+    size_t totalSize = _http_header(http_header, all, count, false) + strlen(contentLength) + body_len; 
+    // Allow 20s plus the time to push the body through the UART at a pessimistic 5kB/s
+    int input_time = 20 + totalSize / 5000;
+    
+    Kernel::Clock::time_point start = Kernel::Clock::now();
+    _send("AT+QHTTPPOST=%u,%d,20", (unsigned) totalSize, input_time);
+    if (_match(resp) != AT_CONNECT) 
+	{
+        // The module is still in command mode, nothing may be written
+		return Q_FAILURE;
+	}
+    if (_ssl_enabled)
+    {
+        // CONNECT comes once the connection is up, handshake included
+        uint32_t elapsed_ms = (Kernel::Clock::now() - start).count();
+        _ssl_metrics.handshakes++;
+        _ssl_metrics.total_ms += elapsed_ms;
+        if (elapsed_ms > _ssl_metrics.max_ms)
+        {
+            _ssl_metrics.max_ms = elapsed_ms;
+        }
+    }
+    _http_header(http_header, all, count, true);
+    _write(contentLength, strlen(contentLength)); 
+    _arm_urc(URC_QHTTPPOST);
+    return status;
+}
+
+int QUECTEL_BG77::flush_queue(QUECTEL_BG77_QUEUE &queue, const char *http_header, size_t max_records, 
+                              const char *ack_path)
+{
+    BG77_SPAN(SPAN_SEND_HTTP_POST);
+    uint8_t record[QUECTEL_BG77_QUEUE::RECORD_MAX];
+    size_t  records = queue.count();
+    size_t  body_len = 0;
+    int     acked = -1;
+    QUECTEL_BG77_JSON::field ack = { ack_path, QUECTEL_BG77_JSON::JSON_INT, &acked, sizeof(acked) };
+    http_response response = { 0, 0, &ack, 1 };
+
+    if (records > max_records)
+    {
+        records = max_records;
+    }
+    if (records == 0)
+    {
+        return Q_SUCCESS;
+    }
+    // Nothing may shift under the indexes until the acknowledged records are dropped
+    queue.hold(true);
+    // Only the records that can be read are sent, up to the first one that cannot
+    for (size_t i = 0; i < records; i++)
+    {
+        size_t len = 0;
+        if (queue.peek(i, record, sizeof(record), len) != QUECTEL_BG77_QUEUE::QUEUE_SUCCESS)
+        {
+            records = i;
+            break;
+        }
+        body_len += len;
+    }
+    if (records == 0)
+    {
+        queue.hold(false);
+        return Q_FAILURE;
+    }
+    // '[' and ']' around the records, ',' between them
+    body_len += records + 1;
+
+    mutex_lock();
+    int status = _http_post_begin(http_header, body_len);
+    if (status != Q_SUCCESS)
+    {
+        mutex_unlock();
+        queue.hold(false);
+        return status;
+    }
+    for (size_t i = 0; i < records && status == Q_SUCCESS; i++)
+    {
+        size_t len = 0;
+        // A record that read a moment ago and fails now leaves the body short, the module 
+        // times the input out and nothing is acknowledged
+        if (queue.peek(i, record, sizeof(record), len) != QUECTEL_BG77_QUEUE::QUEUE_SUCCESS
+            || !_write((i == 0) ? "[" : ",", 1) || !_write(record, len))
+        {
+            status = Q_FAILURE;
+        }
+    }
+    if (status == Q_SUCCESS && !_write("]", 1))
+    {
+        status = Q_FAILURE;
+    }
+    status = _http_post_end(status, response);
+    mutex_unlock();
+
+    if (response.http_code >= 200 && response.http_code <= 299)
+    {
+        if (!ack.found)
+        {
+            acked = records;
+        }
+        if (acked > 0)
+        {
+            queue.drop(((size_t)acked < records) ? acked : records);
+        }
+        if (acked < 0 || (size_t)acked < records)
+        {
+            status = Q_FAILURE;
+        }
+    }
+    queue.hold(false);
+    return status;
+}
+
+int QUECTEL_BG77::_file_write(int handle, const void *data, size_t len)
+{
+    static const char *const qfwrite[] = { "+QFWRITE: %u" };
+    unsigned written = 0;
+    at_response resp;
+    _send("AT+QFWRITE=%d,%u", handle, (unsigned) len);
+    if (_match(resp) != AT_CONNECT || !_write(data, len) 
+        || _match(resp, qfwrite, 1, &written) != AT_OK || resp.fields != 1 || written != len)
+    {
+        return Q_FAILURE;
+    }
+    return Q_SUCCESS;
+}
+
+int QUECTEL_BG77::http_post_compressed(const char* http_header, Callback<ssize_t(uint8_t *, size_t)> body_source, 
+                                       http_response &response)
+{
+    BG77_SPAN(SPAN_SEND_HTTP_POST);
+    static const char *const qfopen[] = { "+QFOPEN: %d" };
+    static const char *const qfwrite[] = { "+QFWRITE: %*u" };
+    QUECTEL_BG77_LZSS lz;
+    uint8_t     chunk[64];
+    char        encoding[32];
+    char        length[CONTENT_LENGTH_WIDTH + 5];
+    const char *fields[] = { encoding };
+    int         handle = -1;
+    int         status = 0;
+    ssize_t     got = 0;
+    at_response resp;
+
+    snprintf(encoding, sizeof(encoding), "Content-Encoding: %s", QUECTEL_BG77_LZSS::CONTENT_ENCODING);
+    response.http_code = 0;
+    response.content_length = 0;
+
     mutex_lock();
-    _parser->send("AT+CPIN?");
-    if(!(_parser->recv("+CPIN: READY") && _parser->recv("OK")))
+    // Mode 1 creates the file or truncates what a failed post left
+    _send("AT+QFOPEN=\"UFS:%s\",1", POST_FILE);
+    if (!(_match(resp, qfopen, 1, &handle) == AT_OK && resp.fields == 1))
     {
         mutex_unlock();
         return Q_FAILURE;
     }
+
+    // Header and a blank Content-Length, which is written over once the body is done
+    size_t header_len = _http_header(http_header, fields, 1, false);
+    snprintf(length, sizeof(length), "%*s\r\n\r\n", CONTENT_LENGTH_WIDTH, "");
+    _send("AT+QFWRITE=%d,%u", handle, (unsigned)(header_len + strlen(length)));
+    if (_match(resp) != AT_CONNECT)
+    {
+        status = Q_FAILURE;
+    }
+    else
+    {
+        _http_header(http_header, fields, 1, true);
+        if (!_write(length, strlen(length)) || _match(resp, qfwrite, 1) != AT_OK)
+        {
+            status = Q_FAILURE;
+        }
+    }
+
+    // Compressed body, one file write per output block
+    while (status == Q_SUCCESS && (got = body_source(chunk, sizeof(chunk))) > 0)
+    {
+        for (ssize_t i = 0; i < got && status == Q_SUCCESS; i++)
+        {
+            if (lz.put(chunk[i]))
+            {
+                status = _file_write(handle, lz.output(), lz.output_len());
+                lz.drain();
+            }
+        }
+    }
+    if (got < 0)
+    {
+        status = Q_FAILURE;
+    }
+    while (status == Q_SUCCESS && lz.finish())
+    {
+        status = _file_write(handle, lz.output(), lz.output_len());
+        lz.drain();
+    }
+
+    // Fill in the placeholder, the padding is whitespace the server ignores
+    snprintf(length, sizeof(length), "%-*u", CONTENT_LENGTH_WIDTH, (unsigned) lz.bytes_out());
+    if (status != Q_SUCCESS 
+        || _command("AT+QFSEEK=%d,%u,0", handle, (unsigned) header_len) != Q_SUCCESS
+        || _file_write(handle, length, CONTENT_LENGTH_WIDTH) != Q_SUCCESS)
+    {
+        status = Q_FAILURE;
+    }
+    if (_command("AT+QFCLOSE=%d", handle) != Q_SUCCESS)
+    {
+        status = Q_FAILURE;
+    }
+
+    if (status == Q_SUCCESS)
+    {
+        _arm_urc(URC_QHTTPPOSTFILE);
+        if (_command("AT+QHTTPPOSTFILE=\"UFS:%s\",80", POST_FILE) != Q_SUCCESS)
+        {
+            status = Q_FAILURE;
+        }
+        else
+        {
+            status = _http_post_end(status, response, URC_QHTTPPOSTFILE);
+        }
+    }
+    _command("AT+QFDEL=\"UFS:%s\"", POST_FILE);
     mutex_unlock();
-	return Q_SUCCESS;
+    return status;
 }
 
-int QUECTEL_BG77::enter_psm(int mode)
+int QUECTEL_BG77::http_download(const char *http_header, Callback<int(const uint8_t *, size_t)> sink, 
+                                http_download_state &state, size_t chunk_len)
 {
-    int status = 0;
+    BG77_SPAN(SPAN_HTTP_DOWNLOAD);
+    int status = Q_SUCCESS;
+    int tries = 0;
+    bool aborted = false;
+    Kernel::Clock::time_point start = Kernel::Clock::now();
+
+    state.bytes = 0;
     mutex_lock();
-	_parser->send("AT+QCFGEXT=\"attm2mfeat\"");
-	if (!_parser->recv("OK"))
+    // Content-Range and Content-Length come in the response header
+    if (_command("AT+QHTTPCFG=\"responseheader\",1") != Q_SUCCESS)
+    {
+        status = Q_FAILURE;
+    }
+    while (status == Q_SUCCESS && (state.total == 0 || state.offset < state.total))
+    {
+        size_t before = state.offset;
+        if (_http_get_range(http_header, sink, state, chunk_len, aborted) == Q_SUCCESS)
+        {
+            tries = 0;
+        }
+        // Only a range that brought nothing counts as a failed try
+        else if (aborted || (state.offset == before && ++tries >= DOWNLOAD_TRIES))
+        {
+            status = Q_FAILURE;
+        }
+    }
+    mutex_unlock();
+
+    state.elapsed_ms = (Kernel::Clock::now() - start).count();
+    state.bytes_per_s = state.elapsed_ms ? (uint32_t)((uint64_t) state.bytes * 1000 / state.elapsed_ms) : 0;
+    return status;
+}
+
+int QUECTEL_BG77::_http_get_range(const char *http_header, Callback<int(const uint8_t *, size_t)> sink, 
+                                  http_download_state &state, size_t chunk_len, bool &aborted)
+{
+    char        range[48];
+    char        line[LINE_LEN];
+    uint8_t     buffer[128];
+    int         err = -1;
+    int         http_code = 0;
+    size_t      length = 0;
+    size_t      first = 0;
+    bool        has_length = false;
+    bool        has_range = false;
+    at_response resp;
+
+    snprintf(range, sizeof(range), "Range: bytes=%u-%u\r\n\r\n", (unsigned) state.offset, 
+             (unsigned)(state.offset + chunk_len - 1));
+    size_t header_len = strlen(http_header) + strlen(range);
+    _arm_urc(URC_QHTTPGET);
+    _send("AT+QHTTPGET=80,%u,20", (unsigned) header_len);
+    if (_match(resp) != AT_CONNECT || !_write(http_header, strlen(http_header)) || !_write(range, strlen(range))
+        || _match(resp) != AT_OK)
+    {
+        return Q_FAILURE;
+    }
+    if (!(_wait_urc(URC_QHTTPGET, 80000) && sscanf(_urc_payload[URC_QHTTPGET], "%d,%d", &err, &http_code) == 2 
+        && err == 0))
+    {
+        return Q_FAILURE;
+    }
+    // Past the end, the size we had was stale
+    if (http_code == 416)
+    {
+        state.total = state.offset;
+        return Q_SUCCESS;
+    }
+
+    _arm_urc(URC_QHTTPREAD);
+    _send("AT+QHTTPREAD=80");
+    if (_match(resp) != AT_CONNECT)
+    {
+        return Q_FAILURE;
+    }
+
+    // Response header, one line at a time up to the blank line
+    size_t len = 0;
+    int c;
+    while ((c = _getc()) >= 0)
+    {
+        if (c != '\n')
+        {
+            if (c != '\r' && len + 1 < sizeof(line))
+            {
+                line[len++] = c;
+            }
+            continue;
+        }
+        line[len] = '\0';
+        if (len == 0)
+        {
+            break;
+        }
+        unsigned a = 0, b = 0, total = 0;
+        if (strncasecmp(line, "Content-Length:", 15) == 0)
+        {
+            length = strtoul(line + 15, nullptr, 10);
+            has_length = true;
+        }
+        else if (strncasecmp(line, "Content-Range:", 14) == 0 
+                 && sscanf(line + 14, " bytes %u-%u/%u", &a, &b, &total) == 3)
+        {
+            first = a;
+            state.total = total;
+            has_range = true;
+        }
+        len = 0;
+    }
+
+    int status = Q_SUCCESS;
+    if (c < 0 || !has_length || (http_code != 200 && http_code != 206) || (http_code == 206 && (!has_range || first != state.offset)))
+    {
+        status = Q_FAILURE;
+    }
+    else if (http_code == 200)
+    {
+        // The server ignored the range and sends it all, skip what the sink already has
+        first = 0;
+        state.total = length;
+    }
+
+    // Body, through the buffer into the sink
+    size_t position = first;
+    size_t received = 0;
+    while (status == Q_SUCCESS && received < length)
+    {
+        size_t n = 0;
+        while (n < sizeof(buffer) && received < length && (c = _getc()) >= 0)
+        {
+            if (position + received >= state.offset)
+            {
+                buffer[n++] = c;
+            }
+            received++;
+        }
+        if (c < 0)
+        {
+            status = Q_FAILURE;
+        }
+        if (n > 0)
+        {
+            if (sink(buffer, n) != Q_SUCCESS)
+            {
+                aborted = true;
+                status = Q_FAILURE;
+                break;
+            }
+            state.offset += n;
+            state.bytes += n;
+        }
+    }
+    if (http_code == 200 && status == Q_SUCCESS)
+    {
+        state.total = state.offset;
+    }
+
+    // The rest of the body and OK are dropped, +QHTTPREAD: <err> closes the read
+    if (!(_wait_urc(URC_QHTTPREAD, _timeout) && atoi(_urc_payload[URC_QHTTPREAD]) == 0))
+    {
+        status = Q_FAILURE;
+    }
+    return status;
+}
+
+int QUECTEL_BG77::_http_post_end(int status, http_response &response, urc_t done)
+{
+    int err = -1;
+    unsigned content_length = 0;
+    at_response resp;
+
+    response.http_code = 0;
+    response.content_length = 0;
+    if (!(_wait_urc(done, (done == URC_QHTTPPOSTFILE) ? 80000 : 20000) 
+        && sscanf(_urc_payload[done], "%d,%d,%u", &err, &response.http_code, &content_length) >= 2
+        && err == 0))
 	{
-		status = Q_FAILURE;	
+		return Q_FAILURE;	
 	}
-    _parser->send("AT+CEDRXS=1,5,\"1111\"");
-	if (!_parser->recv("OK"))
+    response.content_length = content_length;
+    if (response.http_code < 200 || response.http_code > 299)
+    {
+        status = Q_FAILURE;
+    }
+
+    // get response and wait up to 5s for it
+    _arm_urc(URC_QHTTPREAD);
+    _send("AT+QHTTPREAD=5");
+    if (_match(resp) != AT_CONNECT)
 	{
-		status = Q_FAILURE;	
+		return Q_FAILURE;	
 	}
-	_parser->send("AT+QCFG=\"psm/enter\",%d", mode);
-	if (!_parser->recv("OK"))
+
+    // The response header comes first if it is enabled (AT+QHTTPCFG="responseheader",1)
+    static const char http_version[] = "HTTP/";
+    char prefix[sizeof(http_version) - 1];
+    size_t prefix_len = 0;
+    int c = 0;
+    while (content_length > 0 && prefix_len < sizeof(prefix) && (c = _getc()) >= 0)
+    {
+        prefix[prefix_len++] = c;
+        if (c != http_version[prefix_len - 1])
+        {
+            break;
+        }
+    }
+    size_t body = 0;
+    if (prefix_len == sizeof(prefix) && memcmp(prefix, http_version, sizeof(prefix)) == 0)
+    {
+        // Up to the blank line, the body is the content_length bytes after it
+        uint32_t last = 0;
+        while (last != 0x0D0A0D0A && (c = _getc()) >= 0)
+        {
+            last = (last << 8) | (uint8_t) c;
+        }
+        prefix_len = 0;
+    }
+
+    // Scan exactly the body, nothing of the OK and +QHTTPREAD after it. A body that is not
+    // JSON only leaves the fields not found
+    QUECTEL_BG77_JSON json(response.fields, response.fields ? response.field_count : 0);
+    int scanned = QUECTEL_BG77_JSON::JSON_MORE;
+    for (; body < prefix_len; body++)
+    {
+        scanned = json.feed(prefix[body]);
+    }
+    while (c >= 0 && body < content_length && (c = _getc()) >= 0)
+    {
+        if (scanned == QUECTEL_BG77_JSON::JSON_MORE)
+        {
+            scanned = json.feed(c);
+        }
+        body++;
+    }
+    if (c < 0)
+    {
+        status = Q_FAILURE;
+    }
+
+    // OK is dropped, +QHTTPREAD: <err> closes the read
+    if (!(_wait_urc(URC_QHTTPREAD, _timeout) && atoi(_urc_payload[URC_QHTTPREAD]) == 0))
 	{
-		status = Q_FAILURE;	
+        status = Q_FAILURE;
+	}
+    return status;
+}
+
+
+
+int QUECTEL_BG77::turn_off_module()
+{
+    int status = 0;
+    mutex_lock();
+    status = _command("AT+QPOWD");
+    ThisThread::sleep_for(100ms);
+    mutex_unlock();
+    return (status);
+}
+
+int QUECTEL_BG77::cops_info()
+{
+    int status = 0;
+    mutex_lock();
+    status = _command("AT+COPS=?");
+    mutex_unlock();
+	return (status);
+}
+
+int QUECTEL_BG77::activate_pdp()
+{
+    static const char *const cops[] = { "+COPS: 0,0,\"Vodafone\",9" };
+    static const char *const qiact[] = { "+QIACT: 1,1,1,\"%15[^\"]\"" };
+    int status = 0;
+    char qibuff[16];
+    at_response resp;
+    mutex_lock();
+    _send("AT+COPS?");
+    if (!(_match(resp, cops, 1) == AT_OK && resp.match == 0)) 
+	{
+        enable_autoconnect();
+        //todo: qiact?
+		status = Q_FAILURE;
 	}
-     _parser->send("AT+QSCLK = 1");
-	if (!_parser->recv("OK"))
+    // One read of the response tells if context 1 is active, whatever the length of its address
+    _send("AT+QIACT?");
+    if (!(_match(resp, qiact, 1, qibuff) == AT_OK && resp.match == 0))
+    {
+        if (_command("AT+QIACT=1") != Q_SUCCESS)
+        {
+           status = Q_FAILURE;
+        }
+    }
+    if (_command("AT+CGDCONT?") != Q_SUCCESS)
 	{
 		status = Q_FAILURE;	
 	}
@@ -369,430 +3559,667 @@ int QUECTEL_BG77::enter_psm(int mode)
 	return (status);
 }
 
-int QUECTEL_BG77::disable_psm()
+int QUECTEL_BG77::define_pdp_nbiot()
 {
     int status = 0;
     mutex_lock();
-    _parser->send("AT+CPSMS=0");
+    status = _config_command(CFG_PDP, "AT+CGDCONT=1,\"IP\",\"lpwa.vodafone.iot\"");
+    mutex_unlock();
+	return (status);
+}
+
+/** Seconds since the epoch of a UTC date and time, without the C library's time zone
+ */
+static time_t utc_seconds(int year, int month, int day, int hour, int minute, int second)
+{
+    // Days from 1970-01-01 of a proleptic Gregorian date
+    year -= (month <= 2);
+    int era = (year >= 0 ? year : year - 399) / 400;
+    int yoe = year - era * 400;
+    int doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    int doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    long days = (long) era * 146097 + doe - 719468;
+    return (time_t) days * 86400 + hour * 3600 + minute * 60 + second;
+}
+
+/** Parse "yy/MM/dd,hh:mm:ss+zz" (AT+CCLK) or "yyyy/MM/dd,hh:mm:ss+zz" (+QNTP), local time 
+    and its offset from UTC in quarter hours
+ */
+static bool parse_clock(const char *text, time_t &utc, int &tz_minutes)
+{
+    int year, month, day, hour, minute, second, quarters;
+    if (sscanf(text, "%d/%d/%d,%d:%d:%d%d", &year, &month, &day, &hour, &minute, &second, &quarters) != 7)
+    {
+        return false;
+    }
+    year += (year < 100) ? 2000 : 0;
+    tz_minutes = quarters * 15;
+    utc = utc_seconds(year, month, day, hour, minute, second) - tz_minutes * 60;
+    return utc >= VALID_TIME;
+}
+
+time_t QUECTEL_BG77::_rtc_utc(uint32_t &error_ms)
+{
+    time_t rtc = time(nullptr);
+    int64_t since = rtc - _time_sync_utc;
+    // The RTC ran free since it was set, take out the drift learned so far
+    time_t utc = rtc - (time_t)(since * _rtc_ppm / 1000000);
+    uint32_t ppm = _rtc_trained ? RTC_PPM_TRAINED : RTC_PPM;
+    error_ms = _time_sync_error_ms + (uint32_t)((since > 0 ? since : -since) * ppm / 1000);
+    return utc;
+}
+
+void QUECTEL_BG77::_time_discipline(time_t utc, uint32_t error_ms, time_source_t source)
+{
+    time_t rtc = time(nullptr);
+    int64_t since = utc - _time_sync_utc;
+    // Learn the drift over a long enough run that the error of the two syncs hardly counts
+    if (_time_synced && since >= RTC_LEARN_S)
+    {
+        int32_t ppm = (int32_t)((int64_t)(rtc - utc) * 1000000 / since);
+        ppm = (ppm > RTC_PPM_LIMIT) ? RTC_PPM_LIMIT : (ppm < -RTC_PPM_LIMIT) ? -RTC_PPM_LIMIT : ppm;
+        _rtc_ppm = _rtc_trained ? (3 * _rtc_ppm + ppm) / 4 : ppm;
+        _rtc_trained = true;
+    }
+    set_time(utc);
+    _time_sync_utc = utc;
+    _time_sync_error_ms = error_ms;
+    _time_source = source;
+    _time_synced = true;
+}
+
+int QUECTEL_BG77::get_time(time_value &out, uint32_t max_error_ms)
+{
+    static const char *const cclk[] = { "+CCLK: \"%40[^\"]" };
+    static const char *const qiact[] = { "+QIACT: 1,1" };
+    char clock[41];
+    time_t utc = 0;
+    int tz = 0;
+    int err = -1;
+    uint32_t error_ms = 0;
+    at_response resp;
+    int status = Q_SUCCESS;
+
+    mutex_lock();
+    if (_time_synced)
+    {
+        _rtc_utc(error_ms);
+    }
+    if (!_time_synced || error_ms > max_error_ms)
+    {
+        // The module clock, good since the network last sent its time
+        uint64_t nitz_age_ms = (Kernel::Clock::now() - _nitz_at).count();
+        uint32_t nitz_ms = RTC_NITZ_ERROR_MS + (uint32_t)(nitz_age_ms * RTC_PPM / 1000000);
+        bool nitz = false;
+        if (_nitz_seen && nitz_ms <= max_error_ms)
+        {
+            _send("AT+CCLK?");
+            nitz = (_match(resp, cclk, 1, clock) == AT_OK && resp.match == 0 && parse_clock(clock, utc, tz));
+        }
+        if (nitz)
+        {
+            _time_tz = tz;
+            _time_discipline(utc, nitz_ms, TIME_NITZ);
+        }
+        // NTP only when nothing closer to hand is good enough, and only over a context that is 
+        // already up: bringing one up is the attach's job and takes minutes when it fails
+        else if (_send("AT+QIACT?") && _match(resp, qiact, 1) == AT_OK && resp.match == 0)
+        {
+            _arm_urc(URC_QNTP);
+            if (_command("AT+QNTP=1,\"pool.ntp.org\",123,1") == Q_SUCCESS && _wait_urc(URC_QNTP, 30000)
+                && sscanf(_urc_payload[URC_QNTP], "%d,\"%40[^\"]", &err, clock) == 2 && err == 0 
+                && parse_clock(clock, utc, tz))
+            {
+                _time_tz = tz;
+                _time_discipline(utc, RTC_NTP_ERROR_MS, TIME_NTP);
+            }
+        }
+    }
+    if (!_time_synced)
+    {
+        mutex_unlock();
+        return Q_FAILURE;
+    }
+    out.utc = _rtc_utc(out.error_ms);
+    out.tz_minutes = _time_tz;
+    out.source = _time_source;
+    if (out.error_ms > max_error_ms)
+    {
+        status = Q_FAILURE;
+    }
     mutex_unlock();
-	return (status);
+    return status;
 }
 
-int QUECTEL_BG77::enable_autoconnect()
+int QUECTEL_BG77::get_time_iso(char *buffer, size_t len, uint32_t max_error_ms)
 {
-    int  status = -1;
+    time_value now;
+    struct tm t;
     mutex_lock();
-    _parser->send("AT+COPS=0");
-    if(_parser->recv("OK"))
+    int status = get_time(now, max_error_ms);
+    if (!_time_synced || len < ISO_TIME_LEN)
     {
+        mutex_unlock();
         return Q_FAILURE;
     }
+    gmtime_r(&now.utc, &t);
+    strftime(buffer, len, "%Y-%m-%dT%H:%M:%SZ", &t);
     mutex_unlock();
-	return (status);
+    return status;
 }
 
-int QUECTEL_BG77::auto_zone_update()
+char * QUECTEL_BG77::sync_ntp()
 {
-    int status = 0;
+    BG77_SPAN(SPAN_SYNC_NTP);
     mutex_lock();
-	_parser->send("AT+CTZU=3"); 
-	if (!_parser->recv("OK"))
-	{
-		status = Q_FAILURE;
-	}
+    if (get_time_iso(_iso_time, sizeof(_iso_time), TIME_MAX_ERROR_MS) != Q_SUCCESS && !_time_synced)
+    {
+        _iso_time[0] = '\0';
+    }
     mutex_unlock();
-	return (status);
+    return _iso_time;
 }
 
-int QUECTEL_BG77::tcpip_startup(const char *apn)
+int QUECTEL_BG77::gnss_start()
 {
-    int status = 0;
- 
-    _parser->send("AT+QGPSCFG=\"priority\",1");
-	if (!_parser->recv("OK"))
+    static const at_step gnss_on[] =
     {
-        status = -1;	
-    }
-    if (cfun(1) != Q_SUCCESS)
+        { "AT+QGPSCFG=\"gpsnmeatype\",31",       nullptr, 0, STEP_CONTINUE, true },
+        { "AT+QGPSCFG=\"outport\",\"uartnmea\"",  nullptr, 0, STEP_STOP,     true, CFG_GNSS_OUTPORT },
+    };
+    int status = 0;
+    mutex_lock();
+    // Fixes of the last session are dropped. With the GNSS port the parser is reset on
+    // the URC thread, between two feed() calls, and get_fix() has none until then
+    if (_gnss_fh)
     {
-        cfun(1);
-	    status = Q_FAILURE;
+        core_util_atomic_store_bool(&_nmea_reset, true);
+        _gnss_sigio();
     }
-    if (band_config() != QUECTEL_BG77::Q_SUCCESS)
+    else
     {
-        band_config();
-        status = Q_FAILURE;
+        _nmea.reset();
     }
-    if (query_sim() != Q_SUCCESS )
+    rf_select(RF_GNSS);
+    // Without the GNSS port positions are polled
+    if (_gnss_fh)
     {
-        query_sim();
-        status = Q_FAILURE;
+        status = run_sequence(gnss_on, sizeof(gnss_on) / sizeof(gnss_on[0]));
     }
-    if (csq(apn) != Q_SUCCESS)
+    // +CME ERROR: 504 if it is on already. The reply is read even after a failed
+    // configuration so it is not left for the next command
+    at_response resp;
+    bool on = _send("AT+QGPS=1") && (_match(resp) == AT_OK || resp.cme_error == 504);
+    if (!on)
     {
-        csq(apn);
         status = Q_FAILURE;
     }
-    
-	return (status);
+    mutex_unlock();
+    return status;
 }
 
-int QUECTEL_BG77::configure_http_server()
+int QUECTEL_BG77::gnss_stop()
 {
     int status = 0;
     mutex_lock();
-	// _parser->send("AT+QHTTPCFG=\"contextid\",1");
-	// if (!_parser->recv("OK"))
-	// {
-	// 	status = Q_FAILURE;	
-	// }
+    status = _command("AT+QGPSEND");
     mutex_unlock();
-	return (status);
+    return status;
 }
 
-int QUECTEL_BG77::request_http_header()
+bool QUECTEL_BG77::get_fix(QUECTEL_BG77_NMEA::fix &fix)
 {
-    int status = 0;
-    mutex_lock();
-	_parser->send("AT+QHTTPCFG=\"requestheader\",1");
-	if (!_parser->recv("OK"))
-	{
-		status = Q_FAILURE;
-	}
-    mutex_unlock();
-	return (status);
+    return !core_util_atomic_load_bool(&_nmea_reset) && _nmea.get(fix) && fix.valid;
 }
 
-int QUECTEL_BG77::response_http_header()
+bool QUECTEL_BG77::_gnss_poll(QUECTEL_BG77_NMEA::fix &fix)
 {
-    int status = 0;
+    if (_gnss_fh)
+    {
+        return get_fix(fix);
+    }
+    static const char *const qgpsloc[] = { "+QGPSLOC: %10[^,],%f,%f,%f,%f,%d,%f,%f,%f,%6[^,],%d" };
+    char utc[12];
+    char date[8];
+    float spkn;
+    int fix_type, nsat;
+    at_response resp;
+    memset(&fix, 0, sizeof(fix));
     mutex_lock();
-	_parser->send("AT+QHTTPCFG=\"responseheader\",1");
-	if (!_parser->recv("OK"))
-	{
-		status = Q_FAILURE;	
-	}
+    // +CME ERROR: 516 until there is a fix
+    _send("AT+QGPSLOC=2");
+    fix.valid = (_match(resp, qgpsloc, 1, utc, &fix.latitude, &fix.longitude, &fix.hdop, &fix.altitude, &fix_type,
+                        &fix.course, &fix.speed_kmh, &spkn, date, &nsat) == AT_OK && resp.fields == 11);
     mutex_unlock();
-	return (status);
+    if (fix.valid)
+    {
+        unsigned hms = 0, ms = 0;
+        sscanf(utc, "%u.%u", &hms, &ms);
+        fix.time_ms = ((hms / 10000) * 3600 + (hms / 100 % 100) * 60 + hms % 100) * 1000 + ms;
+        fix.date = strtoul(date, nullptr, 10);
+        fix.fix_type = fix_type;
+        fix.quality = 1;
+        fix.satellites = nsat;
+    }
+    return fix.valid;
 }
 
-int QUECTEL_BG77::set_http_url(const char *url_m)
+int QUECTEL_BG77::get_location(gnss_fix &out, const fix_request &request)
 {
-    int status = 0;
+    Kernel::Clock::time_point start = Kernel::Clock::now();
     mutex_lock();
-    request_http_header();
-    _parser->send("AT+QHTTPURL=%d,80",strlen(url_m));
-	if (!_parser->recv("CONNECT"))
-	{
-		status = Q_FAILURE;	
-	}
-    _parser->send("%s",url_m);
-    if (!_parser->recv("OK"))
+    if (_fix_cached && request.max_age_s > 0 && start - _fix_time < std::chrono::seconds(request.max_age_s))
     {
-        status = Q_FAILURE;	
+        out = _last_fix;
+        out.cached = true;
+        out.age_ms = (start - _fix_time).count();
+        mutex_unlock();
+        return Q_SUCCESS;
     }
+    // Ephemeris is good for a few hours, the almanac for weeks
+    start_t kind = !_fix_cached ? START_COLD 
+                 : (start - _fix_time < std::chrono::seconds(GNSS_HOT_WINDOW_S)) ? START_HOT : START_WARM;
     mutex_unlock();
-	return (status);
-}
-
-bool QUECTEL_BG77::send_http_post(const char* http_header, uint8_t *http_body, size_t body_len, const char *stateStr)
-{
-    mutex_lock();
-    int status = 0;
 
-    _parser->set_timeout(12500);
-    char isSafeChar[1];
-    char contentLength[10];
-    sprintf(contentLength, "%d\r\n\r\n", body_len); 
+    QUECTEL_BG77_NMEA::fix fix;
+    bool found = false;
+    uint32_t ttff_ms = 0;
+    int status = gnss_start();
+    // The lock is only held to poll, LTE work goes on meanwhile. Polls that wait for the 
+    // lock count against the timeout too
+    while (status == Q_SUCCESS && Kernel::Clock::now() - start < std::chrono::seconds(request.timeout_s))
+    {
+        ThisThread::sleep_for(1s);
+        if (!_gnss_poll(fix))
+        {
+            continue;
+        }
+        if (!found || fix.hdop < out.fix.hdop)
+        {
+            out.fix = fix;
+        }
+        if (!found)
+        {
+            found = true;
+            ttff_ms = (Kernel::Clock::now() - start).count();
+        }
+        // Good enough, no need to keep the receiver on
+        if (fix.hdop > 0 && fix.hdop <= request.max_hdop)
+        {
+            break;
+        }
+    }
+    if (gnss_stop() != Q_SUCCESS)
+    {
+        status = Q_FAILURE;
+    }
 
-    int totalSize = strlen(http_header) + strlen(contentLength) + body_len; 
-    
-    _parser->send("AT+QHTTPPOST=%d,20,20", totalSize);
-    if (!_parser->recv("CONNECT")) 
-	{
-		status = Q_FAILURE;
-	}
-    _parser->write(http_header, strlen(http_header));
-    _parser->write(contentLength, strlen(contentLength)); 
-       
-    char c_buffer[body_len]; 
-    memcpy(c_buffer, http_body, body_len);
-    _parser->write(c_buffer, body_len);
-
-    if (!_parser->recv("+QHTTPPOST:"))
-	{
-		status = Q_FAILURE;	
-	}
-    // get response and wait up to 20s for the HTTP session to close
-    _parser->send("AT+QHTTPREAD=5");
-    if (!_parser->recv("CONNECT"))
-	{
-		status = Q_FAILURE;	
-	}
-    
-    char * asset_id;
-    asset_id = (char *) malloc(26);
-    if (!_parser->scanf("{\"info\":[{\"src\":{\"asset_id\":\"%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c\"},\"isSafe\":%c", asset_id, 
-                                                                asset_id+1, asset_id+2, asset_id+3, asset_id+4, asset_id+5, asset_id+6,
-                                                                asset_id+7, asset_id+8, asset_id+9, asset_id+10, asset_id+11,
-                                                                asset_id+12, asset_id+13, asset_id+14, asset_id+15, asset_id+16, asset_id+17, asset_id+18,
-                                                                asset_id+19, asset_id+20, asset_id+21, asset_id+22, asset_id+23, isSafeChar))
-    {
-        status = Q_FAILURE; 
-    }
-    free(asset_id);
-    if (!_parser->recv("+QHTTPREAD: 0"))
-	{
-        status = Q_FAILURE; //if for any reason it fails return that is safe
-	}
-    
-    mutex_unlock();
-    if(isSafeChar[0] == 't' || status == -1) //if it failed assume its safe
+    mutex_lock();
+    if (!found)
+    {
+        _ttff_metrics.failures++;
+        mutex_unlock();
+        return Q_FAILURE;
+    }
+    _ttff_metrics.fixes[kind]++;
+    _ttff_metrics.total_ms[kind] += ttff_ms;
+    if (ttff_ms > _ttff_metrics.max_ms[kind])
     {
-        return true;
-    } 
-    else 
+        _ttff_metrics.max_ms[kind] = ttff_ms;
+    }
+    // Assisted if the XTRA data was valid when the session started
+    out.assisted = (_xtra_expires > 0 && _xtra_expires > time(nullptr));
+    if (out.assisted)
     {
-        return false;
+        _ttff_metrics.assisted[kind]++;
+        _ttff_metrics.assisted_ms[kind] += ttff_ms;
     }
+    out.start = kind;
+    out.ttff_ms = ttff_ms;
+    out.age_ms = 0;
+    out.cached = false;
+    _last_fix = out;
+    _fix_time = Kernel::Clock::now();
+    _fix_cached = true;
+    mutex_unlock();
+    return Q_SUCCESS;
 }
 
-
-
-int QUECTEL_BG77::turn_off_module()
+void QUECTEL_BG77::get_ttff_metrics(ttff_metrics &metrics)
 {
-    int status = 0;
     mutex_lock();
-    // _parser->send("AT+QGPSEND");
-    // if (!_parser->recv("OK"))
-	// {
-	// 	status = Q_FAILURE;	
-	// }
-    // ThisThread::sleep_for(100ms);
+    metrics = _ttff_metrics;
+    mutex_unlock();
+}
 
-    _parser->send("AT+QPOWD");
-    if (!_parser->recv("OK"))
+int QUECTEL_BG77::parse_latlon(float &lon, float &lat)
+{
+    BG77_SPAN(SPAN_PARSE_LATLON);
+    const fix_request request = { GNSS_MAX_HDOP, GNSS_FIX_TIMEOUT_S, 0 };
+    gnss_fix fix;
+    int status = get_location(fix, request);
+    if (status == Q_SUCCESS)
     {
-	    status = Q_FAILURE;		
+        lat = fix.fix.latitude;
+        lon = fix.fix.longitude;
     }
-    ThisThread::sleep_for(100ms);
-    mutex_unlock();
-    return (status);
+	return status;
 }
 
-int QUECTEL_BG77::cops_info()
+int QUECTEL_BG77::query_satellite_system()
 {
     int status = 0;
     mutex_lock();
-    _parser->send("AT+COPS=?");
-	if (!_parser->recv("OK"))
-	{
-		status = Q_FAILURE;
-	}
+    status = _command("AT+QGPSCFG=\"gnssconfig\"");
     mutex_unlock();
 	return (status);
 }
 
-int QUECTEL_BG77::activate_pdp()
+int QUECTEL_BG77::nmea_configuration()
 {
     int status = 0;
-    char qiBuff[64];
     mutex_lock();
-    _parser->set_timeout(10000);
-    _parser->send("AT+COPS?");
-    if (!_parser->recv("+COPS: 0,0,\"Vodafone\",9")) 
-	{
-        enable_autoconnect();
-        //todo: qiact?
-		status = Q_FAILURE;
-	}
-    char qibuff[16];
-    _parser->send("AT+QIACT?");
-    if(!((_parser->scanf("+QIACT: 1,1,1,\"%12s\"", qibuff)) 
-        || (_parser->scanf("+QIACT: 1,1,1,\"%13s\"", qibuff))
-        || (_parser->scanf("+QIACT: 1,1,1,\"%14s\"", qibuff))
-        || (_parser->scanf("OK"))))
+    if (_command("AT+QGPSCFG=\"gpsnmeatype\",31") != Q_SUCCESS 
+        || _command("AT+QGPSCFG=\"nmeasrc\",1") != Q_SUCCESS)
     {
-        _parser->set_timeout(1000);
-        _parser->send("AT+QIACT=1");
-        //rtos::ThisThread::sleep_for(300ms);
-        if (!_parser->recv("OK"))
-        {
-           status = Q_FAILURE;
-        }
+        status = Q_FAILURE;
     }
-    _parser->send("AT+CGDCONT?");
-    if (!_parser->recv("OK"))
-	{
-		status = Q_FAILURE;	
-	}
-    //ThisThread::sleep_for(200ms);
     mutex_unlock();
 	return (status);
 }
 
-int QUECTEL_BG77::define_pdp_nbiot()
+int QUECTEL_BG77::enable_xtra()
 {
-    int status = 0;
-    mutex_lock();
-    _parser->send("AT+CGDCONT=1,\"IP\",\"lpwa.vodafone.iot\"");
-    if (!_parser->recv("OK"))
-	{
-		status = Q_FAILURE;	
-	}
-    mutex_unlock();
-	return (status);
+    return xtra_refresh(XTRA_REFRESH_S);
 }
 
-char * QUECTEL_BG77::sync_ntp()
+int QUECTEL_BG77::rf_select(rf_owner_t owner)
 {
-    mutex_lock();
     int status = 0;
-    activate_pdp();
-    _parser->flush();
-    _parser->set_timeout(30000); //important 
-    char * timeBuff;
-    timeBuff = (char *) malloc(24); 
-    //todo: Check if google ntp is faster? http://time.google.com/ 
-    _parser->send("AT+QNTP=1,\"pool.ntp.org\",123,1");
-    if (!( _parser->recv("OK") && _parser->scanf("+QNTP: %d,\"%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c\"", &status, timeBuff, 
-        timeBuff+1, timeBuff+2, timeBuff+3, timeBuff+4, timeBuff+5, timeBuff+6, timeBuff+7, timeBuff+8, 
-        timeBuff+9, timeBuff+10, timeBuff+11, timeBuff+12, timeBuff+13, timeBuff+14, timeBuff+15, timeBuff+16, 
-        timeBuff+17, timeBuff+18, timeBuff+19,timeBuff+20,timeBuff+21)))
+    mutex_lock();
+    if (_rf_owner != owner)
     {
-        status = Q_FAILURE;
+        // 0 gives GNSS the RF path, 1 gives it to WWAN
+        status = _command("AT+QGPSCFG=\"priority\",%d", (owner == RF_GNSS) ? 0 : 1);
+        if (status == Q_SUCCESS)
+        {
+            Kernel::Clock::time_point now = Kernel::Clock::now();
+            if (_rf_owner >= 0)
+            {
+                _rf_metrics.owner_ms[_rf_owner] += (now - _rf_since).count();
+                _rf_metrics.switches++;
+            }
+            _rf_owner = owner;
+            _rf_since = now;
+        }
+        else
+        {
+            _rf_owner = -1;
+        }
     }
-    if (timeBuff[0] != '2' || status == -1)
+    // LTE work goes on at least until now, rf_run() lines GNSS up with the quiet after it
+    if (status == Q_SUCCESS && owner == RF_WWAN)
     {
+        _rf_wwan_end = Kernel::Clock::now();
+    }
+    mutex_unlock();
+    return status;
+}
 
-        _parser->send("AT+CCLK?");
-        if (!(_parser->scanf("\n+CCLK: \"%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c%c\"", timeBuff+2, timeBuff+3, timeBuff+4, 
-                            timeBuff+5, timeBuff+6, timeBuff+7, timeBuff+8, timeBuff+9, timeBuff+10, timeBuff+11, timeBuff+12, timeBuff+13, timeBuff+14, 
-                            timeBuff+15, timeBuff+16, timeBuff+17, timeBuff+18, timeBuff+19,timeBuff+20,timeBuff+21)) && (_parser->recv("\nOK")))
+int QUECTEL_BG77::rf_schedule(const rf_job &job)
+{
+    int status = Q_FAILURE;
+    mutex_lock();
+    for (int i = 0; i < RF_JOBS; i++)
+    {
+        if (!_rf_jobs[i].used)
         {
-            //sprintf (timeBuff,"%s", previous_timeBuff); //todo: hold the previous time in case all fail?
+            _rf_jobs[i].job = job;
+            _rf_jobs[i].deadline = Kernel::Clock::now() + std::chrono::milliseconds(job.deadline_ms);
+            _rf_jobs[i].used = true;
+            status = Q_SUCCESS;
+            break;
         }
-        //
-        timeBuff[0] = '2';
-        timeBuff[1] = '0';
     }
-    /** Format the time 
-     */
-    timeBuff[4] = 45;
-    timeBuff[7] = 45;
-    timeBuff[10] = 84;
-    timeBuff[19] = 90; //I need the first 20 bytes
-
     mutex_unlock();
-    return timeBuff;
+    return status;
 }
 
-int QUECTEL_BG77::parse_latlon(float &lon, float &lat)
+int QUECTEL_BG77::_rf_next(Kernel::Clock::time_point now)
 {
-    int status = 0;
-    mutex_lock();
-    _parser->set_timeout(5000);
-    _parser->send("AT+QGPSCFG=\"priority\",0");
-	if (!_parser->recv("OK"))
+    int best[RF_OWNERS] = { -1, -1 };
+    for (int i = 0; i < RF_JOBS; i++)
     {
-       status = Q_FAILURE;
+        if (!_rf_jobs[i].used)
+        {
+            continue;
+        }
+        // Earliest deadline first, the higher priority among equal deadlines
+        int &b = best[_rf_jobs[i].job.owner];
+        if (b < 0 || _rf_jobs[i].deadline < _rf_jobs[b].deadline 
+            || (_rf_jobs[i].deadline == _rf_jobs[b].deadline && _rf_jobs[i].job.priority > _rf_jobs[b].job.priority))
+        {
+            b = i;
+        }
     }
-    _parser->send("AT+QGPSCFG=\"gpsnmeatype\",31");
-    if (!_parser->recv("OK"))
+    if (best[RF_WWAN] < 0 || best[RF_GNSS] < 0)
     {
-        status = Q_FAILURE;
+        return (best[RF_WWAN] >= 0) ? best[RF_WWAN] : best[RF_GNSS];
     }
-    _parser->send("AT+QGPSCFG=\"nmeasrc\",1");
-    if (!_parser->recv("OK"))
+    int first = (_rf_jobs[best[RF_WWAN]].deadline <= _rf_jobs[best[RF_GNSS]].deadline) ? RF_WWAN : RF_GNSS;
+    int stay = (_rf_owner >= 0) ? _rf_owner : first;
+    int other = best[1 - stay];
+    // Stay while the other side's most urgent job still starts in time after this one
+    if (now + std::chrono::milliseconds(_rf_jobs[best[stay]].job.duration_ms) <= _rf_jobs[other].deadline)
     {
-        status = Q_FAILURE;
+        return best[stay];
     }
-    _parser->send("AT+QGPS=1");
-    if (!_parser->recv("OK"))
+    return other;
+}
+
+int QUECTEL_BG77::rf_run()
+{
+    int status = Q_SUCCESS;
+    granted_timers timers;
+    uint32_t quiet_ms = 0;
+    if (get_granted_timers(timers) == Q_SUCCESS)
     {
-        _parser->send("AT+QGPS=1"); //retry?!
-        status = Q_FAILURE;
-    }
-    char utc[12];
-    char cog[7];
-    char date[8];
-    float hdop, altitude, spkm, spkn;
-    int fix, nsat, err;
-    float latt,lonn;
-    _parser->set_timeout(3000);
-    for (int i = 0; i < 6; i++)
-    {
-        _parser->send("AT+QGPSLOC=2");
-        if((_parser->scanf("+QGPSLOC: %10s,%f,%f,%f,%f,%d,%4s,%f,%f,%6s,%d", 
-                            utc, &latt, &lonn, &hdop, &altitude, &fix,
-                            cog,&spkm, &spkn, date, &nsat) && _parser->recv("OK")))
-        {
-            lat = latt;
-            lon = lonn;
-            break;
+        // How long the network may still page the module after it was last active
+        if (timers.active_s != UINT32_MAX)
+        {
+            quiet_ms = timers.active_s * 1000;
+        }
+        else if (timers.edrx_ms > 0)
+        {
+            quiet_ms = timers.ptw_ms;
         }
     }
-    _parser->send("AT+QGPSXTRA=0");
-    if (!_parser->recv("OK"))
+
+    for (;;)
     {
-        status = Q_FAILURE;
+        mutex_lock();
+        Kernel::Clock::time_point now = Kernel::Clock::now();
+        int next = _rf_next(now);
+        if (next < 0)
+        {
+            mutex_unlock();
+            break;
+        }
+        rf_slot slot = _rf_jobs[next];
+        _rf_jobs[next].used = false;
+        bool after_wwan = (_rf_owner == RF_WWAN);
+        Kernel::Clock::time_point quiet = _rf_wwan_end + std::chrono::milliseconds(quiet_ms);
+        mutex_unlock();
+
+        // Line GNSS up with the sleep that follows LTE activity, if it can wait that long
+        if (slot.job.owner == RF_GNSS && after_wwan && quiet_ms > 0)
+        {
+            if (quiet > now && quiet <= slot.deadline)
+            {
+                ThisThread::sleep_for(quiet - now);
+            }
+        }
+
+        if (rf_select(slot.job.owner) != Q_SUCCESS)
+        {
+            status = Q_FAILURE;
+        }
+        mutex_lock();
+        _rf_metrics.jobs++;
+        if (Kernel::Clock::now() > slot.deadline)
+        {
+            _rf_metrics.late++;
+            status = Q_FAILURE;
+        }
+        mutex_unlock();
+        slot.job.run();
+        if (slot.job.owner == RF_WWAN)
+        {
+            mutex_lock();
+            _rf_wwan_end = Kernel::Clock::now();
+            mutex_unlock();
+        }
     }
-    _parser->send("AT+QGPSEND");
-    if (!_parser->recv("OK"))
+    return status;
+}
+
+void QUECTEL_BG77::get_rf_metrics(rf_metrics &metrics)
+{
+    mutex_lock();
+    metrics = _rf_metrics;
+    // The side holding it now has had it since the last switch
+    if (_rf_owner >= 0)
     {
-        _parser->send("AT+QGPSEND");
-        status = Q_FAILURE;
+        metrics.owner_ms[_rf_owner] += (Kernel::Clock::now() - _rf_since).count();
     }
     mutex_unlock();
-	return status;
 }
 
-int QUECTEL_BG77::query_satellite_system()
+int QUECTEL_BG77::get_xtra_status(xtra_status &xtra)
 {
+    static const char *const qgpsxtra[] = { "+QGPSXTRA: %d" };
+    static const char *const qgpsxtradata[] = { "+QGPSXTRADATA: %u,\"%d/%d/%d,%d:%d:%d\"" };
+    unsigned minutes = 0;
+    int enabled = 0;
+    int year, month, day, hour, minute, second;
+    at_response resp;
     int status = 0;
+
+    memset(&xtra, 0, sizeof(xtra));
     mutex_lock();
-    _parser->send("AT+QGPSCFG=\"gnssconfig\"");
+    _send("AT+QGPSXTRA?");
+    xtra.enabled = (_match(resp, qgpsxtra, 1, &enabled) == AT_OK && resp.match == 0 && enabled == 1);
+    // A module without data answers 0,"1980/01/06,00:00:00"
+    _send("AT+QGPSXTRADATA?");
+    if (!(_match(resp, qgpsxtradata, 1, &minutes, &year, &month, &day, &hour, &minute, &second) == AT_OK 
+          && resp.fields == 7))
+    {
+        status = Q_FAILURE;
+    }
+    else if (minutes > 0)
+    {
+        xtra.injected = utc_seconds(year, month, day, hour, minute, second);
+        xtra.expires = xtra.injected + (time_t) minutes * 60;
+    }
+    _xtra_expires = xtra.expires;
     mutex_unlock();
-	return (status);
+    return status;
 }
 
-int QUECTEL_BG77::nmea_configuration()
+int QUECTEL_BG77::_xtra_inject_time()
 {
-    int status = 0;
-    mutex_lock();
-    _parser->send("AT+QGPSCFG=\"gpsnmeatype\",31");
-    _parser->send("AT+QGPSCFG=\"nmeasrc\",1");
-    mutex_unlock();
-	return (status);
+    char utc[24];
+    time_t now = time(nullptr);
+    if (now < VALID_TIME)
+    {
+        return Q_FAILURE;
+    }
+    struct tm t;
+    gmtime_r(&now, &t);
+    strftime(utc, sizeof(utc), "%Y/%m/%d,%H:%M:%S", &t);
+    // <operate> 0 injects, <utc_time>, <force> 1 so the engine does not reject it, <reset> 0,
+    // <uncertainty> 3500 ms for an RTC set to the second
+    return _command("AT+QGPSXTRATIME=0,\"%s\",1,0,3500", utc);
 }
 
-int QUECTEL_BG77::enable_xtra()
+int QUECTEL_BG77::_xtra_upload(Callback<ssize_t(uint8_t *, size_t)> source, size_t len)
 {
-    int status = 0;
-    mutex_lock();
-    _parser->set_timeout(5000);
-    _parser->send("AT+QGPSXTRA?");
-	if (!_parser->recv("OK"))
+    static const char *const qfupl[] = { "+QFUPL: %u" };
+    uint8_t chunk[128];
+    unsigned size = 0;
+    size_t sent = 0;
+    at_response resp;
+
+    _command("AT+QFDEL=\"UFS:%s\"", XTRA_FILE);
+    _send("AT+QFUPL=\"UFS:%s\",%u,60", XTRA_FILE, (unsigned) len);
+    if (_match(resp) != AT_CONNECT)
+    {
+        return Q_FAILURE;
+    }
+    // The module waits for all len bytes, a short source is padded so it lets go
+    bool short_source = false;
+    while (sent < len)
     {
-        _parser->send("AT+QGPSXTRA=1");
-        if (!_parser->recv("OK"))
+        size_t want = (len - sent < sizeof(chunk)) ? len - sent : sizeof(chunk);
+        ssize_t got = source(chunk, want);
+        if (got <= 0)
         {
-            status = Q_FAILURE;	
+            memset(chunk, 0, want);
+            got = want;
+            short_source = true;
+        }
+        if (!_write(chunk, got))
+        {
+            return Q_FAILURE;
         }
-    }	
-    _parser->send("AT+QGPSCFG=\"xtra_info\"");
-    if (!_parser->recv("OK"))
+        sent += got;
+    }
+    if (_match(resp, qfupl, 1, &size) != AT_OK || resp.fields != 1 || size != len || short_source)
     {
-        status = Q_FAILURE;	
+        return Q_FAILURE;
     }
+    int status = _command("AT+QGPSXTRADATA=\"UFS:%s\"", XTRA_FILE);
+    _command("AT+QFDEL=\"UFS:%s\"", XTRA_FILE);
+    return status;
+}
 
-    _parser->send("AT+QGPSCFG=\"xtra_download\",1");
-    //rtos::ThisThread::sleep_for(1s);
-	if (!_parser->recv("OK"))
+int QUECTEL_BG77::xtra_refresh(uint32_t min_remaining_s, Callback<ssize_t(uint8_t *, size_t)> source, size_t len)
+{
+    static const at_step download[] =
+    {
+        { "AT+QGPSCFG=\"xtra_info\"",        nullptr, 0, STEP_CONTINUE, true },
+        { "AT+QGPSCFG=\"xtra_download\",1",  nullptr, 0, STEP_CONTINUE, true },
+    };
+    xtra_status xtra;
+    int status = 0;
+    mutex_lock();
+    get_xtra_status(xtra);
+    // Takes effect from the next boot of the module
+    if (!xtra.enabled && _command("AT+QGPSXTRA=1") != Q_SUCCESS)
     {
         status = Q_FAILURE;
     }
-    
+    _xtra_inject_time();
+
+    // Without a clock the expiry cannot be judged, so the data is renewed
+    time_t now = time(nullptr);
+    if (now >= VALID_TIME && xtra.expires > now + (time_t) min_remaining_s)
+    {
+        mutex_unlock();
+        return status;
+    }
+    if (source && len > 0)
+    {
+        if (_xtra_upload(source, len) != Q_SUCCESS)
+        {
+            status = Q_FAILURE;
+        }
+    }
+    else if (run_sequence(download, sizeof(download) / sizeof(download[0])) != Q_SUCCESS)
+    {
+        status = Q_FAILURE;	
+    }
+    get_xtra_status(xtra);
     mutex_unlock();
 	return (status);
-}
\ No newline at end of file
+}
\ No newline at end of file
@@ -17,6 +17,11 @@
 /** Includes 
  */
 #include <mbed.h>
+#include "quectel_bg77_cbor.h"
+#include "quectel_bg77_json.h"
+#include "quectel_bg77_lzss.h"
+#include "quectel_bg77_nmea.h"
+#include "quectel_bg77_queue.h"
 /**
    Communicating with Quectel according to the AT manual
    https://www.quectel.com/UploadImage/Downlad/Quectel_BG95&BG77_AT_Commands_Manual_V1.0.pdf
@@ -33,6 +38,13 @@
  
  */
 
+/** Per command and per method instrumentation. Define QUECTEL_BG77_STATS=1 to build it in,
+    when it is 0 (default) none of it is compiled.
+ */
+#ifndef QUECTEL_BG77_STATS
+#define QUECTEL_BG77_STATS 0
+#endif
+
 /** TODO List: 1) Better error message handling (divide critical non critical?)
                2) Add new feature by QUECTEL to detect jamming
                3) XTRA enabled? battery?!
@@ -49,6 +61,78 @@ class QUECTEL_BG77
             Q_FAILURE = -1
         };
 
+        /** What a command sequence does when a step fails
+         */
+        enum step_policy_t
+        {
+            STEP_STOP = 0,
+            STEP_CONTINUE = 1
+        };
+
+        /** Settings kept in the module's NVM that the driver remembers writing, so they are
+            only written again when they change. The shadow is only checked against the IMEI 
+            and firmware of the module: if something else changes its NVM, e.g. another host 
+            or a factory reset over the debug UART, call invalidate_config_cache()
+         */
+        enum config_t
+        {
+            CFG_NONE = 0,
+            CFG_BAND,               // AT+QCFG="band"
+            CFG_BANDPRIOR,          // AT+QCFG="nb1/bandprior"
+            CFG_IOTOPMODE,          // AT+QCFG="iotopmode"
+            CFG_GNSS_OUTPORT,       // AT+QGPSCFG="outport"
+            CFG_APN,                // AT+QICSGP
+            CFG_PSM,                // AT+CPSMS
+            CFG_EDRX,               // AT+CEDRXS, AT+QEDRXCFG
+            CFG_PDP,                // AT+CGDCONT of context 1
+            CFG_CA_CERT,            // CA certificate on UFS, AT+QFUPL
+            CFG_CLIENT_CERT,        // client certificate on UFS
+            CFG_CLIENT_KEY,         // client key on UFS
+            CFG_COUNT
+        };
+
+        /** One step of a command sequence, see run_sequence()
+         */
+        struct at_step
+        {
+            const char *command;        // complete command line, e.g. "AT+QCFG=\"band\",0,0,0x80000"
+            const char *expect;         // scanf pattern of the information response, nullptr for OK only
+            uint32_t    timeout_ms;     // 0 for the deadline of the command
+            uint8_t     policy;         // step_policy_t
+            bool        chain;          // may share a line with neighbouring chain steps
+            uint8_t     config;         // config_t the command sets, skipped if the module has it
+        };
+
+        /** Unsolicited result codes reported by the module. Handlers attached with
+            attach_urc() are called with the remainder of the URC line
+         */
+        enum urc_t
+        {
+            URC_CEREG = 0,          // +CEREG:      network registration changed
+            URC_QIND,               // +QIND:       FOTA, SMS, csq indications
+            URC_QHTTPPOST,          // +QHTTPPOST:  http post completed
+            URC_QHTTPREAD,          // +QHTTPREAD:  http read completed
+            URC_QHTTPPOSTFILE,      // +QHTTPPOSTFILE: http post of a file completed
+            URC_QHTTPGET,           // +QHTTPGET:   http get completed
+            URC_QNTP,               // +QNTP:       ntp sync completed
+            URC_QGPSURC,            // +QGPSURC:    gnss events
+            URC_CPIN,               // +CPIN:       sim state changed
+            URC_RDY,                // RDY:         module booted
+            URC_POWERED_DOWN,       // POWERED DOWN
+            URC_QIOPEN,             // +QIOPEN:     socket opened or failed to
+            URC_QIURC,              // +QIURC:      socket data, closed by peer, context deactivated
+            URC_QMTOPEN,            // +QMTOPEN:    mqtt network opened
+            URC_QMTCONN,            // +QMTCONN:    mqtt connect acknowledged
+            URC_QMTDISC,            // +QMTDISC:    mqtt disconnected
+            URC_QMTSUB,             // +QMTSUB:     mqtt subscribe acknowledged
+            URC_QMTPUB,             // +QMTPUB:     mqtt publish acknowledged
+            URC_QMTRECV,            // +QMTRECV:    mqtt message waiting in a receive buffer
+            URC_QMTSTAT,            // +QMTSTAT:    mqtt link state changed
+            URC_CTZE,               // +CTZE:       network time and zone (NITZ)
+            URC_CTZV,               // +CTZV:       network time zone
+            URC_COUNT
+        };
+
 		/** Constructor. Instantiates an ATCmdParser object
 		    on the heap for comms between microcontroller and modem
 		   
@@ -56,8 +140,19 @@ class QUECTEL_BG77
 		   @param rxu Pin connected to quectel RXD (This is MCU RXU)
 		   @param pwkey Pin connected to quectel powerkey
 		   @param baud Baud rate for UART between MCU and quectel
+		   @param gnss_rxu Pin connected to quectel GNSS_TXD, NC to poll positions over AT
 		 */  
-		QUECTEL_BG77(PinName txu, PinName rxu, PinName pwkey, int baud = 115200);
+		QUECTEL_BG77(PinName txu, PinName rxu, PinName pwkey, int baud = 115200, PinName gnss_rxu = NC);
+
+		/** Constructor. Runs the driver over already opened streams instead of
+		    the UART pins, e.g. pseudo-terminals to a modem emulator when the
+		    driver is built for a host. The streams are not owned by the driver.
+
+		   @param fh Stream connected to the quectel AT port
+		   @param pwkey Pin connected to quectel powerkey
+		   @param gnss_fh Stream connected to the quectel GNSS port, nullptr to poll positions over AT
+		 */
+		QUECTEL_BG77(FileHandle *fh, PinName pwkey, FileHandle *gnss_fh = nullptr);
 
 		/** Destructor for the Quactel class. Deletes the BufferedSerial (instead of UartDerial) and ATCmdParser
 		    objects from the heap to release unused memory
@@ -74,6 +169,93 @@ class QUECTEL_BG77
          */
         void mutex_unlock();
 
+        /** Size command deadlines from the response times seen so far instead of the 
+            maximum in the AT manual. The deadline becomes twice the 95th percentile of the 
+            recent responses to that command, never more than the manual's maximum
+            @param enable. true for adaptive deadlines, false for the manual's maximum
+            @return Nothing
+         */
+        void set_adaptive_timeouts(bool enable);
+
+#if QUECTEL_BG77_STATS
+        /** Counters of one AT command
+         */
+        struct command_stats
+        {
+            uint32_t calls;
+            uint32_t ok;                // OK or CONNECT
+            uint32_t failed;            // ERROR, +CME ERROR or timeout
+            uint32_t retries;           // sent again right after failing
+            uint32_t bytes_sent;        // command line and data written after it
+            uint32_t bytes_received;    // everything read until the next command
+            uint16_t latency_hist[14];  // response times, bucket b is < 25ms << b, the last is open
+        };
+
+        /** Methods timed as a whole
+         */
+        enum span_t
+        {
+            SPAN_TCPIP_STARTUP = 0,
+            SPAN_CSQ,
+            SPAN_SEND_HTTP_POST,
+            SPAN_PARSE_LATLON,
+            SPAN_SYNC_NTP,
+            SPAN_RESUME,
+            SPAN_MQTT_PUBLISH,
+            SPAN_HTTP_DOWNLOAD,
+            SPAN_COUNT
+        };
+
+        /** Wall time of one method
+         */
+        struct span_stats
+        {
+            uint32_t count;
+            uint32_t total_ms;
+            uint32_t max_ms;
+        };
+
+        /** Number of command counters. The last one collects commands that are not in 
+            the timeout table
+         */
+        int command_stats_count();
+
+        /** Copy the counters of a command
+            @param index. 0 to command_stats_count() - 1
+            @param stats. Counters of the command
+            @return the command, e.g. "AT+QIACT", nullptr if index is out of range
+         */
+        const char *get_command_stats(int index, command_stats &stats);
+
+        /** Copy the wall time of a method
+         */
+        void get_span_stats(span_t span, span_stats &stats);
+
+        /** Clear all counters
+         */
+        void reset_stats();
+
+        /** Write all counters as a compact binary record: "B7", version, number of commands, 
+            number of buckets, number of spans, then per command calls, ok, failed, retries,
+            bytes sent, bytes received (u32) and the latency buckets (u16), then per span
+            count, total and max ms (u32). All little endian
+            @param buffer. Where to write, nullptr to ask for the size
+            @param len. Size of the buffer
+            @return bytes written, or bytes needed if the buffer is too small
+         */
+        size_t dump_stats(uint8_t *buffer, size_t len);
+#endif
+
+        /** Register a handler for an unsolicited result code. URCs are read by a background
+            thread whenever the driver is idle and while commands are waiting for responses,
+            so handlers run with the driver lock held and must not block for long.
+            @param type. URC to handle
+            @param handler. Called with the rest of the URC line after the prefix, 
+                            nullptr to detach
+            @return Nothing
+         */
+        void attach_urc(urc_t type, Callback<void(const char *)> handler);
+
 		/** Send "AT" command
             @return Indicates success or failure 
          */
@@ -110,6 +292,25 @@ class QUECTEL_BG77
          */
         int cfun(int mode);
 
+        /** Run a sequence of commands under one lock. Neighbouring steps that are marked
+            chain and only expect OK are sent on one line ("AT+A;+B;+C") to save UART round 
+            trips. If such a line fails the module has stopped at the failing command, so 
+            its steps are run again one at a time to find it.
+            @param steps. Commands to run, in order
+            @param count. Number of steps
+            @param results. Optional, Q_SUCCESS or Q_FAILURE for every step. Steps not run
+                            after a STEP_STOP failure are Q_FAILURE
+            @return Q_SUCCESS if every step succeeded
+         */
+        int run_sequence(const at_step *steps, size_t count, int *results = nullptr);
+
+        /** Forget which settings the module holds, so the next configuration writes them
+            all again. Called by reset_band_config() and after a firmware update, call it 
+            if the module's NVM is changed behind the driver's back
+            @return Nothing
+         */
+        void invalidate_config_cache();
+
         /** Query network info and set band configuartion. Default value is LTE
             Configure RAT Searching Sequence, qcfg_configuration
         
@@ -153,6 +354,21 @@ class QUECTEL_BG77
          */
         int csq(const char *apn);
 
+        /** Signal metrics of the serving cell, from AT+QCSQ
+         */
+        struct signal_metrics
+        {
+            int rssi;       // dBm
+            int rsrp;       // dBm
+            int sinr;       // in 1/5 dB, as the module reports it
+            int rsrq;       // dB
+        };
+
+        /** Read the signal metrics of the serving cell
+            @return Q_SUCCESS if the module is on a LTE cell and reported them
+         */
+        int get_signal(signal_metrics &metrics);
+
         /** Query connection 
          *  @return status. Returns true if connected to Nb-iot
          */
@@ -180,6 +396,8 @@ class QUECTEL_BG77
             @param mode. <mode>     0: Enter PSM after T3324 expires (active timer), 
                                     1: Enter PSM immediately after RRC connection release is received, 
                                     (An RRC connection release message may be signaled to the UE to put the UE into an RRC idle state)
+            eDRX is requested with a 10485.76 s cycle on NB-IoT (AT+CEDRXS=1,5,"1111") unless 
+            set_edrx() chose the settings
          */
         int enter_psm(int mode);
 
@@ -187,6 +405,195 @@ class QUECTEL_BG77
          */
         int disable_psm();
 
+        /** Access technology of the eDRX settings, <AcT-type> of AT+CEDRXS
+         */
+        enum act_t
+        {
+            ACT_CATM = 4,
+            ACT_NBIOT = 5
+        };
+
+        /** GPRS Timer 3 and GPRS Timer 2 value meaning the timer is deactivated
+         */
+        static constexpr uint8_t TIMER_DEACTIVATED = 0xE0;
+
+        /** Encode a duration as GPRS Timer 3 (3GPP TS 24.008 10.5.7.4a), the format of the 
+            requested periodic TAU (T3412). The nearest representable value is chosen
+            @param seconds. Requested duration, UINT32_MAX to deactivate the timer
+            @return unit in bits 7-5, value in bits 4-0
+         */
+        static constexpr uint8_t gprs_timer3(uint32_t seconds)
+        {
+            if (seconds == UINT32_MAX)
+            {
+                return TIMER_DEACTIVATED;
+            }
+            uint8_t best = 0;
+            uint32_t best_error = UINT32_MAX;
+            for (uint8_t unit = 0; unit < 7; unit++)
+            {
+                uint32_t step = gprs_timer3_seconds(unit << 5 | 1);
+                uint32_t value = (seconds + step / 2) / step;
+                value = (value > 31) ? 31 : value;
+                uint32_t error = (value * step > seconds) ? value * step - seconds : seconds - value * step;
+                // Prefer the finer unit on a tie, it has more room around the value
+                if (error < best_error || (error == best_error && step < gprs_timer3_seconds(best | 1)))
+                {
+                    best = unit << 5 | value;
+                    best_error = error;
+                }
+            }
+            return best;
+        }
+
+        /** Decode GPRS Timer 3
+            @return duration in seconds, UINT32_MAX if deactivated
+         */
+        static constexpr uint32_t gprs_timer3_seconds(uint8_t timer)
+        {
+            return (timer >> 5) == 0 ? (timer & 31) * 600UL
+                 : (timer >> 5) == 1 ? (timer & 31) * 3600UL
+                 : (timer >> 5) == 2 ? (timer & 31) * 36000UL
+                 : (timer >> 5) == 3 ? (timer & 31) * 2UL
+                 : (timer >> 5) == 4 ? (timer & 31) * 30UL
+                 : (timer >> 5) == 5 ? (timer & 31) * 60UL
+                 : (timer >> 5) == 6 ? (timer & 31) * 1152000UL
+                 : UINT32_MAX;
+        }
+
+        /** Encode a duration as GPRS Timer 2 (3GPP TS 24.008 10.5.7.3), the format of the 
+            requested active time (T3324). The nearest representable value is chosen
+            @param seconds. Requested duration, UINT32_MAX to deactivate the timer
+            @return unit in bits 7-5, value in bits 4-0
+         */
+        static constexpr uint8_t gprs_timer2(uint32_t seconds)
+        {
+            if (seconds == UINT32_MAX)
+            {
+                return TIMER_DEACTIVATED;
+            }
+            uint8_t best = 0;
+            uint32_t best_error = UINT32_MAX;
+            for (uint8_t unit = 0; unit < 3; unit++)
+            {
+                uint32_t step = gprs_timer2_seconds(unit << 5 | 1);
+                uint32_t value = (seconds + step / 2) / step;
+                value = (value > 31) ? 31 : value;
+                uint32_t error = (value * step > seconds) ? value * step - seconds : seconds - value * step;
+                if (error < best_error)
+                {
+                    best = unit << 5 | value;
+                    best_error = error;
+                }
+            }
+            return best;
+        }
+
+        /** Decode GPRS Timer 2
+            @return duration in seconds, UINT32_MAX if deactivated
+         */
+        static constexpr uint32_t gprs_timer2_seconds(uint8_t timer)
+        {
+            return (timer >> 5) == 0 ? (timer & 31) * 2UL
+                 : (timer >> 5) == 1 ? (timer & 31) * 60UL
+                 : (timer >> 5) == 2 ? (timer & 31) * 360UL
+                 : UINT32_MAX;
+        }
+
+        /** Encode an eDRX cycle (3GPP TS 24.008 10.5.5.32). NB-IoT only has some of the 
+            cycles of Cat-M, the nearest one it has is chosen
+            @param ms. Requested cycle in milliseconds
+            @param act. Access technology
+            @return 4 bit eDRX value
+         */
+        static constexpr uint8_t edrx_value(uint32_t ms, act_t act)
+        {
+            uint8_t best = (act == ACT_NBIOT) ? 2 : 0;
+            uint32_t best_error = UINT32_MAX;
+            for (uint8_t value = 0; value < 16; value++)
+            {
+                if (act == ACT_NBIOT && (value < 2 || value == 4 || (value > 5 && value < 9)))
+                {
+                    continue;
+                }
+                uint32_t cycle = edrx_ms(value, act);
+                uint32_t error = (cycle > ms) ? cycle - ms : ms - cycle;
+                if (error < best_error)
+                {
+                    best = value;
+                    best_error = error;
+                }
+            }
+            return best;
+        }
+
+        /** Decode an eDRX cycle
+            @return cycle in milliseconds
+         */
+        static constexpr uint32_t edrx_ms(uint8_t value, act_t act)
+        {
+            // Values NB-IoT does not have are taken as 20.48 s
+            return (act == ACT_NBIOT && (value < 2 || value == 4 || (value > 5 && value < 9))) ? 20480UL
+                 : (value < 4) ? 5120UL << value
+                 : (value < 10) ? 5120UL * 4 * (value - 1)
+                 : 5120UL << (value - 4);
+        }
+
+        /** Encode a paging time window, 1.28 s steps on Cat-M and 2.56 s steps on NB-IoT
+            @param ms. Requested window in milliseconds
+            @param act. Access technology
+            @return 4 bit PTW value
+         */
+        static constexpr uint8_t ptw_value(uint32_t ms, act_t act)
+        {
+            return (ms + ptw_ms(0, act) / 2) / ptw_ms(0, act) <= 1 ? 0
+                 : (ms + ptw_ms(0, act) / 2) / ptw_ms(0, act) >= 16 ? 15
+                 : (ms + ptw_ms(0, act) / 2) / ptw_ms(0, act) - 1;
+        }
+
+        /** Decode a paging time window
+            @return window in milliseconds
+         */
+        static constexpr uint32_t ptw_ms(uint8_t value, act_t act)
+        {
+            return (value + 1UL) * ((act == ACT_NBIOT) ? 2560UL : 1280UL);
+        }
+
+        /** Power saving timers the network granted, which may differ from the requested ones
+         */
+        struct granted_timers
+        {
+            uint32_t tau_s;         // periodic TAU (T3412), UINT32_MAX if not granted
+            uint32_t active_s;      // active time (T3324), UINT32_MAX if not granted
+            uint32_t edrx_ms;       // eDRX cycle, 0 if eDRX is not used
+            uint32_t ptw_ms;        // paging time window, 0 if eDRX is not used
+        };
+
+        /** Request power saving mode with the given timers, AT+CPSMS
+            @param tau_s. Periodic TAU (T3412), how often the module wakes to update its tracking area,
+                          UINT32_MAX for none
+            @param active_s. Active time (T3324), how long it stays reachable after it was active,
+                             UINT32_MAX for none
+            @return Q_SUCCESS if the module accepted the request
+         */
+        int set_psm_timers(uint32_t tau_s, uint32_t active_s);
+
+        /** Request eDRX with the given cycle, AT+CEDRXS. With a paging time window AT+QEDRXCFG 
+            is used instead, which sets both
+            @param act. Access technology the setting applies to
+            @param cycle_ms. eDRX cycle
+            @param window_ms. Paging time window, 0 to keep the module's
+            @return Q_SUCCESS if the module accepted the request
+         */
+        int set_edrx(act_t act, uint32_t cycle_ms, uint32_t window_ms = 0);
+
+        /** Read the timers the network granted, from +CEREG: 4 and AT+CEDRXRDP. The +CEREG 
+            URC format in use before the call is restored
+            @param timers. Filled with the granted values
+            @return Q_SUCCESS if the module is registered and reported them
+         */
+        int get_granted_timers(granted_timers &timers);
+
         /** Operator Selection. 
            @param mode. <mode>      0: Automatic
                                     1: Manual TODO: do the manual selection
@@ -200,16 +607,103 @@ class QUECTEL_BG77
          */
         int auto_zone_update();
 
-        /**  Configure TCP
+        /** Blocking attach: CFUN=1, band configuration, SIM, then signal and PDP context 
+            with csq(). Each step is retried with the backoff of attach() until it succeeds 
+            or runs out of tries
+            @param apn. APN of the PDP context
+            @return Q_SUCCESS if the last try of every step succeeded
          */
         int tcpip_startup(const char *apn);
 
+        /** Resume after a PSM wake. One chained query checks that registration, the PDP 
+            context and the SIM survived the sleep; only if one of them did not is the full 
+            tcpip_startup run again
+            @param apn. APN, used only if a full startup is needed
+            @param warm. If not nullptr, set to true when the module was ready without startup
+            @return Q_SUCCESS if the module is ready to send
+         */
+        int resume(const char *apn, bool *warm = nullptr);
+
+        /** Stages of the non-blocking attach
+         */
+        enum attach_state_t
+        {
+            ATTACH_IDLE = 0,
+            ATTACH_SIM,             // CFUN=1, band configuration, waiting for the SIM
+            ATTACH_REGISTER,        // waiting for EPS registration
+            ATTACH_PDP,             // activating the PDP context
+            ATTACH_DONE,
+            ATTACH_FAILED
+        };
+
+        /** Timing of the last attach
+         */
+        struct attach_metrics
+        {
+            uint32_t total_ms;          // time to attach, from attach() to the callback
+            uint32_t stage_ms[3];       // time spent in ATTACH_SIM, ATTACH_REGISTER, ATTACH_PDP
+            uint32_t retries;           // polls that found a stage not done yet
+            int      result;            // Q_SUCCESS or Q_FAILURE
+        };
+
+        /** Attach to the network without blocking: SIM ready, then registered, then PDP 
+            context active. It runs on the driver's work thread and advances as soon as +CPIN 
+            or +CEREG URCs report progress, polling with exponential backoff as a fallback. 
+            Every stage gives up after a bounded number of polls
+            @param apn. APN of the PDP context
+            @param done. Called on the work thread with Q_SUCCESS or Q_FAILURE when it ends
+            @return Q_SUCCESS if it started, Q_FAILURE if an attach is already running
+         */
+        int attach(const char *apn, Callback<void(int)> done);
+
+        /** Stage of the current or last attach
+         */
+        attach_state_t attach_state();
+
+        /** Timing of the last attach, to tune cold and warm attach
+         */
+        void get_attach_metrics(attach_metrics &metrics);
+
 
         /** Configure Parameters for HTTP(S) Server. 
            @return Indicates success or failure 
          */
         int configure_http_server();
 
+        /** TLS setup of SSL context 1, used by the http client
+         */
+        struct ssl_config
+        {
+            const char *ca_cert;            // PEM, nullptr to not verify the server
+            size_t      ca_len;
+            const char *client_cert;        // PEM, nullptr without client authentication
+            size_t      client_len;
+            const char *client_key;
+            size_t      key_len;
+            bool        session_cache;      // resume TLS sessions instead of full handshakes
+            bool        keep_alive;         // ask the server to keep the connection between posts
+        };
+
+        /** Connection setups of https posts, from AT+QHTTPPOST until CONNECT, which takes 
+            the TCP connect and the TLS handshake
+         */
+        struct ssl_metrics
+        {
+            uint32_t handshakes;
+            uint32_t total_ms;
+            uint32_t max_ms;
+        };
+
+        /** Set up SSL context 1 and bind the http client to it. Certificates are uploaded to
+            UFS only when the module does not hold the same ones already
+            @return Q_SUCCESS if the context is ready
+         */
+        int ssl_setup(const ssl_config &config);
+
+        /** Handshake count and time since the last call to ssl_setup()
+         */
+        void get_ssl_metrics(ssl_metrics &metrics);
+
         /** Configure Parameters for HTTP(S) Server. 
             @return Indicates success or failure 
          */
@@ -231,6 +725,295 @@ class QUECTEL_BG77
         //bool send_http_post(float lat,  float lon,  const char *stateStr);
         bool send_http_post(const char* http_header, uint8_t *http_body, size_t body_len, const char *stateStr);
 
+        /** One piece of a scatter-gather http body
+         */
+        struct http_fragment
+        {
+            const void *data;
+            size_t      len;
+        };
+
+        /** Sends the post to the server, writing each body fragment straight to the UART 
+            after CONNECT. Nothing is copied, so the fragments can live anywhere
+            @param http_header. Request header, ending in "Content-Length: "
+            @param fragments. Body fragments, sent in order
+            @param count. Number of fragments
+            @return true if safe, false if recovery needed
+         */
+        bool send_http_post(const char* http_header, const http_fragment *fragments, size_t count, const char *stateStr);
+
+        /** Result of a http post
+         */
+        struct http_response
+        {
+            int                         http_code;      // <httprspcode> of +QHTTPPOST, 0 if none
+            size_t                      content_length; // <content_length> of +QHTTPPOST
+            QUECTEL_BG77_JSON::field   *fields;         // key paths to extract from the body, may be nullptr
+            size_t                      field_count;
+        };
+
+        /** Sends the post to the server and scans the JSON response as it is read from the UART.
+            Values of the registered key paths are stored in their fields, whatever the key order
+            @param http_header. Request header, ending in "Content-Length: "
+            @param fragments. Body fragments, sent in order
+            @param count. Number of fragments
+            @param response. Fields to extract, http code and content length are filled in
+            @param content_type. If not nullptr, replaces the Content-Type of the header, 
+                                 e.g. QUECTEL_BG77_CBOR::CONTENT_TYPE
+            @return Q_SUCCESS if the server answered with 2xx and the body was read, else Q_FAILURE
+         */
+        int http_post(const char* http_header, const http_fragment *fragments, size_t count, http_response &response,
+                      const char *content_type = nullptr);
+
+        /** Sends the post to the server, pulling the body from a callback in small chunks.
+            Use it for bodies larger than free RAM, e.g. logs kept in flash
+            @param http_header. Request header, ending in "Content-Length: "
+            @param body_source. Fills up to len bytes of the buffer and returns how many it
+                                wrote, 0 or negative when it has nothing more
+            @param body_len. Total body length, must be known up front for Content-Length
+            @return true if safe, false if recovery needed
+         */
+        bool send_http_post(const char* http_header, Callback<ssize_t(uint8_t *, size_t)> body_source, 
+                            size_t body_len, const char *stateStr);
+
+        /** Sends a compressed post, for bulk uploads such as logs. The body is pulled from a 
+            callback, compressed on the fly (see QUECTEL_BG77_LZSS) and staged with its header 
+            in a file on the module's UFS, as the compressed length is only known at the end. 
+            Content-Length is written as a space padded placeholder and filled in before 
+            AT+QHTTPPOSTFILE sends the file
+            @param http_header. Request header, ending in "Content-Length: ". Content-Encoding
+                                is set to QUECTEL_BG77_LZSS::CONTENT_ENCODING
+            @param body_source. Fills up to len bytes of the buffer and returns how many it
+                                wrote, 0 at the end of the body, negative on error
+            @param response. Fields to extract, http code and content length are filled in
+            @return Q_SUCCESS if the server answered with 2xx and the body was read, else Q_FAILURE
+         */
+        int http_post_compressed(const char* http_header, Callback<ssize_t(uint8_t *, size_t)> body_source, 
+                                 http_response &response);
+
+        /** Progress of a http download. Keep it across calls: after a failure, calling 
+            http_download() again with it resumes from the first byte not yet delivered
+         */
+        struct http_download_state
+        {
+            size_t      offset;         // next byte to fetch, 0 to start from the beginning
+            size_t      total;          // size of the resource, 0 until the server told it
+            size_t      bytes;          // delivered to the sink by the last call
+            uint32_t    elapsed_ms;     // duration of the last call
+            uint32_t    bytes_per_s;    // throughput of the last call
+        };
+
+        /** Download a resource of any size in range requests of chunk_len bytes, each read 
+            from the UART straight into the sink through a small buffer. Set the URL with 
+            set_http_url() first. A range that fails is requested again a few times before
+            giving up; state.offset always points at the first byte the sink has not had
+            @param http_header. Request header, e.g. "GET /fw.bin HTTP/1.1\r\nHost: x\r\n", 
+                                every line ends in "\r\n". The Range field and the blank line 
+                                are added
+            @param sink. Takes each piece of the body in order, returns Q_SUCCESS to go on,
+                         anything else stops the download
+            @param state. Offset to start from, progress and throughput are filled in
+            @param chunk_len. Bytes per range request
+            @return Q_SUCCESS once the whole resource is delivered, else Q_FAILURE
+         */
+        int http_download(const char *http_header, Callback<int(const uint8_t *, size_t)> sink, 
+                          http_download_state &state, size_t chunk_len = 4096);
+
+        /** Send the oldest records of a queue in one post, as the JSON array [record,record,...], 
+            so each record must be a JSON value. The server acknowledges with an integer at 
+            ack_path in its JSON response, the number of records it stored from the start of the 
+            array; without one a 2xx response acknowledges them all. Acknowledged records are 
+            removed from the queue, the others are sent again by the next flush. Records are sent
+            up to the first one that cannot be read, and the queue is held against overwrites
+            until the acknowledgement is applied
+            @param queue. Queue to flush
+            @param http_header. Request header, Content-Length is filled in
+            @param max_records. Most records in the post
+            @param ack_path. Key path of the acknowledgement in the response
+            @return Q_SUCCESS if every record that was sent is acknowledged, Q_FAILURE also if 
+                    the oldest record cannot be read
+         */
+        int flush_queue(QUECTEL_BG77_QUEUE &queue, const char *http_header, size_t max_records = 32, 
+                        const char *ack_path = "ack");
+
+        /** Sockets of the module's TCP/IP stack, with connectID 0 to SOCKET_COUNT - 1, on PDP 
+            context 1. They are opened in buffer access mode: +QIURC: "recv" tells data 
+            is waiting and socket_recv() reads it with AT+QIRD. Payloads go both ways as 
+            binary, AT+QISEND takes the length up front so nothing is escaped or hex encoded
+         */
+        static const int SOCKET_COUNT = 4;
+
+        /** Largest payload of one AT+QISEND or AT+QIRD
+         */
+        static const size_t SOCKET_MTU = 1460;
+
+        /** Longest remote host name, keeps AT+QIOPEN and AT+QISEND within the 256 byte 
+            command buffer of ATCmdParser
+         */
+        static const size_t SOCKET_HOST_LEN = 128;
+
+        enum socket_type_t
+        {
+            SOCKET_TCP = 0,         // "TCP" client
+            SOCKET_UDP              // "UDP SERVICE", may send to and receive from any host
+        };
+
+        /** Open a socket
+            @param type. SOCKET_TCP connects to host, SOCKET_UDP only binds the local port
+            @param host. Remote host of a TCP socket, IP address or domain name, up to SOCKET_HOST_LEN
+            @param port. Remote port of a TCP socket, local port of a UDP socket (0 for any)
+            @return connectID of the socket, Q_FAILURE if none is free or it did not open
+         */
+        int socket_open(socket_type_t type, const char *host, uint16_t port);
+
+        /** Send on a socket
+            @param id. connectID
+            @param data. Payload
+            @param len. Payload length, up to SOCKET_MTU
+            @param host. Remote host of a UDP socket, up to SOCKET_HOST_LEN, nullptr for TCP
+            @param port. Remote port of a UDP socket
+            @return Q_SUCCESS if the module took the payload
+         */
+        int socket_send(int id, const void *data, size_t len, const char *host = nullptr, uint16_t port = 0);
+
+        /** Read what the socket received
+            @param id. connectID
+            @param data. Receives the payload
+            @param len. Size of data
+            @param host. If not nullptr, receives the sender of a UDP datagram, 16 bytes at least
+            @param port. If not nullptr, receives the port of the sender of a UDP datagram
+            @return bytes read, 0 if nothing is waiting, Q_FAILURE on error
+         */
+        int socket_recv(int id, void *data, size_t len, char *host = nullptr, uint16_t *port = nullptr);
+
+        /** Close a socket
+         */
+        int socket_close(int id);
+
+        /** False once the peer closed the socket or the PDP context went down
+         */
+        bool socket_connected(int id);
+
+        /** Call back, on the URC thread, when data arrives on the socket or it is closed
+         */
+        void socket_attach(int id, Callback<void()> event);
+
+        /** MQTT client of the module, client index 0 on PDP context 1
+         */
+        struct mqtt_config
+        {
+            const char *host;           // up to MQTT_HOST_LEN
+            uint16_t    port;
+            const char *client_id;      // up to MQTT_CLIENT_ID_LEN
+            const char *user;           // nullptr for none, up to MQTT_USER_LEN
+            const char *password;       // up to MQTT_PASSWORD_LEN
+            uint16_t    keepalive_s;
+            bool        clean_session;  // false keeps subscriptions and QoS 1 messages across PSM
+        };
+
+        /** One message of a publish batch
+         */
+        struct mqtt_message
+        {
+            const char *topic;          // up to MQTT_TOPIC_LEN
+            const void *payload;
+            size_t      len;            // up to MQTT_PAYLOAD_LEN
+            uint8_t     qos;            // 0 or 1
+            bool        retain;
+        };
+
+        /** Largest payload published or received, and most messages in a publish batch
+         */
+        static const size_t MQTT_PAYLOAD_LEN = 256;
+        static const size_t MQTT_TOPIC_LEN = 64;
+        static const size_t MQTT_BATCH = 16;
+
+        /** Longest connection arguments. The host is the limit of AT+QMTOPEN, the others 
+            keep AT+QMTCONN within the 256 byte command buffer of ATCmdParser
+         */
+        static const size_t MQTT_HOST_LEN = 100;
+        static const size_t MQTT_CLIENT_ID_LEN = 64;
+        static const size_t MQTT_USER_LEN = 64;
+        static const size_t MQTT_PASSWORD_LEN = 96;
+
+        /** Open the network connection and connect to the broker. Nothing is sent when the 
+            client is still connected
+            @return Q_SUCCESS if the broker accepted the connection, Q_FAILURE also if an 
+                    argument is longer than its limit
+         */
+        int mqtt_connect(const mqtt_config &config);
+
+        /** Disconnect from the broker and close the network connection
+         */
+        int mqtt_disconnect();
+
+        /** True until +QMTSTAT reports the link down or mqtt_disconnect()
+         */
+        bool mqtt_connected();
+
+        /** Subscribe to a topic
+            @param topic. Topic filter, up to MQTT_TOPIC_LEN
+            @param qos. 0 or 1
+            @return Q_SUCCESS if the broker granted it
+         */
+        int mqtt_subscribe(const char *topic, int qos);
+
+        /** Publish several messages in one wake window. All of them are handed to the module 
+            before any acknowledgement is waited for, so the round trips overlap
+            @param messages. Messages to publish
+            @param count. Number of messages, up to MQTT_BATCH
+            @return number of messages the broker acknowledged (QoS 1) or the module sent 
+                    (QoS 0), Q_FAILURE if none or if any message has no topic, a QoS above 1
+                    or a topic or payload too long
+         */
+        int mqtt_publish(const mqtt_message *messages, size_t count);
+
+        /** Handlers for incoming messages and the link state
+            @param received. Called on the work thread with the topic and payload of each 
+                   incoming message
+            @param status. Called on the URC thread with the <err_code> of +QMTSTAT when the 
+                   link goes down
+         */
+        void mqtt_attach(Callback<void(const char *, const uint8_t *, size_t)> received, 
+                         Callback<void(int)> status);
+
+        /** Non-IP data delivery: frames go to the network without IP, UDP or any other 
+            header, over a "Non-IP" PDP context. A frame is one channel byte followed by the 
+            payload, so an application can keep several kinds of messages apart. Both ways the
+            module carries them hex encoded
+         */
+        static const size_t NIDD_MTU = 256;
+
+        /** Define the Non-IP context and open the NIDD connection
+            @param apn. APN of the operator's NIDD service
+            @param cid. PDP context, 1 when the attach itself is Non-IP
+            @return Q_SUCCESS if the connection is open
+         */
+        int nidd_open(const char *apn, int cid = 1);
+
+        /** Close the NIDD connection
+         */
+        int nidd_close();
+
+        /** Send a frame
+            @param channel. First byte of the frame
+            @param data. Payload
+            @param len. Payload length, up to NIDD_MTU - 1
+            @return Q_SUCCESS if the module took the frame
+         */
+        int nidd_send(uint8_t channel, const void *data, size_t len);
+
+        /** Handler called on the work thread with the channel and payload of each downlink frame
+         */
+        void nidd_attach(Callback<void(uint8_t, const uint8_t *, size_t)> received);
+
+        /** Address of PDP context 1
+            @param ip. Receives the address
+            @param len. Size of ip
+            @return Q_SUCCESS if the context is active
+         */
+        int ip_address(char *ip, size_t len);
+
         
         /** Turn of the module.  This procedure is realized by letting the module log off from the network and allowing the software to
             enter a secure and safe data state before disconnecting the power supply
@@ -251,18 +1034,211 @@ class QUECTEL_BG77
          */
         int define_pdp_nbiot();
 
-        /** Sync date and time form the ntp server
+        /** Current UTC time as "yyyy-MM-ddThh:mm:ssZ", see get_time()
+            @return internal buffer, valid until the next call, empty if there is no time
          */
         char * sync_ntp();
 
-        /** Query location, get a fix
+        /** Where the time came from
+         */
+        enum time_source_t
+        {
+            TIME_NONE = 0,
+            TIME_NITZ,              // network time, read with AT+CCLK?
+            TIME_NTP                // AT+QNTP
+        };
+
+        /** A point in time
+         */
+        struct time_value
+        {
+            time_t          utc;
+            int16_t         tz_minutes;     // local time zone, from the network
+            time_source_t   source;         // of the last sync of the RTC
+            uint32_t        error_ms;       // bound on the error, grows with the RTC's drift
+        };
+
+        /** Largest error sync_ntp() accepts, and the length get_time_iso() needs
+         */
+        static const uint32_t TIME_MAX_ERROR_MS = 5000;
+        static const size_t ISO_TIME_LEN = 21;
+
+        /** UTC time from the MCU RTC, which is set and its drift learned each time it is
+            synced. The RTC is synced only when its error bound is over max_error_ms: from 
+            the module clock if NITZ (enable it with auto_zone_update()) makes it good 
+            enough, from NTP otherwise when PDP context 1 is active
+            @param out. Time, zone, source and error bound
+            @param max_error_ms. Error that is good enough
+            @return Q_SUCCESS if the time is within max_error_ms
+         */
+        int get_time(time_value &out, uint32_t max_error_ms = TIME_MAX_ERROR_MS);
+
+        /** get_time() as ISO 8601, "yyyy-MM-ddThh:mm:ssZ"
+            @param buffer. At least ISO_TIME_LEN bytes
+            @return Q_SUCCESS if the time is within max_error_ms
+         */
+        int get_time_iso(char *buffer, size_t len, uint32_t max_error_ms = TIME_MAX_ERROR_MS);
+
+        /** Query location, get a fix. See get_location()
+            @return Q_SUCCESS if there was a fix, lat and lon are left alone otherwise
          */
         int parse_latlon(float &lon, float &lat);
 
-        /** Enable the extra mode. Download the xtra file.
+        /** How the receiver started, from the age of the last fix
+         */
+        enum start_t
+        {
+            START_COLD = 0,         // no fix since the driver started
+            START_WARM,             // ephemeris of the last fix is out of date
+            START_HOT,              // last fix is recent
+            START_COUNT
+        };
+
+        /** What a caller needs of a fix
+         */
+        struct fix_request
+        {
+            float       max_hdop;       // stop as soon as a fix is this good
+            uint32_t    timeout_s;      // give up after, the best fix so far is kept
+            uint32_t    max_age_s;      // answer from the last fix if it is younger, 0 never
+        };
+
+        /** A fix and how it was obtained
+         */
+        struct gnss_fix
+        {
+            QUECTEL_BG77_NMEA::fix  fix;
+            start_t                 start;
+            uint32_t                ttff_ms;    // time to the first fix of the session
+            uint32_t                age_ms;     // since the fix was taken
+            bool                    cached;     // from an earlier session, GNSS stayed off
+            bool                    assisted;   // XTRA data was valid
+        };
+
+        /** Time to first fix by start kind, since the driver started
+         */
+        struct ttff_metrics
+        {
+            uint32_t    fixes[START_COUNT];
+            uint32_t    total_ms[START_COUNT];
+            uint32_t    max_ms[START_COUNT];
+            uint32_t    assisted[START_COUNT];  // of the fixes, those with valid XTRA data
+            uint32_t    assisted_ms[START_COUNT];
+            uint32_t    failures;               // sessions that timed out without a fix
+        };
+
+        /** Get a fix. A cached one younger than request.max_age_s is returned without 
+            turning GNSS on. Otherwise GNSS runs until a fix is as good as request.max_hdop
+            or the timeout, and the best fix seen is returned. With the GNSS port connected 
+            the fix comes from the NMEA stream, else AT+QGPSLOC is polled; either way the AT 
+            port is free between polls
+            @return Q_SUCCESS if there was a fix
+         */
+        int get_location(gnss_fix &out, const fix_request &request);
+
+        void get_ttff_metrics(ttff_metrics &metrics);
+
+        /** Turn GNSS on with its NMEA sentences on the GNSS port, which the driver parses
+            on the URC thread, see get_fix(). Needs the GNSS port
+            @return Indicates success or failure
+         */
+        int gnss_start();
+
+        /** Turn GNSS off
+            @return Indicates success or failure
+         */
+        int gnss_stop();
+
+        /** Last fix decoded from the GNSS port
+            @return true if there was one since gnss_start()
+         */
+        bool get_fix(QUECTEL_BG77_NMEA::fix &fix);
+
+        /** Owner of the single RF path, AT+QGPSCFG="priority". A switch drops whatever the 
+            other side was doing: an LTE transfer, or a GNSS session that has to reacquire
+         */
+        enum rf_owner_t
+        {
+            RF_WWAN = 0,
+            RF_GNSS,
+            RF_OWNERS
+        };
+
+        /** Work that needs the RF path
+         */
+        struct rf_job
+        {
+            rf_owner_t          owner;
+            uint8_t             priority;       // higher first among jobs due at the same time
+            uint32_t            deadline_ms;    // after rf_schedule(), the job should start by then
+            uint32_t            duration_ms;    // expected run time, to plan the other jobs around
+            Callback<void()>    run;            // called from rf_run(), may use the driver
+        };
+
+        /** Time each side had the RF path, since the driver started
+         */
+        struct rf_metrics
+        {
+            uint32_t    switches;
+            uint32_t    owner_ms[RF_OWNERS];
+            uint32_t    jobs;
+            uint32_t    late;                   // jobs started after their deadline
+        };
+
+        /** Queue a job for rf_run()
+            @return Q_FAILURE if the queue is full
+         */
+        int rf_schedule(const rf_job &job);
+
+        /** Run the queued jobs, jobs queued meanwhile included. The side that has the RF path 
+            keeps it while the most urgent job of the other side can still start in time, so 
+            jobs of a side run back to back with as few switches as possible. GNSS jobs wait 
+            out the active time (PSM) or paging window (eDRX) after the last LTE job when 
+            their deadline allows it, so the module stays reachable for downlink data first
+            @return Q_FAILURE if a job started late
+         */
+        int rf_run();
+
+        /** Hand the RF path to one side, nothing is sent if it has it already. Selecting 
+            RF_WWAN counts as LTE activity for the quiet period of rf_run()
+            @return Indicates success or failure
+         */
+        int rf_select(rf_owner_t owner);
+
+        void get_rf_metrics(rf_metrics &metrics);
+
+        /** Enable the extra mode. Download the xtra file if it expires within a day,
+            see xtra_refresh()
          */
         int enable_xtra();
 
+        /** XTRA assistance data held by the module
+         */
+        struct xtra_status
+        {
+            bool        enabled;        // AT+QGPSXTRA, effective from the next boot
+            time_t      injected;       // start of validity, 0 if the module has no data
+            time_t      expires;        // end of validity
+        };
+
+        /** Read XTRA state with AT+QGPSXTRA? and AT+QGPSXTRADATA?
+            @return Indicates success or failure
+         */
+        int get_xtra_status(xtra_status &xtra);
+
+        /** Keep XTRA usable: enable it, inject UTC from the RTC with AT+QGPSXTRATIME when
+            the RTC is set, and renew the data only when it expires within min_remaining_s.
+            The data is downloaded by the module, or uploaded from source when there is one,
+            e.g. a file fetched with http_download()
+            @param min_remaining_s. Renew when less validity than this is left
+            @param source. Fills up to len bytes of the buffer and returns how many, nullptr
+                           to let the module download
+            @param len. Size of the file source gives
+            @return Indicates success or failure
+         */
+        int xtra_refresh(uint32_t min_remaining_s, Callback<ssize_t(uint8_t *, size_t)> source = nullptr,
+                         size_t len = 0);
+
         /** Query
          */
         int query_satellite_system();
@@ -275,23 +1251,491 @@ class QUECTEL_BG77
          */
         void _modem_on();
     private:
+
+        /** Maximum length of a response or URC line
+         */
+        static const int LINE_LEN = 96;
+
+        /** Entries in the command timeout table, buckets of the latency histograms
+         */
+        static const int AT_COMMANDS = 64;
+        static const int LATENCY_BUCKETS = 14;
+
+        /** Final result of a command
+         */
+        enum at_result_t
+        {
+            AT_OK = 0,
+            AT_CONNECT = 1,         // CONNECT, the module waits for data
+            AT_ERROR = -1,
+            AT_CME_ERROR = -2,      // +CME ERROR: <err> or +CMS ERROR: <err>
+            AT_TIMEOUT = -3
+        };
+
+        /** Response to a command, see _match()
+         */
+        struct at_response
+        {
+            int     result;         // at_result_t
+            int     match;          // index of the pattern that matched, -1 if none did
+            int     fields;         // number of fields converted from the matched line
+            int     cme_error;      // <err> of +CME ERROR
+            char    line[LINE_LEN]; // the matched line
+        };
+
+        /** Find a command in the timeout table
+            @return index in the table, -1 if it is not there
+         */
+        int _find_command(const char *command);
+
+        /** Deadline of a command in ms, from the table or from its latency history
+         */
+        int _command_timeout(int index);
+
+        /** Add a response time to the latency history of a command
+         */
+        void _record_latency(int index, uint32_t elapsed_ms);
+
+        /** Longest line run_sequence() builds from chained steps
+         */
+        static const int SEQUENCE_LINE_LEN = 160;
+
+        /** Start a command: set its deadline and account for it
+            @param timeout_ms. Deadline, 0 for the one of the command
+            @param len. Length of the command line
+         */
+        void _begin_command(const char *command, int timeout_ms, size_t len);
+
+        /** Send a command, printf style, with the deadline of the command
+            @return true if it was written
+         */
+        bool _vsend(const char *command, va_list args);
+
+        /** Send a complete command line
+            @param timeout_ms. Deadline, 0 for the one of the command
+            @return true if it was written
+         */
+        bool _send_line(const char *line, int timeout_ms);
+
+        /** Run one step of a sequence
+            @return Indicates success or failure
+         */
+        int _run_step(const at_step &step);
+
+        /** Load the configuration shadow from KVStore and check it belongs to this module
+            and firmware with one AT+CGSN;+GMR query. Settings changed by anything but this 
+            driver go unnoticed
+         */
+        void _config_load();
+
+        /** @return true if the module is known to hold the setting written by this line
+         */
+        bool _config_cached(uint8_t item, const char *line);
+
+        /** @return true if the shadow holds any value of an item
+         */
+        bool _config_known(uint8_t item);
+
+        /** Remember that the module now holds the setting written by this line
+         */
+        void _config_applied(uint8_t item, const char *line);
+
+        /** Write the shadow back to KVStore if it changed
+         */
+        void _config_save();
+
+        /** Write a setting, printf style, unless the module already holds it
+            @return Indicates success or failure
+         */
+        int _config_command(config_t item, const char *command, ...);
+
+        /** Account for the final result of the command in flight
+         */
+        void _end_command(int result);
+
+        /** Write data after a command, e.g. a body after CONNECT
+            @return true if all of it was written
+         */
+        bool _write(const void *data, size_t len);
+
+        /** Read a byte of the response
+            @return the byte, -1 on timeout
+         */
+        int _getc();
+
+        /** Send a command, printf style, with the deadline of the command. Read the 
+            response with _match()
+            @return true if it was written
+         */
+        bool _send(const char *command, ...);
+
+        /** Send a command, printf style, and wait for its final result within its deadline
+            @return Q_SUCCESS if it was OK, else Q_FAILURE
+         */
+        int _command(const char *command, ...);
+
+        /** Read the response to a command up to its final result (OK, ERROR, +CME ERROR or
+            CONNECT) within the current timeout. Every line is read once and tested against 
+            all the patterns, so a miss costs nothing extra. A pattern matches a line that 
+            starts with its text up to the first conversion; its fields are then converted 
+            into the variable arguments, which all the patterns share. Lines that match no 
+            pattern are dispatched as URCs
+            @param resp. Filled with the final result, the matching pattern and line
+            @param patterns. scanf formats for the information response, may be nullptr
+            @param count. Number of patterns
+            @return resp.result
+         */
+        int _match(at_response &resp, const char *const *patterns = nullptr, int count = 0, ...);
+
+        /** Read the response of chained queries, each of which answers with its own line.
+            Every prefix keeps the first line that starts with it, with no conversion. Lines 
+            that match no prefix are dispatched as URCs
+            @param resp. Filled with the final result, match is the first prefix seen
+            @param prefixes. Literal start of each line
+            @param count. Number of prefixes
+            @param lines. One buffer per prefix, left empty if its line never came
+            @return resp.result
+         */
+        int _match_lines(at_response &resp, const char *const *prefixes, int count, char (*lines)[LINE_LEN]);
+
+        /** Response reader behind _match and _match_lines
+         */
+        int _vmatch(at_response &resp, const char *const *patterns, int count, char (*lines)[LINE_LEN], 
+                    va_list *args);
+
+        /** Common constructor code
+         */
+        void _init();
+
+        /** Set the parser timeout and remember it so it can be restored
+         */
+        void _set_timeout(int timeout_ms);
+
+        /** Read one line from the module, CR/LF stripped
+            @return length of the line, -1 on timeout
+         */
+        int _read_line(char *line, size_t len);
+
+        /** Hand a line to its URC handler if it starts with a known URC prefix
+            @return true if the line was an URC
+         */
+        bool _dispatch_urc(const char *line);
+
+        /** Store the payload of an URC, signal waiters and call the user handler
+            @param solicited. The line is the information response of the command in flight,
+                              e.g. +CEREG: to AT+CEREG?, that shares the prefix of an URC
+         */
+        void _handle_urc(urc_t type, const char *payload, bool solicited);
+
+        /** Read and dispatch everything pending on the UART. Lines that are not URCs are
+            stale responses and are dropped. Must be called with the lock held
+         */
+        void _process_urcs();
+
+        /** Forget an earlier occurrence of an URC. Call before sending the command that
+            triggers it
+         */
+        void _arm_urc(urc_t type);
+
+        /** Wait for an URC, reading lines until it has been dispatched. Must be called
+            with the lock held
+            @return true if the URC arrived in time, payload in _urc_payload[type]
+         */
+        bool _wait_urc(urc_t type, int timeout_ms);
+
+        /** Start a http post: send AT+QHTTPPOST, wait for CONNECT and write the header
+            @param fields. Complete header lines, e.g. "Content-Type: application/cbor", that 
+                           replace the lines of the same name in http_header
+            @param field_count. Number of fields
+            @return Q_SUCCESS once the header is written. On Q_FAILURE nothing was written and
+                    the module is in command mode: skip the body and _http_post_end()
+         */
+        int _http_post_begin(const char *http_header, size_t body_len, const char *const *fields = nullptr, 
+                             size_t field_count = 0);
+
+        /** Write http_header with fields replacing its lines of the same name, before the 
+            trailing "Content-Length: "
+            @param write. false to only measure it
+            @return length of the header as written
+         */
+        size_t _http_header(const char *http_header, const char *const *fields, size_t field_count, bool write);
+
+        /** Fetch one range of a download and hand its body to the sink
+            @param aborted. Set if the sink refused the data
+            @return Q_SUCCESS if the range was delivered, else Q_FAILURE
+         */
+        int _http_get_range(const char *http_header, Callback<int(const uint8_t *, size_t)> sink, 
+                            http_download_state &state, size_t chunk_len, bool &aborted);
+
+        /** Finish a http post: wait for +QHTTPPOST and scan the <content_length> bytes of the
+            response body, none if it is empty
+            @return Q_SUCCESS if the server answered with 2xx and the body was read, else Q_FAILURE
+         */
+        int _http_post_end(int status, http_response &response, urc_t done = URC_QHTTPPOST);
+
+        /** Read the messages +QMTRECV reported waiting and hand them to the handler, on 
+            the work thread
+         */
+        void _mqtt_deliver();
+
+        /** Read one message from a receive buffer of the module
+            @return payload length, Q_FAILURE if the buffer was empty or the read failed
+         */
+        int _mqtt_read(int buffer, char *topic, uint8_t *payload);
+
+        /** Read the downlink frames waiting in the module and hand them to the handler, on
+            the work thread
+         */
+        void _nidd_deliver();
+
+        /** Read one downlink frame
+            @return frame length, 0 if none is waiting, Q_FAILURE if the read failed
+         */
+        int _nidd_read(uint8_t *frame, size_t size);
+
+        /** Wait for the "> " prompt of a command that takes data
+            @return true if it came, false on error or timeout
+         */
+        bool _prompt();
+
+        /** Upload a file to UFS unless the config shadow says the module holds it
+            @param item. Config item of the file
+            @param name. File name on UFS
+            @return Indicates success or failure
+         */
+        int _file_upload(config_t item, const char *name, const char *data, size_t len);
+
+        /** Write to an open UFS file
+            @return Indicates success or failure
+         */
+        int _file_write(int handle, const void *data, size_t len);
+
+        /** Run the attach stage machine, on the work thread
+         */
+        void _attach_step();
+
+        /** Move the attach to a stage, closing the timing of the previous one
+         */
+        void _attach_enter(attach_state_t state);
+
+        /** Poll the current stage again after a backoff, or fail when out of tries
+         */
+        void _attach_retry();
+
+        /** End the attach and call back
+         */
+        void _attach_finish(int result);
+
+        /** Serial sigio, called from interrupt context
+         */
+        void _sigio();
+
+        /** Runs on the URC thread
+         */
+        void _urc_event();
+
+        /** Read the GNSS port from now on, without blocking
+         */
+        void _gnss_open(FileHandle *fh);
+
+        /** Bytes arrived on the GNSS port, called from interrupt context
+         */
+        void _gnss_sigio();
+
+        /** Feed what the GNSS port has to the NMEA parser, on the URC thread
+         */
+        void _gnss_event();
+
+        /** Inject UTC from the RTC into the XTRA engine
+            @return Q_FAILURE if the RTC is not set or the module refused it
+         */
+        int _xtra_inject_time();
+
+        /** Upload an XTRA file to UFS and hand it to the XTRA engine
+            @return Indicates success or failure
+         */
+        int _xtra_upload(Callback<ssize_t(uint8_t *, size_t)> source, size_t len);
+
+        /** RTC time with the learned drift taken out
+            @param error_ms. Bound on its error
+         */
+        time_t _rtc_utc(uint32_t &error_ms);
+
+        /** Set the RTC to a time from a sync and learn its drift since the last one
+         */
+        void _time_discipline(time_t utc, uint32_t error_ms, time_source_t source);
+
+        /** Index of the job rf_run() should start next, -1 if there is none
+         */
+        int _rf_next(Kernel::Clock::time_point now);
+
+        /** Current fix, from the NMEA stream or AT+QGPSLOC
+            @return true if there is one
+         */
+        bool _gnss_poll(QUECTEL_BG77_NMEA::fix &fix);
         
         /**Digital inputs*/
         DigitalOut _pwkey; 
         
         /** Uart*/
         BufferedSerial  *_serial;
+        FileHandle      *_fh;
         BufferedSerial  *_gps_serial;
+        FileHandle      *_gnss_fh;
 
         /*Parser for at commands*/
         ATCmdParser *_parser;
 
-        /*Parser for at commands*/
-        ATCmdParser *_gps_parser;
+        /*NMEA sentences of the GNSS port*/
+        QUECTEL_BG77_NMEA   _nmea;
+        volatile bool       _gnss_pending;
+        volatile bool       _nmea_reset;
+
+        /*Fix manager*/
+        gnss_fix                    _last_fix;
+        Kernel::Clock::time_point   _fix_time;
+        bool                        _fix_cached;
+        ttff_metrics                _ttff_metrics;
+        time_t                      _xtra_expires;
+
+        /*RF time sharing between GNSS and LTE*/
+        static const int RF_JOBS = 8;
+        struct rf_slot
+        {
+            rf_job                      job;
+            Kernel::Clock::time_point   deadline;
+            bool                        used;
+        };
+        rf_slot                     _rf_jobs[RF_JOBS];
+        int                         _rf_owner;          // rf_owner_t, -1 if not known
+        Kernel::Clock::time_point   _rf_since;
+        Kernel::Clock::time_point   _rf_wwan_end;
+        rf_metrics                  _rf_metrics;
+
+        /*Time service*/
+        bool                        _time_synced;
+        time_t                      _time_sync_utc;     // when the RTC was set
+        uint32_t                    _time_sync_error_ms;
+        time_source_t               _time_source;
+        int16_t                     _time_tz;
+        int32_t                     _rtc_ppm;           // learned drift, positive if fast
+        bool                        _rtc_trained;
+        volatile bool               _nitz_seen;
+        Kernel::Clock::time_point   _nitz_at;           // last NITZ
+        char                        _iso_time[ISO_TIME_LEN];
 
         /*Mutex or lock to enforce mutual exclusion*/
         Mutex _smutex;
+        int   _lock_depth;
+
+        /*Current parser timeout*/
+        int   _timeout;
+
+        /*Configuration shadow, stored in KVStore*/
+        enum
+        {
+            CONFIG_UNKNOWN,         // not loaded yet
+            CONFIG_VALID,           // loaded and matches the module
+            CONFIG_INVALID          // module could not be identified, write everything
+        }               _config_state;
+        bool            _config_dirty;
+        bool            _edrx_chosen;       // set_edrx() took, enter_psm() leaves eDRX alone
+        struct
+        {
+            uint32_t    version;
+            char        imei[16];
+            char        firmware[24];
+            uint32_t    applied[CFG_COUNT];     // hash of the command that set each item, 0 unknown
+        }               _config;
+
+        /*Non-blocking attach*/
+        volatile attach_state_t     _attach_state;
+        int                         _attach_timer;
+        int                         _attach_tries;
+        bool                        _attach_radio;      // CFUN=1 and the band took
+        char                        _attach_apn[64];
+        Callback<void(int)>         _attach_done;
+        Kernel::Clock::time_point   _attach_start;
+        Kernel::Clock::time_point   _attach_stage_start;
+        attach_metrics              _attach_metrics;
+
+        /*Command in flight and per command latency history for adaptive deadlines*/
+        int                         _cmd_index;
+        bool                        _cmd_pending;
+        char                        _cmd_name[16];      // e.g. "+CEREG", its information responses are no URCs
+        Kernel::Clock::time_point   _cmd_sent;
+        bool                        _adaptive;
+        uint8_t                     _latency_hist[AT_COMMANDS][LATENCY_BUCKETS];
+
+#if QUECTEL_BG77_STATS
+        /** Times a method from construction to destruction
+         */
+        class _span_timer
+        {
+            public:
+                _span_timer(QUECTEL_BG77 *modem, span_t span);
+                ~_span_timer();
+            private:
+                QUECTEL_BG77               *_modem;
+                span_t                      _span;
+                Kernel::Clock::time_point   _start;
+        };
+
+        /*Instrumentation, the last command slot is for commands not in the table*/
+        int             _stats_slot;
+        bool            _stats_failed;
+        command_stats   _cmd_stats[AT_COMMANDS + 1];
+        span_stats      _span_stats[SPAN_COUNT];
+#endif
+
+        /*URC handling*/
+        Thread          _urc_thread;
+        EventQueue      _urc_queue;
+
+        /*Work that runs commands on its own, e.g. the attach, kept off the URC thread so 
+          that stays free to drain the UARTs*/
+        Thread          _work_thread;
+        EventQueue      _work_queue;
+        EventFlags      _urc_flags;
+        volatile bool   _urc_pending;
+        Callback<void(const char *)> _urc_handlers[URC_COUNT];
+        char            _urc_payload[URC_COUNT][LINE_LEN];
+
+        /*Sockets, updated from their URCs*/
+        struct socket_state
+        {
+            bool                open;
+            bool                connected;
+            Callback<void()>    event;
+        };
+        socket_state    _sockets[SOCKET_COUNT];
+        bool            _sockets_ready;
+
+        /*MQTT client, updated from its URCs*/
+        volatile bool   _mqtt_connected;
+        uint16_t        _mqtt_msgid;
+        uint32_t        _mqtt_rx_pending;           // receive buffers +QMTRECV reported
+        bool            _mqtt_rx_scheduled;
+        size_t          _mqtt_acked;                // +QMTPUB of the current batch
+        size_t          _mqtt_failed;
+        uint16_t        _mqtt_first_id;
+        uint16_t        _mqtt_last_id;
+        Callback<void(const char *, const uint8_t *, size_t)> _mqtt_received;
+        Callback<void(int)> _mqtt_status;
+        char            _mqtt_topic[MQTT_TOPIC_LEN + 1];
+        uint8_t         _mqtt_payload[MQTT_PAYLOAD_LEN];
+
+        /*TLS of the http client*/
+        bool            _ssl_enabled;
+        bool            _http_keep_alive;
+        ssl_metrics     _ssl_metrics;
+
+        /*Non-IP data delivery*/
+        bool            _nidd_open;
+        bool            _nidd_scheduled;
+        Callback<void(uint8_t, const uint8_t *, size_t)> _nidd_received;
+        uint8_t         _nidd_frame[NIDD_MTU];
 
 };
 
-#endif
\ No newline at end of file
+#endif
\ No newline at end of file
@@ -0,0 +1,243 @@
+/**
+    @file       quectel_bg77_cbor.cpp
+    @version    0.0.3
+    @brief      CBOR encoder for compact uplink bodies sent through the quectel bg77
+ */
+
+
+/** Includes */
+#include "quectel_bg77_cbor.h"
+#include <cstring>
+
+
+const char *const QUECTEL_BG77_CBOR::CONTENT_TYPE = "application/cbor";
+
+/** Additional information values of the initial byte
+ */
+static const uint8_t AI_1_BYTE = 24;
+static const uint8_t AI_INDEFINITE = 31;
+static const uint8_t SIMPLE_FALSE = 20;
+static const uint8_t SIMPLE_TRUE = 21;
+static const uint8_t SIMPLE_NULL = 22;
+static const uint8_t SIMPLE_FLOAT32 = 26;
+static const uint8_t SIMPLE_FLOAT64 = 27;
+static const uint8_t BREAK = 0xFF;
+
+/** Tags of standard date/time string and epoch based date/time
+ */
+static const uint64_t TAG_DATETIME = 0;
+static const uint64_t TAG_EPOCH = 1;
+
+/** Length of YYYY-MM-DDTHH:MM:SSZ
+ */
+static const size_t ISO_LEN = 20;
+
+QUECTEL_BG77_CBOR::QUECTEL_BG77_CBOR(uint8_t *buffer, size_t size) 
+                                :_buffer(buffer), _size(size)
+{
+    reset();
+}
+
+void QUECTEL_BG77_CBOR::reset()
+{
+    _len = 0;
+    _overflow = false;
+}
+
+const uint8_t *QUECTEL_BG77_CBOR::data() const
+{
+    return _buffer;
+}
+
+size_t QUECTEL_BG77_CBOR::length() const
+{
+    return _len;
+}
+
+bool QUECTEL_BG77_CBOR::ok() const
+{
+    return !_overflow;
+}
+
+void QUECTEL_BG77_CBOR::_put(const void *bytes, size_t len)
+{
+    // Once an item is dropped nothing after it is written, the output stays a valid prefix
+    if (_overflow || len > _size - _len)
+    {
+        _overflow = true;
+        return;
+    }
+    memcpy(_buffer + _len, bytes, len);
+    _len += len;
+}
+
+void QUECTEL_BG77_CBOR::_put_be(uint64_t value, size_t len)
+{
+    uint8_t bytes[8];
+    for (size_t i = 0; i < len; i++)
+    {
+        bytes[i] = (uint8_t)(value >> (8 * (len - 1 - i)));
+    }
+    _put(bytes, len);
+}
+
+void QUECTEL_BG77_CBOR::_head(major_t major, uint64_t argument)
+{
+    // The argument takes the fewest bytes that hold it
+    uint8_t initial = major << 5;
+    size_t  len = 0;
+    if (argument < AI_1_BYTE)
+    {
+        initial |= argument;
+    }
+    else if (argument <= UINT8_MAX)
+    {
+        initial |= AI_1_BYTE;
+        len = 1;
+    }
+    else if (argument <= UINT16_MAX)
+    {
+        initial |= AI_1_BYTE + 1;
+        len = 2;
+    }
+    else if (argument <= UINT32_MAX)
+    {
+        initial |= AI_1_BYTE + 2;
+        len = 4;
+    }
+    else
+    {
+        initial |= AI_1_BYTE + 3;
+        len = 8;
+    }
+    _put(&initial, 1);
+    _put_be(argument, len);
+}
+
+void QUECTEL_BG77_CBOR::begin_map(size_t pairs)
+{
+    if (pairs == INDEFINITE)
+    {
+        uint8_t initial = MAJOR_MAP << 5 | AI_INDEFINITE;
+        _put(&initial, 1);
+        return;
+    }
+    _head(MAJOR_MAP, pairs);
+}
+
+void QUECTEL_BG77_CBOR::begin_array(size_t items)
+{
+    if (items == INDEFINITE)
+    {
+        uint8_t initial = MAJOR_ARRAY << 5 | AI_INDEFINITE;
+        _put(&initial, 1);
+        return;
+    }
+    _head(MAJOR_ARRAY, items);
+}
+
+void QUECTEL_BG77_CBOR::end()
+{
+    _put(&BREAK, 1);
+}
+
+void QUECTEL_BG77_CBOR::put_uint(uint64_t value)
+{
+    _head(MAJOR_UINT, value);
+}
+
+void QUECTEL_BG77_CBOR::put_int(int64_t value)
+{
+    if (value < 0)
+    {
+        // -1 - n, computed without overflowing on INT64_MIN
+        _head(MAJOR_NINT, (uint64_t)(-(value + 1)));
+        return;
+    }
+    _head(MAJOR_UINT, value);
+}
+
+void QUECTEL_BG77_CBOR::put_float(float value)
+{
+    uint32_t bits;
+    uint8_t initial = MAJOR_SIMPLE << 5 | SIMPLE_FLOAT32;
+    memcpy(&bits, &value, sizeof(bits));
+    _put(&initial, 1);
+    _put_be(bits, sizeof(bits));
+}
+
+void QUECTEL_BG77_CBOR::put_double(double value)
+{
+    uint64_t bits;
+    uint8_t initial = MAJOR_SIMPLE << 5 | SIMPLE_FLOAT64;
+    memcpy(&bits, &value, sizeof(bits));
+    _put(&initial, 1);
+    _put_be(bits, sizeof(bits));
+}
+
+void QUECTEL_BG77_CBOR::put_bool(bool value)
+{
+    uint8_t initial = MAJOR_SIMPLE << 5 | (value ? SIMPLE_TRUE : SIMPLE_FALSE);
+    _put(&initial, 1);
+}
+
+void QUECTEL_BG77_CBOR::put_null()
+{
+    uint8_t initial = MAJOR_SIMPLE << 5 | SIMPLE_NULL;
+    _put(&initial, 1);
+}
+
+void QUECTEL_BG77_CBOR::put_text(const char *text)
+{
+    put_text(text, strlen(text));
+}
+
+void QUECTEL_BG77_CBOR::put_text(const char *text, size_t len)
+{
+    _head(MAJOR_TEXT, len);
+    _put(text, len);
+}
+
+void QUECTEL_BG77_CBOR::put_bytes(const void *bytes, size_t len)
+{
+    _head(MAJOR_BYTES, len);
+    _put(bytes, len);
+}
+
+void QUECTEL_BG77_CBOR::put_tag(uint64_t tag)
+{
+    _head(MAJOR_TAG, tag);
+}
+
+void QUECTEL_BG77_CBOR::position(float lat, float lon)
+{
+    put_text("lat");
+    put_float(lat);
+    put_text("lon");
+    put_float(lon);
+}
+
+void QUECTEL_BG77_CBOR::timestamp(const char *iso)
+{
+    // RFC 3339 as sync_ntp() writes it, YYYY-MM-DDTHH:MM:SSZ. Anything longer is cut there
+    put_text("t");
+    put_tag(TAG_DATETIME);
+    put_text(iso, strnlen(iso, ISO_LEN));
+}
+
+void QUECTEL_BG77_CBOR::timestamp(uint32_t epoch)
+{
+    put_text("t");
+    put_tag(TAG_EPOCH);
+    put_uint(epoch);
+}
+
+void QUECTEL_BG77_CBOR::signal(int rsrp, int rsrq, int sinr)
+{
+    put_text("rsrp");
+    put_int(rsrp);
+    put_text("rsrq");
+    put_int(rsrq);
+    put_text("sinr");
+    put_int(sinr);
+}
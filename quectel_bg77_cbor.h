@@ -0,0 +1,135 @@
+/** 
+    @file    quectel_bg77_cbor.h
+    @version 0.0.3
+    @brief   CBOR encoder for compact uplink bodies sent through the quectel bg77
+ */
+
+#ifndef QUECTEL_BG77_CBOR_H
+#define QUECTEL_BG77_CBOR_H
+
+/** Define to prevent recursive inclusion
+ */
+#pragma once
+
+/** Includes 
+ */
+#include <cstddef>
+#include <cstdint>
+
+/** CBOR (RFC 8949) encoder writing into a caller provided buffer, nothing is allocated. 
+    A map of position, time and signal takes 64 bytes where the same JSON takes about 92 
+    (bench_bg77 encode_cbor, encode_json), and floats keep their precision without 
+    formatting. Once the buffer is full further items are dropped and ok() turns false, so 
+    the items can be written without checking each one.
+
+    Besides the generic items there are the telemetry fields of the driver, each a key and 
+    its value in the current map:
+        position()  "lat", "lon"    parse_latlon(), as float32
+        timestamp() "t"             sync_ntp(), as a tag 0 date/time string, or tag 1 epoch
+        signal()    "rsrp", "rsrq", "sinr"  get_signal()
+
+    Example code
+    uint8_t body[64];
+    QUECTEL_BG77_CBOR cbor(body, sizeof(body));
+    cbor.begin_map();
+    cbor.position(lat, lon);
+    cbor.timestamp(modem.sync_ntp());
+    cbor.end();
+    QUECTEL_BG77::http_fragment fragment = { cbor.data(), cbor.length() };
+    modem.http_post(header, &fragment, 1, response, QUECTEL_BG77_CBOR::CONTENT_TYPE);
+ */
+class QUECTEL_BG77_CBOR
+{
+    public:
+        /** Media type of the encoded body
+         */
+        static const char *const CONTENT_TYPE;
+
+        /** Length of a map or array whose end is marked with end()
+         */
+        static const size_t INDEFINITE = SIZE_MAX;
+
+        /** Constructor
+            @param buffer. Receives the encoded items
+            @param size. Size of buffer
+         */
+        QUECTEL_BG77_CBOR(uint8_t *buffer, size_t size);
+
+        /** Start over at the beginning of the buffer
+         */
+        void reset();
+
+        /** Encoded bytes so far
+         */
+        const uint8_t *data() const;
+        size_t length() const;
+
+        /** False if an item did not fit in the buffer
+         */
+        bool ok() const;
+
+        /** Open a map of pairs key/value pairs, or of any number closed with end()
+         */
+        void begin_map(size_t pairs = INDEFINITE);
+
+        /** Open an array of items, or of any number closed with end()
+         */
+        void begin_array(size_t items = INDEFINITE);
+
+        /** Close the innermost map or array opened with INDEFINITE
+         */
+        void end();
+
+        void put_uint(uint64_t value);
+        void put_int(int64_t value);
+        void put_float(float value);
+        void put_double(double value);
+        void put_bool(bool value);
+        void put_null();
+        void put_text(const char *text);
+        void put_text(const char *text, size_t len);
+        void put_bytes(const void *bytes, size_t len);
+        void put_tag(uint64_t tag);
+
+        /** Position fields "lat" and "lon", in degrees
+         */
+        void position(float lat, float lon);
+
+        /** Time field "t" from a date/time string such as the one of sync_ntp()
+         */
+        void timestamp(const char *iso);
+
+        /** Time field "t" from seconds since the epoch
+         */
+        void timestamp(uint32_t epoch);
+
+        /** Signal fields "rsrp", "rsrq" and "sinr"
+         */
+        void signal(int rsrp, int rsrq, int sinr);
+
+    private:
+        /** Major types, in the top 3 bits of the initial byte
+         */
+        enum major_t
+        {
+            MAJOR_UINT = 0,
+            MAJOR_NINT = 1,
+            MAJOR_BYTES = 2,
+            MAJOR_TEXT = 3,
+            MAJOR_ARRAY = 4,
+            MAJOR_MAP = 5,
+            MAJOR_TAG = 6,
+            MAJOR_SIMPLE = 7
+        };
+
+        void _head(major_t major, uint64_t argument);
+        void _put(const void *bytes, size_t len);
+        void _put_be(uint64_t value, size_t len);
+
+        uint8_t    *_buffer;
+        size_t      _size;
+        size_t      _len;
+        bool        _overflow;
+};
+
+#endif
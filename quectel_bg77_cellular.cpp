@@ -0,0 +1,312 @@
+/**
+    @file       quectel_bg77_cellular.cpp
+    @version    0.0.3
+    @brief      mbed CellularInterface and NetworkStack over the sockets of the quectel bg77
+ */
+
+
+/** Includes */
+#include "quectel_bg77_cellular.h"
+
+
+QUECTEL_BG77_CELLULAR::QUECTEL_BG77_CELLULAR(QUECTEL_BG77 &modem) 
+                                :_modem(modem), _connected(false)
+{
+    _apn[0] = '\0';
+    for (int i = 0; i < QUECTEL_BG77::SOCKET_COUNT; i++)
+    {
+        _sockets[i].in_use = false;
+    }
+}
+
+void QUECTEL_BG77_CELLULAR::set_credentials(const char *apn, const char *uname, const char *pwd)
+{
+    // The driver configures context 1 without authentication
+    if (apn != nullptr)
+    {
+        strncpy(_apn, apn, sizeof(_apn) - 1);
+        _apn[sizeof(_apn) - 1] = '\0';
+    }
+}
+
+void QUECTEL_BG77_CELLULAR::set_plmn(const char *plmn)
+{
+    // Automatic operator selection only
+}
+
+void QUECTEL_BG77_CELLULAR::set_sim_pin(const char *sim_pin)
+{
+    // SIMs without PIN only
+}
+
+nsapi_error_t QUECTEL_BG77_CELLULAR::connect(const char *sim_pin, const char *apn, const char *uname, const char *pwd)
+{
+    set_credentials(apn, uname, pwd);
+    return connect();
+}
+
+nsapi_error_t QUECTEL_BG77_CELLULAR::connect()
+{
+    _connected = (_modem.resume(_apn) == QUECTEL_BG77::Q_SUCCESS);
+    return _connected ? NSAPI_ERROR_OK : NSAPI_ERROR_NO_CONNECTION;
+}
+
+nsapi_error_t QUECTEL_BG77_CELLULAR::disconnect()
+{
+    for (int i = 0; i < QUECTEL_BG77::SOCKET_COUNT; i++)
+    {
+        if (_sockets[i].in_use && _sockets[i].id >= 0)
+        {
+            _modem.socket_close(_sockets[i].id);
+            _sockets[i].id = -1;
+        }
+    }
+    _connected = false;
+    return NSAPI_ERROR_OK;
+}
+
+bool QUECTEL_BG77_CELLULAR::is_connected()
+{
+    return _connected;
+}
+
+nsapi_error_t QUECTEL_BG77_CELLULAR::get_ip_address(SocketAddress *address)
+{
+    char ip[40];
+    if (_modem.ip_address(ip, sizeof(ip)) != QUECTEL_BG77::Q_SUCCESS || !address->set_ip_address(ip))
+    {
+        return NSAPI_ERROR_NO_ADDRESS;
+    }
+    return NSAPI_ERROR_OK;
+}
+
+nsapi_error_t QUECTEL_BG77_CELLULAR::get_netmask(SocketAddress *address)
+{
+    return NSAPI_ERROR_UNSUPPORTED;
+}
+
+nsapi_error_t QUECTEL_BG77_CELLULAR::get_gateway(SocketAddress *address)
+{
+    return NSAPI_ERROR_UNSUPPORTED;
+}
+
+nsapi_connection_status_t QUECTEL_BG77_CELLULAR::get_connection_status() const
+{
+    return _connected ? NSAPI_STATUS_GLOBAL_UP : NSAPI_STATUS_DISCONNECTED;
+}
+
+NetworkStack *QUECTEL_BG77_CELLULAR::get_stack()
+{
+    return this;
+}
+
+QUECTEL_BG77_CELLULAR::socket_t *QUECTEL_BG77_CELLULAR::_socket(nsapi_socket_t handle)
+{
+    socket_t *socket = (socket_t *) handle;
+    return (socket != nullptr && socket->in_use) ? socket : nullptr;
+}
+
+void QUECTEL_BG77_CELLULAR::_event(socket_t *socket)
+{
+    if (socket->callback)
+    {
+        socket->callback(socket->data);
+    }
+}
+
+nsapi_error_t QUECTEL_BG77_CELLULAR::socket_open(nsapi_socket_t *handle, nsapi_protocol_t proto)
+{
+    for (int i = 0; i < QUECTEL_BG77::SOCKET_COUNT; i++)
+    {
+        if (!_sockets[i].in_use)
+        {
+            _sockets[i].in_use = true;
+            _sockets[i].proto = proto;
+            _sockets[i].id = -1;
+            _sockets[i].local_port = 0;
+            _sockets[i].callback = nullptr;
+            _sockets[i].data = nullptr;
+            *handle = &_sockets[i];
+            return NSAPI_ERROR_OK;
+        }
+    }
+    return NSAPI_ERROR_NO_SOCKET;
+}
+
+nsapi_error_t QUECTEL_BG77_CELLULAR::socket_close(nsapi_socket_t handle)
+{
+    socket_t *socket = _socket(handle);
+    if (socket == nullptr)
+    {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+    if (socket->id >= 0)
+    {
+        _modem.socket_close(socket->id);
+    }
+    socket->in_use = false;
+    return NSAPI_ERROR_OK;
+}
+
+nsapi_error_t QUECTEL_BG77_CELLULAR::socket_bind(nsapi_socket_t handle, const SocketAddress &address)
+{
+    socket_t *socket = _socket(handle);
+    if (socket == nullptr)
+    {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+    if (socket->proto != NSAPI_UDP || socket->id >= 0)
+    {
+        return NSAPI_ERROR_UNSUPPORTED;
+    }
+    socket->local_port = address.get_port();
+    return _open_udp(socket);
+}
+
+nsapi_error_t QUECTEL_BG77_CELLULAR::socket_listen(nsapi_socket_t handle, int backlog)
+{
+    return NSAPI_ERROR_UNSUPPORTED;
+}
+
+nsapi_error_t QUECTEL_BG77_CELLULAR::socket_accept(nsapi_socket_t server, nsapi_socket_t *handle, SocketAddress *address)
+{
+    return NSAPI_ERROR_UNSUPPORTED;
+}
+
+nsapi_error_t QUECTEL_BG77_CELLULAR::_open_udp(socket_t *socket)
+{
+    socket->id = _modem.socket_open(QUECTEL_BG77::SOCKET_UDP, nullptr, socket->local_port);
+    if (socket->id < 0)
+    {
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    _modem.socket_attach(socket->id, mbed::Callback<void()>([this, socket]() { _event(socket); }));
+    return NSAPI_ERROR_OK;
+}
+
+nsapi_error_t QUECTEL_BG77_CELLULAR::socket_connect(nsapi_socket_t handle, const SocketAddress &address)
+{
+    socket_t *socket = _socket(handle);
+    if (socket == nullptr)
+    {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+    if (socket->id >= 0)
+    {
+        return NSAPI_ERROR_IS_CONNECTED;
+    }
+    if (socket->proto == NSAPI_UDP)
+    {
+        // UDP sockets stay unconnected on the module, sends carry the address
+        return _open_udp(socket);
+    }
+    socket->id = _modem.socket_open(QUECTEL_BG77::SOCKET_TCP, address.get_ip_address(), address.get_port());
+    if (socket->id < 0)
+    {
+        return NSAPI_ERROR_NO_CONNECTION;
+    }
+    _modem.socket_attach(socket->id, mbed::Callback<void()>([this, socket]() { _event(socket); }));
+    return NSAPI_ERROR_OK;
+}
+
+nsapi_size_or_error_t QUECTEL_BG77_CELLULAR::socket_send(nsapi_socket_t handle, const void *data, nsapi_size_t size)
+{
+    socket_t *socket = _socket(handle);
+    if (socket == nullptr)
+    {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+    if (socket->id < 0 || socket->proto != NSAPI_TCP)
+    {
+        return NSAPI_ERROR_NO_CONNECTION;
+    }
+    // A stream may be sent in part, the caller sends the rest
+    if (size > QUECTEL_BG77::SOCKET_MTU)
+    {
+        size = QUECTEL_BG77::SOCKET_MTU;
+    }
+    if (_modem.socket_send(socket->id, data, size) != QUECTEL_BG77::Q_SUCCESS)
+    {
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    return size;
+}
+
+nsapi_size_or_error_t QUECTEL_BG77_CELLULAR::socket_recv(nsapi_socket_t handle, void *data, nsapi_size_t size)
+{
+    return socket_recvfrom(handle, nullptr, data, size);
+}
+
+nsapi_size_or_error_t QUECTEL_BG77_CELLULAR::socket_sendto(nsapi_socket_t handle, const SocketAddress &address, 
+                                                           const void *data, nsapi_size_t size)
+{
+    socket_t *socket = _socket(handle);
+    if (socket == nullptr)
+    {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+    if (socket->proto == NSAPI_TCP)
+    {
+        return socket_send(handle, data, size);
+    }
+    if (size > QUECTEL_BG77::SOCKET_MTU)
+    {
+        return NSAPI_ERROR_PARAMETER;
+    }
+    if (socket->id < 0 && _open_udp(socket) != NSAPI_ERROR_OK)
+    {
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    if (_modem.socket_send(socket->id, data, size, address.get_ip_address(), address.get_port()) 
+        != QUECTEL_BG77::Q_SUCCESS)
+    {
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    return size;
+}
+
+nsapi_size_or_error_t QUECTEL_BG77_CELLULAR::socket_recvfrom(nsapi_socket_t handle, SocketAddress *address, 
+                                                             void *data, nsapi_size_t size)
+{
+    char     host[16];
+    uint16_t port = 0;
+    socket_t *socket = _socket(handle);
+    if (socket == nullptr)
+    {
+        return NSAPI_ERROR_NO_SOCKET;
+    }
+    if (socket->id < 0)
+    {
+        return NSAPI_ERROR_NO_CONNECTION;
+    }
+    int got = _modem.socket_recv(socket->id, data, size, host, &port);
+    if (got < 0)
+    {
+        return NSAPI_ERROR_DEVICE_ERROR;
+    }
+    if (got == 0)
+    {
+        // A TCP socket the peer closed reads as end of stream once it is drained
+        if (socket->proto == NSAPI_TCP && !_modem.socket_connected(socket->id))
+        {
+            return 0;
+        }
+        return NSAPI_ERROR_WOULD_BLOCK;
+    }
+    if (address != nullptr && socket->proto == NSAPI_UDP)
+    {
+        address->set_ip_address(host);
+        address->set_port(port);
+    }
+    return got;
+}
+
+void QUECTEL_BG77_CELLULAR::socket_attach(nsapi_socket_t handle, void (*callback)(void *), void *data)
+{
+    socket_t *socket = _socket(handle);
+    if (socket != nullptr)
+    {
+        socket->callback = callback;
+        socket->data = data;
+    }
+}
@@ -0,0 +1,100 @@
+/** 
+    @file    quectel_bg77_cellular.h
+    @version 0.0.3
+    @brief   mbed CellularInterface and NetworkStack over the sockets of the quectel bg77
+ */
+
+#ifndef QUECTEL_BG77_CELLULAR_H
+#define QUECTEL_BG77_CELLULAR_H
+
+/** Define to prevent recursive inclusion
+ */
+#pragma once
+
+/** Includes 
+ */
+#include <mbed.h>
+#include "quectel_bg77.h"
+
+/** Lets mbed's TCPSocket, UDPSocket and the libraries built on them use the module's own 
+    TCP/IP stack through QUECTEL_BG77::socket_open() and friends. connect() brings the 
+    module up with QUECTEL_BG77::resume(), which skips the startup when the registration 
+    and the PDP context survived PSM.
+
+    Example code
+    QUECTEL_BG77 modem(PA_9, PA_10, PB_5);
+    QUECTEL_BG77_CELLULAR cellular(modem);
+    cellular.set_credentials("iot.apn");
+    cellular.connect();
+    UDPSocket socket;
+    socket.open(&cellular);
+    socket.sendto(SocketAddress("203.0.113.1", 5683), payload, len);
+ */
+class QUECTEL_BG77_CELLULAR : public CellularInterface, public NetworkStack
+{
+    public:
+        /** Constructor
+            @param modem. Driver of the module, powered on
+         */
+        QUECTEL_BG77_CELLULAR(QUECTEL_BG77 &modem);
+
+        /** CellularInterface
+         */
+        void set_credentials(const char *apn, const char *uname = 0, const char *pwd = 0);
+        void set_plmn(const char *plmn);
+        void set_sim_pin(const char *sim_pin);
+        nsapi_error_t connect(const char *sim_pin, const char *apn = 0, const char *uname = 0, const char *pwd = 0);
+        nsapi_error_t connect();
+        nsapi_error_t disconnect();
+        bool is_connected();
+        nsapi_error_t get_ip_address(SocketAddress *address);
+        nsapi_error_t get_netmask(SocketAddress *address);
+        nsapi_error_t get_gateway(SocketAddress *address);
+        nsapi_connection_status_t get_connection_status() const;
+
+    protected:
+        /** NetworkInterface
+         */
+        NetworkStack *get_stack();
+
+        /** NetworkStack
+         */
+        nsapi_error_t socket_open(nsapi_socket_t *handle, nsapi_protocol_t proto);
+        nsapi_error_t socket_close(nsapi_socket_t handle);
+        nsapi_error_t socket_bind(nsapi_socket_t handle, const SocketAddress &address);
+        nsapi_error_t socket_listen(nsapi_socket_t handle, int backlog);
+        nsapi_error_t socket_connect(nsapi_socket_t handle, const SocketAddress &address);
+        nsapi_error_t socket_accept(nsapi_socket_t server, nsapi_socket_t *handle, SocketAddress *address = 0);
+        nsapi_size_or_error_t socket_send(nsapi_socket_t handle, const void *data, nsapi_size_t size);
+        nsapi_size_or_error_t socket_recv(nsapi_socket_t handle, void *data, nsapi_size_t size);
+        nsapi_size_or_error_t socket_sendto(nsapi_socket_t handle, const SocketAddress &address, 
+                                            const void *data, nsapi_size_t size);
+        nsapi_size_or_error_t socket_recvfrom(nsapi_socket_t handle, SocketAddress *address, 
+                                              void *data, nsapi_size_t size);
+        void socket_attach(nsapi_socket_t handle, void (*callback)(void *), void *data);
+
+    private:
+        /** mbed socket, the module's socket is opened on connect, or bind or first sendto 
+            for UDP
+         */
+        struct socket_t
+        {
+            bool                in_use;
+            nsapi_protocol_t    proto;
+            int                 id;             // connectID, -1 until opened on the module
+            uint16_t            local_port;
+            void              (*callback)(void *);
+            void               *data;
+        };
+
+        socket_t *_socket(nsapi_socket_t handle);
+        nsapi_error_t _open_udp(socket_t *socket);
+        void _event(socket_t *socket);
+
+        QUECTEL_BG77   &_modem;
+        socket_t        _sockets[QUECTEL_BG77::SOCKET_COUNT];
+        char            _apn[64];
+        bool            _connected;
+};
+
+#endif
@@ -0,0 +1,308 @@
+/**
+    @file       quectel_bg77_json.cpp
+    @version    0.0.3
+    @brief      Incremental JSON scanner for responses read from the quectel bg77
+ */
+
+
+/** Includes */
+#include "quectel_bg77_json.h"
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+
+QUECTEL_BG77_JSON::QUECTEL_BG77_JSON(field *fields, size_t count) 
+                                :_fields(fields), _count(count)
+{
+    reset();
+}
+
+void QUECTEL_BG77_JSON::reset()
+{
+    _state = ST_PRE;
+    _depth = 0;
+    _path_len = 0;
+    _path[0] = '\0';
+    _path_overflow = false;
+    _match = nullptr;
+    _value_len = 0;
+    for (size_t i = 0; i < _count; i++)
+    {
+        _fields[i].found = false;
+    }
+}
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+int QUECTEL_BG77_JSON::feed(char c)
+{
+    switch (_state)
+    {
+        case ST_PRE:
+            if (c == '{' || c == '[')
+            {
+                return _open(c);
+            }
+            return JSON_MORE;
+
+        case ST_KEY_OR_END:
+            if (c == '"')
+            {
+                // Remember where the parent path ends so the key can be dropped after its value
+                _key_start[_depth - 1] = _path_len;
+                if (_path_len > 0 && !_path_overflow)
+                {
+                    if (_path_len + 1 < PATH_LEN)
+                    {
+                        _path[_path_len++] = '.';
+                    }
+                    else
+                    {
+                        _overflow();
+                    }
+                }
+                _state = ST_KEY;
+            }
+            else if (c == '}')
+            {
+                return _close(c);
+            }
+            else if (!is_space(c))
+            {
+                _state = ST_ERROR;
+            }
+            break;
+
+        case ST_KEY:
+        case ST_KEY_ESC:
+            if (_state == ST_KEY && c == '\\')
+            {
+                _state = ST_KEY_ESC;
+                break;
+            }
+            if (_state == ST_KEY && c == '"')
+            {
+                _path[_path_len] = '\0';
+                _state = ST_COLON;
+                break;
+            }
+            if (_path_len + 1 < PATH_LEN)
+            {
+                _path[_path_len++] = c;
+            }
+            else
+            {
+                _overflow();
+            }
+            _state = ST_KEY;
+            break;
+
+        case ST_COLON:
+            if (c == ':')
+            {
+                _state = ST_VALUE;
+            }
+            else if (!is_space(c))
+            {
+                _state = ST_ERROR;
+            }
+            break;
+
+        case ST_VALUE:
+            if (is_space(c))
+            {
+                break;
+            }
+            if (c == '{' || c == '[')
+            {
+                return _open(c);
+            }
+            if (c == ']' && _stack[_depth - 1] == '[')
+            {
+                return _close(c);
+            }
+            if (c == ',' || c == '}' || c == ']' || c == ':')
+            {
+                _state = ST_ERROR;
+                break;
+            }
+            _value_start();
+            if (c == '"')
+            {
+                if (_match && _match->type != JSON_STRING)
+                {
+                    _match = nullptr;
+                }
+                _state = ST_STRING;
+            }
+            else
+            {
+                _state = ST_LITERAL;
+                _literal[_value_len++] = c;
+            }
+            break;
+
+        case ST_STRING:
+        case ST_STRING_ESC:
+            if (_state == ST_STRING && c == '\\')
+            {
+                _state = ST_STRING_ESC;
+                break;
+            }
+            if (_state == ST_STRING && c == '"')
+            {
+                _value_end();
+                break;
+            }
+            if (_match && _match->type == JSON_STRING && _value_len + 1 < _match->len)
+            {
+                static_cast<char *>(_match->value)[_value_len++] = c;
+            }
+            _state = ST_STRING;
+            break;
+
+        case ST_LITERAL:
+            if (isalnum((unsigned char) c) || c == '.' || c == '-' || c == '+')
+            {
+                if (_value_len + 1 < LITERAL_LEN)
+                {
+                    _literal[_value_len++] = c;
+                }
+                break;
+            }
+            _store_literal();
+            _value_end();
+            // This byte ends the literal and belongs to the container
+            return feed(c);
+
+        case ST_AFTER_VALUE:
+            if (c == ',')
+            {
+                _state = (_stack[_depth - 1] == '{') ? ST_KEY_OR_END : ST_VALUE;
+            }
+            else if (c == '}' || c == ']')
+            {
+                return _close(c);
+            }
+            else if (!is_space(c))
+            {
+                _state = ST_ERROR;
+            }
+            break;
+
+        case ST_DONE:
+            return JSON_DONE;
+
+        case ST_ERROR:
+            return JSON_ERROR;
+    }
+    return (_state == ST_ERROR) ? JSON_ERROR : JSON_MORE;
+}
+
+int QUECTEL_BG77_JSON::_open(char c)
+{
+    if (_depth >= MAX_DEPTH)
+    {
+        _state = ST_ERROR;
+        return JSON_ERROR;
+    }
+    _stack[_depth++] = c;
+    _state = (c == '{') ? ST_KEY_OR_END : ST_VALUE;
+    return JSON_MORE;
+}
+
+int QUECTEL_BG77_JSON::_close(char c)
+{
+    if (_depth == 0 || (c == '}') != (_stack[_depth - 1] == '{'))
+    {
+        _state = ST_ERROR;
+        return JSON_ERROR;
+    }
+    _depth--;
+    if (_depth == 0)
+    {
+        _state = ST_DONE;
+        return JSON_DONE;
+    }
+    // The container was the value of its parent's key or array slot
+    _value_end();
+    return JSON_MORE;
+}
+
+void QUECTEL_BG77_JSON::_overflow()
+{
+    // Keys under a path that did not fit can never match
+    if (!_path_overflow)
+    {
+        _path_overflow = true;
+        _overflow_depth = _depth;
+    }
+}
+
+void QUECTEL_BG77_JSON::_value_start()
+{
+    _match = nullptr;
+    _value_len = 0;
+    if (_path_overflow)
+    {
+        return;
+    }
+    _path[_path_len] = '\0';
+    for (size_t i = 0; i < _count; i++)
+    {
+        if (!_fields[i].found && strcmp(_fields[i].path, _path) == 0)
+        {
+            _match = &_fields[i];
+            break;
+        }
+    }
+}
+
+void QUECTEL_BG77_JSON::_store_literal()
+{
+    _literal[_value_len] = '\0';
+    if (!_match)
+    {
+        return;
+    }
+    if (_match->type == JSON_BOOL)
+    {
+        *static_cast<bool *>(_match->value) = (strcmp(_literal, "true") == 0);
+    }
+    else if (_match->type == JSON_INT)
+    {
+        *static_cast<int *>(_match->value) = strtol(_literal, nullptr, 10);
+    }
+    else
+    {
+        // A literal where a string was expected
+        _match = nullptr;
+    }
+}
+
+void QUECTEL_BG77_JSON::_value_end()
+{
+    if (_match)
+    {
+        if (_match->type == JSON_STRING && _match->len > 0)
+        {
+            static_cast<char *>(_match->value)[_value_len] = '\0';
+        }
+        _match->found = true;
+        _match = nullptr;
+    }
+    if (_stack[_depth - 1] == '{')
+    {
+        _path_len = _key_start[_depth - 1];
+        if (_path_overflow && _depth <= _overflow_depth)
+        {
+            _path_overflow = false;
+        }
+        _path[_path_len] = '\0';
+    }
+    _state = ST_AFTER_VALUE;
+}
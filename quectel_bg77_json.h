@@ -0,0 +1,125 @@
+/** 
+    @file    quectel_bg77_json.h
+    @version 0.0.3
+    @brief   Incremental JSON scanner for responses read from the quectel bg77
+ */
+
+#ifndef QUECTEL_BG77_JSON_H
+#define QUECTEL_BG77_JSON_H
+
+/** Define to prevent recursive inclusion
+ */
+#pragma once
+
+/** Includes 
+ */
+#include <cstddef>
+#include <cstdint>
+
+/** Byte at a time JSON scanner. Values are matched against caller registered key paths 
+    and written straight into the caller's storage, so memory use is fixed no matter how
+    long the document is or how its keys are ordered. 
+
+    Paths are object keys joined with '.', arrays are transparent: in
+    {"info":[{"src":{"asset_id":"x"},"isSafe":true}]} the paths are "info.src.asset_id"
+    and "info.isSafe". The first occurrence of a path wins.
+
+    Example code
+    QUECTEL_BG77_JSON::field fields[] = {
+        { "info.isSafe", QUECTEL_BG77_JSON::JSON_BOOL, &is_safe, sizeof(is_safe) },
+    };
+    QUECTEL_BG77_JSON json(fields, 1);
+    while (json.feed(getc()) == QUECTEL_BG77_JSON::JSON_MORE);
+ */
+class QUECTEL_BG77_JSON
+{
+    public:
+        enum
+        {
+            JSON_MORE = 0,
+            JSON_DONE = 1,
+            JSON_ERROR = -1
+        };
+
+        enum field_type
+        {
+            JSON_BOOL,          // value points to a bool
+            JSON_INT,           // value points to an int
+            JSON_STRING         // value points to a char buffer of len bytes, always terminated
+        };
+
+        /** A key path to extract
+         */
+        struct field
+        {
+            const char *path;
+            field_type  type;
+            void       *value;
+            size_t      len;
+            bool        found;
+        };
+
+        /** Constructor
+            @param fields. Key paths to extract, found flags are cleared
+            @param count. Number of fields
+         */
+        QUECTEL_BG77_JSON(field *fields, size_t count);
+
+        /** Start over with a new document, clearing the found flags
+         */
+        void reset();
+
+        /** Feed the next byte. Anything before the first '{' or '[' is skipped, so http 
+            response headers can be fed too
+            @return JSON_MORE until the root value is closed, then JSON_DONE. JSON_ERROR if 
+                    the document is malformed or nested too deep
+         */
+        int feed(char c);
+
+    private:
+        static const int MAX_DEPTH = 8;
+        static const int PATH_LEN = 48;
+        static const int LITERAL_LEN = 16;
+
+        enum state_t
+        {
+            ST_PRE,             // before the root value
+            ST_KEY_OR_END,      // in an object, expecting a key or '}'
+            ST_KEY,             // in a key
+            ST_KEY_ESC,
+            ST_COLON,           
+            ST_VALUE,           // expecting a value (or ']' in an empty array)
+            ST_STRING,          // in a string value
+            ST_STRING_ESC,
+            ST_LITERAL,         // in a number, true, false or null
+            ST_AFTER_VALUE,     // expecting ',' or the end of the container
+            ST_DONE,
+            ST_ERROR
+        };
+
+        int  _open(char c);
+        int  _close(char c);
+        void _overflow();
+        void _value_start();
+        void _value_end();
+        void _store_literal();
+
+        field      *_fields;
+        size_t      _count;
+
+        state_t     _state;
+        int         _depth;
+        char        _stack[MAX_DEPTH];
+        uint8_t     _key_start[MAX_DEPTH];
+
+        char        _path[PATH_LEN];
+        size_t      _path_len;
+        bool        _path_overflow;
+        int         _overflow_depth;
+
+        field      *_match;
+        size_t      _value_len;
+        char        _literal[LITERAL_LEN];
+};
+
+#endif
@@ -0,0 +1,141 @@
+/**
+    @file       quectel_bg77_lzss.cpp
+    @version    0.0.3
+    @brief      Streaming LZSS compressor for bulk uploads through the quectel bg77
+ */
+
+
+/** Includes */
+#include "quectel_bg77_lzss.h"
+
+
+const char *const QUECTEL_BG77_LZSS::CONTENT_ENCODING = "heatshrink";
+
+/** Shortest back reference worth its 13 bits, two literals take 18
+ */
+static const size_t MIN_MATCH = 2;
+
+/** Output bytes one token can complete, a back reference is 13 bits
+ */
+static const size_t TOKEN_BYTES = 2;
+
+QUECTEL_BG77_LZSS::QUECTEL_BG77_LZSS()
+{
+    reset();
+}
+
+void QUECTEL_BG77_LZSS::reset()
+{
+    _pos = 0;
+    _end = 0;
+    _out_len = 0;
+    _out_total = 0;
+    _byte = 0;
+    _bit_count = 0;
+    _flushed = false;
+}
+
+void QUECTEL_BG77_LZSS::_bits(uint32_t value, int count)
+{
+    while (count-- > 0)
+    {
+        _byte = _byte << 1 | ((value >> count) & 1);
+        if (++_bit_count == 8)
+        {
+            _out[_out_len++] = _byte;
+            _out_total++;
+            _byte = 0;
+            _bit_count = 0;
+        }
+    }
+}
+
+void QUECTEL_BG77_LZSS::_encode()
+{
+    // Longest match in the window, the nearest one on a tie as it is found first
+    size_t avail = (_end - _pos < LOOKAHEAD) ? _end - _pos : LOOKAHEAD;
+    size_t history = (_pos < WINDOW) ? _pos : WINDOW;
+    size_t best_len = 0;
+    size_t best_dist = 0;
+    for (size_t dist = 1; dist <= history && best_len < avail; dist++)
+    {
+        size_t len = 0;
+        while (len < avail && _ring[(_pos - dist + len) & (RING - 1)] == _ring[(_pos + len) & (RING - 1)])
+        {
+            len++;
+        }
+        if (len > best_len)
+        {
+            best_len = len;
+            best_dist = dist;
+        }
+    }
+
+    if (best_len >= MIN_MATCH)
+    {
+        _bits(0, 1);
+        _bits(best_dist - 1, WINDOW_BITS);
+        _bits(best_len - 1, LOOKAHEAD_BITS);
+        _pos += best_len;
+    }
+    else
+    {
+        _bits(1, 1);
+        _bits(_ring[_pos & (RING - 1)], 8);
+        _pos++;
+    }
+}
+
+bool QUECTEL_BG77_LZSS::put(uint8_t c)
+{
+    // The ring keeps the window behind _pos and the lookahead after it
+    _ring[_end & (RING - 1)] = c;
+    _end++;
+    if (_end - _pos >= LOOKAHEAD)
+    {
+        _encode();
+    }
+    return _out_len + TOKEN_BYTES > OUTPUT_LEN;
+}
+
+bool QUECTEL_BG77_LZSS::finish()
+{
+    while (_pos != _end && _out_len + TOKEN_BYTES <= OUTPUT_LEN)
+    {
+        _encode();
+    }
+    if (_pos == _end && !_flushed && _out_len < OUTPUT_LEN)
+    {
+        if (_bit_count > 0)
+        {
+            _bits(0, 8 - _bit_count);
+        }
+        _flushed = true;
+    }
+    return _out_len > 0;
+}
+
+const uint8_t *QUECTEL_BG77_LZSS::output() const
+{
+    return _out;
+}
+
+size_t QUECTEL_BG77_LZSS::output_len() const
+{
+    return _out_len;
+}
+
+void QUECTEL_BG77_LZSS::drain()
+{
+    _out_len = 0;
+}
+
+uint32_t QUECTEL_BG77_LZSS::bytes_in() const
+{
+    return _end;
+}
+
+uint32_t QUECTEL_BG77_LZSS::bytes_out() const
+{
+    return _out_total;
+}
@@ -0,0 +1,107 @@
+/** 
+    @file    quectel_bg77_lzss.h
+    @version 0.0.3
+    @brief   Streaming LZSS compressor for bulk uploads through the quectel bg77
+ */
+
+#ifndef QUECTEL_BG77_LZSS_H
+#define QUECTEL_BG77_LZSS_H
+
+/** Define to prevent recursive inclusion
+ */
+#pragma once
+
+/** Includes 
+ */
+#include <cstddef>
+#include <cstdint>
+
+/** LZSS compressor producing the heatshrink bit stream with a 2^8 byte window and a 2^4 
+    byte lookahead (heatshrink -w 8 -l 4), so the server can decode it with stock heatshrink.
+    Each token is a 1 followed by a literal byte, or a 0 followed by 8 bits of distance - 1 
+    and 4 bits of length - 1. The last byte is padded with 0 bits.
+
+    State is fixed at under 700 bytes, the input is not kept beyond the window. Input goes in a
+    byte at a time, output comes out in blocks of at most OUTPUT_LEN bytes.
+
+    Example code
+    QUECTEL_BG77_LZSS lz;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (lz.put(data[i]))
+        {
+            write(lz.output(), lz.output_len());
+            lz.drain();
+        }
+    }
+    while (lz.finish())
+    {
+        write(lz.output(), lz.output_len());
+        lz.drain();
+    }
+ */
+class QUECTEL_BG77_LZSS
+{
+    public:
+        /** Value of the Content-Encoding header of the compressed body
+         */
+        static const char *const CONTENT_ENCODING;
+
+        static const int WINDOW_BITS = 8;
+        static const int LOOKAHEAD_BITS = 4;
+        static const size_t OUTPUT_LEN = 128;
+
+        /** Constructor
+         */
+        QUECTEL_BG77_LZSS();
+
+        /** Start a new stream
+         */
+        void reset();
+
+        /** Compress the next input byte. Drain the output before the next call when it
+            returns true
+            @return true if the output block is full
+         */
+        bool put(uint8_t c);
+
+        /** Compress what is left of the input and close the stream. Drain the output and 
+            call again while it returns true
+            @return true if there is output to drain
+         */
+        bool finish();
+
+        /** Compressed output not drained yet
+         */
+        const uint8_t *output() const;
+        size_t output_len() const;
+
+        /** Mark the output as taken
+         */
+        void drain();
+
+        /** Input and output byte counts of the stream so far
+         */
+        uint32_t bytes_in() const;
+        uint32_t bytes_out() const;
+
+    private:
+        static const size_t WINDOW = 1 << WINDOW_BITS;
+        static const size_t LOOKAHEAD = 1 << LOOKAHEAD_BITS;
+        static const size_t RING = 512;     // power of 2, at least WINDOW + LOOKAHEAD
+
+        void _encode();
+        void _bits(uint32_t value, int count);
+
+        uint8_t     _ring[RING];
+        uint32_t    _pos;               // next input byte to encode
+        uint32_t    _end;               // input bytes received
+        uint8_t     _out[OUTPUT_LEN];
+        size_t      _out_len;
+        uint32_t    _out_total;
+        uint8_t     _byte;              // output byte being filled
+        int         _bit_count;
+        bool        _flushed;
+};
+
+#endif
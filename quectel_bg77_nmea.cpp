@@ -0,0 +1,301 @@
+/**
+    @file       quectel_bg77_nmea.cpp
+    @version    0.0.3
+    @brief      Incremental NMEA 0183 parser for the GNSS port of the quectel bg77
+ */
+
+
+/** Includes */
+#include "quectel_bg77_nmea.h"
+#include <cstdlib>
+#include <cstring>
+
+
+QUECTEL_BG77_NMEA::QUECTEL_BG77_NMEA()
+{
+    reset();
+}
+
+void QUECTEL_BG77_NMEA::reset()
+{
+    _state = ST_IDLE;
+    _len = 0;
+    _seen = 0;
+    memset(&_work, 0, sizeof(_work));
+    memset(_fixes, 0, sizeof(_fixes));
+    memset(&_counters, 0, sizeof(_counters));
+    core_util_atomic_store_u32(&_published, 0);
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if (c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    if (c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+bool QUECTEL_BG77_NMEA::feed(char c)
+{
+    // '$' starts a sentence wherever it comes, a broken one is dropped
+    if (c == '$')
+    {
+        _state = ST_BODY;
+        _len = 0;
+        _sum = 0;
+        return false;
+    }
+    int digit;
+    switch (_state)
+    {
+        case ST_IDLE:
+            break;
+
+        case ST_BODY:
+            if (c == '*')
+            {
+                _state = ST_SUM_HIGH;
+            }
+            else if (c == '\r' || c == '\n' || _len + 1 >= SENTENCE_LEN)
+            {
+                _counters.overruns += (c != '\r' && c != '\n');
+                _state = ST_IDLE;
+            }
+            else
+            {
+                _sum ^= (uint8_t) c;
+                _sentence[_len++] = c;
+            }
+            break;
+
+        case ST_SUM_HIGH:
+        case ST_SUM_LOW:
+            if ((digit = hex_value(c)) < 0)
+            {
+                _counters.checksum_errors++;
+                _state = ST_IDLE;
+                break;
+            }
+            if (_state == ST_SUM_HIGH)
+            {
+                _expected = digit << 4;
+                _state = ST_SUM_LOW;
+                break;
+            }
+            _state = ST_IDLE;
+            if ((_expected | digit) != _sum)
+            {
+                _counters.checksum_errors++;
+                break;
+            }
+            _sentence[_len] = '\0';
+            _counters.sentences++;
+            uint32_t published = _published;
+            _decode();
+            return _published != published;
+    }
+    return false;
+}
+
+bool QUECTEL_BG77_NMEA::get(fix &out) const
+{
+    uint32_t before;
+    do
+    {
+        before = core_util_atomic_load_u32(&_published);
+        if (before == 0)
+        {
+            return false;
+        }
+        out = _fixes[before & 1];
+    } while (core_util_atomic_load_u32(&_published) != before);
+    return true;
+}
+
+void QUECTEL_BG77_NMEA::get_counters(counters &out) const
+{
+    out = _counters;
+}
+
+/** hhmmss.sss to milliseconds of the day
+ */
+static uint32_t parse_time(const char *s)
+{
+    if (strlen(s) < 6)
+    {
+        return 0;
+    }
+    uint32_t hms = strtoul(s, nullptr, 10);
+    const char *dot = strchr(s, '.');
+    uint32_t ms = dot ? (uint32_t)(strtof(dot, nullptr) * 1000.0f + 0.5f) : 0;
+    return ((hms / 10000) * 3600 + (hms / 100 % 100) * 60 + hms % 100) * 1000 + ms;
+}
+
+/** (d)ddmm.mmmm and hemisphere to degrees
+ */
+static float parse_coordinate(const char *s, const char *hemisphere)
+{
+    if (*s == '\0')
+    {
+        return 0.0f;
+    }
+    float value = strtof(s, nullptr);
+    int degrees = (int)(value / 100.0f);
+    float result = degrees + (value - degrees * 100.0f) / 60.0f;
+    return (*hemisphere == 'S' || *hemisphere == 'W') ? -result : result;
+}
+
+void QUECTEL_BG77_NMEA::_decode()
+{
+    // Split in place, empty fields stay as empty strings
+    char *f[MAX_FIELDS];
+    int n = 0;
+    char *p = _sentence;
+    f[n++] = p;
+    while (*p && n < MAX_FIELDS)
+    {
+        if (*p == ',')
+        {
+            *p = '\0';
+            f[n++] = p + 1;
+        }
+        p++;
+    }
+
+    // Address is the talker and the sentence type, e.g. GNRMC
+    if (strlen(f[0]) != 5)
+    {
+        return;
+    }
+    const char *type = f[0] + 2;
+    if (strcmp(type, "GGA") == 0)
+    {
+        _gga(f, n);
+    }
+    else if (strcmp(type, "RMC") == 0)
+    {
+        _rmc(f, n);
+    }
+    else if (strcmp(type, "GSA") == 0)
+    {
+        _gsa(f, n);
+    }
+    else if (strcmp(type, "GSV") == 0)
+    {
+        _gsv(f, n);
+    }
+    else if (strcmp(type, "VTG") == 0)
+    {
+        _vtg(f, n);
+    }
+}
+
+void QUECTEL_BG77_NMEA::_gga(char **f, int n)
+{
+    // $GPGGA,time,lat,N,lon,E,quality,satellites,hdop,altitude,M,...
+    if (n < 10)
+    {
+        return;
+    }
+    _epoch(parse_time(f[1]), SEEN_GGA);
+    _work.quality = atoi(f[6]);
+    _work.satellites = atoi(f[7]);
+    _work.hdop = strtof(f[8], nullptr);
+    _work.altitude = strtof(f[9], nullptr);
+    if (_work.quality > 0)
+    {
+        _work.latitude = parse_coordinate(f[2], f[3]);
+        _work.longitude = parse_coordinate(f[4], f[5]);
+    }
+    if (_seen == (SEEN_GGA | SEEN_RMC))
+    {
+        _publish();
+    }
+}
+
+void QUECTEL_BG77_NMEA::_rmc(char **f, int n)
+{
+    // $GPRMC,time,status,lat,N,lon,E,knots,course,date,...
+    if (n < 10)
+    {
+        return;
+    }
+    _epoch(parse_time(f[1]), SEEN_RMC);
+    _work.valid = (f[2][0] == 'A');
+    if (_work.valid)
+    {
+        _work.latitude = parse_coordinate(f[3], f[4]);
+        _work.longitude = parse_coordinate(f[5], f[6]);
+        _work.speed_kmh = strtof(f[7], nullptr) * 1.852f;
+        _work.course = strtof(f[8], nullptr);
+    }
+    _work.date = strtoul(f[9], nullptr, 10);
+    if (_seen == (SEEN_GGA | SEEN_RMC))
+    {
+        _publish();
+    }
+}
+
+void QUECTEL_BG77_NMEA::_gsa(char **f, int n)
+{
+    // $GPGSA,mode,fix type,12 satellite ids,pdop,hdop,vdop
+    if (n < 18)
+    {
+        return;
+    }
+    _work.fix_type = atoi(f[2]);
+    _work.pdop = strtof(f[15], nullptr);
+    _work.hdop = strtof(f[16], nullptr);
+    _work.vdop = strtof(f[17], nullptr);
+}
+
+void QUECTEL_BG77_NMEA::_gsv(char **f, int n)
+{
+    // $GPGSV,messages,message number,in view,...
+    if (n < 4)
+    {
+        return;
+    }
+    _work.in_view = atoi(f[3]);
+}
+
+void QUECTEL_BG77_NMEA::_vtg(char **f, int n)
+{
+    // $GPVTG,course,T,magnetic,M,knots,N,km/h,K,...
+    if (n < 9 || f[1][0] == '\0')
+    {
+        return;
+    }
+    _work.course = strtof(f[1], nullptr);
+    _work.speed_kmh = strtof(f[7], nullptr);
+}
+
+void QUECTEL_BG77_NMEA::_epoch(uint32_t time_ms, uint8_t seen)
+{
+    // A new time starts a new epoch, what is missing from the last one is not waited for
+    if (time_ms != _work.time_ms)
+    {
+        _work.time_ms = time_ms;
+        _seen = 0;
+    }
+    _seen |= seen;
+}
+
+void QUECTEL_BG77_NMEA::_publish()
+{
+    uint32_t published = _published + 1;
+    _work.sequence = published;
+    _fixes[published & 1] = _work;
+    core_util_atomic_store_u32(&_published, published);
+    // Once per epoch, GSA and VTG after it update the next one
+    _seen = 0;
+}
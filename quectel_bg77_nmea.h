@@ -0,0 +1,137 @@
+/**
+    @file    quectel_bg77_nmea.h
+    @version 0.0.3
+    @brief   Incremental NMEA 0183 parser for the GNSS port of the quectel bg77
+ */
+
+#ifndef QUECTEL_BG77_NMEA_H
+#define QUECTEL_BG77_NMEA_H
+
+/** Define to prevent recursive inclusion
+ */
+#pragma once
+
+/** Includes
+ */
+#include <mbed.h>
+#include <cstddef>
+#include <cstdint>
+
+/** Byte at a time NMEA 0183 parser. The checksum is computed as the sentence arrives and
+    only sentences that pass it are decoded. GGA, RMC, GSA, GSV and VTG from any talker
+    (GP, GL, GA, GB, GN) update a working fix, which is published once the GGA and RMC of
+    the same epoch are in, so at the receiver's rate, 1 Hz by default.
+
+    Published fixes are double buffered: feed() runs on one thread, get() may be called
+    from any other and always returns a complete fix, never half of two. Nothing is
+    allocated, a sentence is decoded in place in an 83 byte buffer.
+
+    Example code
+    QUECTEL_BG77_NMEA nmea;
+    while (serial.read(&c, 1) == 1)
+    {
+        nmea.feed(c);
+    }
+    QUECTEL_BG77_NMEA::fix fix;
+    if (nmea.get(fix) && fix.valid) ...
+ */
+class QUECTEL_BG77_NMEA
+{
+    public:
+        /** Position and quality of one epoch
+         */
+        struct fix
+        {
+            bool        valid;          // RMC status A
+            uint8_t     quality;        // GGA: 0 none, 1 GPS, 2 DGPS, 6 dead reckoning
+            uint8_t     fix_type;       // GSA: 1 none, 2 2D, 3 3D
+            uint8_t     satellites;     // GGA: used in the fix
+            uint8_t     in_view;        // GSV: in view, of the last constellation reported
+            uint32_t    time_ms;        // UTC time of day
+            uint32_t    date;           // ddmmyy, 0 until RMC had one
+            float       latitude;       // degrees, north positive
+            float       longitude;      // degrees, east positive
+            float       altitude;       // metres above mean sea level
+            float       hdop;
+            float       pdop;
+            float       vdop;
+            float       speed_kmh;
+            float       course;         // degrees from true north
+            uint32_t    sequence;       // count of published fixes
+        };
+
+        /** Sentence counters
+         */
+        struct counters
+        {
+            uint32_t    sentences;      // decoded
+            uint32_t    checksum_errors;
+            uint32_t    overruns;       // longer than 82 characters
+        };
+
+        QUECTEL_BG77_NMEA();
+
+        /** Forget the working and published fixes and the counters
+         */
+        void reset();
+
+        /** Feed the next byte from the GNSS port. Call from one thread only
+            @return true if a fix was published by this byte
+         */
+        bool feed(char c);
+
+        /** Copy the last published fix. Safe from any thread
+            @return true if a fix was ever published
+         */
+        bool get(fix &out) const;
+
+        void get_counters(counters &out) const;
+
+    private:
+        static const int SENTENCE_LEN = 83;
+        static const int MAX_FIELDS = 21;
+
+        enum state_t
+        {
+            ST_IDLE,            // waiting for '$'
+            ST_BODY,            // between '$' and '*', checksummed
+            ST_SUM_HIGH,        // first hex digit of the checksum
+            ST_SUM_LOW
+        };
+
+        /** Sentences that make up an epoch
+         */
+        enum
+        {
+            SEEN_GGA = 1,
+            SEEN_RMC = 2
+        };
+
+        void _decode();
+        void _gga(char **f, int n);
+        void _rmc(char **f, int n);
+        void _gsa(char **f, int n);
+        void _gsv(char **f, int n);
+        void _vtg(char **f, int n);
+        void _epoch(uint32_t time_ms, uint8_t seen);
+        void _publish();
+
+        state_t     _state;
+        char        _sentence[SENTENCE_LEN];
+        size_t      _len;
+        uint8_t     _sum;
+        uint8_t     _expected;
+
+        fix         _work;
+        uint8_t     _seen;
+
+        /** Published fixes, _fixes[_published & 1] is the current one. Readers copy and
+            start over if _published moved meanwhile
+         */
+        fix                 _fixes[2];
+        volatile uint32_t   _published;
+
+        counters    _counters;
+};
+
+#endif
@@ -0,0 +1,203 @@
+/**
+    @file       quectel_bg77_queue.cpp
+    @version    0.0.3
+    @brief      Persistent store-and-forward queue of telemetry records for the quectel bg77
+ */
+
+
+/** Includes */
+#include "quectel_bg77_queue.h"
+#include "kvstore_global_api.h"
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+
+QUECTEL_BG77_QUEUE::QUECTEL_BG77_QUEUE(const char *name, size_t capacity, const thresholds &flush_at)
+                                :_capacity(capacity), _flush_at(flush_at), _held(false)
+{
+    strncpy(_name, name, NAME_LEN);
+    _name[NAME_LEN] = '\0';
+
+    size_t actual = 0;
+    snprintf(_header_key, KEY_LEN, "/kv/%s_q", _name);
+    if (kv_get(_header_key, &_header, sizeof(_header), &actual) != MBED_SUCCESS 
+        || actual != sizeof(_header) || _header.version != QUEUE_VERSION)
+    {
+        memset(&_header, 0, sizeof(_header));
+        _header.version = QUEUE_VERSION;
+    }
+}
+
+void QUECTEL_BG77_QUEUE::_key(char *key, uint32_t seq)
+{
+    snprintf(key, KEY_LEN, "/kv/%s_%lx", _name, (unsigned long)seq);
+}
+
+int QUECTEL_BG77_QUEUE::_save()
+{
+    return (kv_set(_header_key, &_header, sizeof(_header), 0) == MBED_SUCCESS) ? QUEUE_SUCCESS : QUEUE_FAILURE;
+}
+
+void QUECTEL_BG77_QUEUE::_drop_one()
+{
+    char key[KEY_LEN];
+    kv_info_t info;
+    _key(key, _header.head);
+    if (kv_get_info(key, &info) == MBED_SUCCESS && info.size >= sizeof(record_t))
+    {
+        size_t len = info.size - sizeof(record_t);
+        _header.bytes = (_header.bytes > len) ? _header.bytes - len : 0;
+    }
+    kv_remove(key);
+    _header.head = (_header.head + 1);
+}
+
+void QUECTEL_BG77_QUEUE::_find_oldest()
+{
+    record_t prefix;
+    char key[KEY_LEN];
+    size_t actual = 0;
+
+    // The age threshold follows the new oldest record
+    _key(key, _header.head);
+    if (count() > 0 && kv_get(key, &prefix, sizeof(prefix), &actual) == MBED_SUCCESS)
+    {
+        _header.oldest = prefix.time;
+    }
+}
+
+int QUECTEL_BG77_QUEUE::push(const void *record, size_t len, priority_t priority)
+{
+    uint8_t entry[sizeof(record_t) + RECORD_MAX];
+    record_t prefix;
+    char key[KEY_LEN];
+
+    if (len > RECORD_MAX || _capacity == 0)
+    {
+        return QUEUE_FAILURE;
+    }
+    prefix.time = (uint32_t)time(nullptr);
+    prefix.priority = priority;
+    memcpy(entry, &prefix, sizeof(prefix));
+    memcpy(entry + sizeof(prefix), record, len);
+
+    _mutex.lock();
+    if (count() >= _capacity)
+    {
+        if (_held)
+        {
+            _mutex.unlock();
+            return QUEUE_FAILURE;
+        }
+        _drop_one();
+        _find_oldest();
+    }
+    _key(key, _header.tail);
+    if (kv_set(key, entry, sizeof(prefix) + len, 0) != MBED_SUCCESS)
+    {
+        _mutex.unlock();
+        return QUEUE_FAILURE;
+    }
+    if (_header.head == _header.tail)
+    {
+        _header.oldest = prefix.time;
+    }
+    _header.tail = (_header.tail + 1);
+    _header.bytes += len;
+    if (priority == PRIORITY_URGENT)
+    {
+        _header.urgent_until = _header.tail;
+    }
+    int status = _save();
+    _mutex.unlock();
+    return status;
+}
+
+size_t QUECTEL_BG77_QUEUE::count()
+{
+    // Unsigned, so it holds when the sequence numbers wrap
+    return _header.tail - _header.head;
+}
+
+size_t QUECTEL_BG77_QUEUE::bytes()
+{
+    return _header.bytes;
+}
+
+bool QUECTEL_BG77_QUEUE::flush_due()
+{
+    _mutex.lock();
+    size_t records = count();
+    // Urgent while the last urgent record is between head and tail
+    bool urgent = _header.urgent_until - _header.head - 1 < records;
+    bool due = records > 0 && (urgent
+               || (_flush_at.records && records >= _flush_at.records)
+               || (_flush_at.bytes && _header.bytes >= _flush_at.bytes)
+               || (_flush_at.age_s && (uint32_t)time(nullptr) - _header.oldest >= _flush_at.age_s));
+    _mutex.unlock();
+    return due;
+}
+
+int QUECTEL_BG77_QUEUE::peek(size_t index, void *buffer, size_t size, size_t &len)
+{
+    uint8_t entry[sizeof(record_t) + RECORD_MAX];
+    char key[KEY_LEN];
+    size_t actual = 0;
+    int status = QUEUE_FAILURE;
+
+    len = 0;
+    _mutex.lock();
+    if (index < count())
+    {
+        _key(key, (_header.head + index));
+        if (kv_get(key, entry, sizeof(entry), &actual) == MBED_SUCCESS 
+            && actual >= sizeof(record_t) && actual - sizeof(record_t) <= size)
+        {
+            len = actual - sizeof(record_t);
+            memcpy(buffer, entry + sizeof(record_t), len);
+            status = QUEUE_SUCCESS;
+        }
+    }
+    _mutex.unlock();
+    return status;
+}
+
+size_t QUECTEL_BG77_QUEUE::length(size_t index)
+{
+    char key[KEY_LEN];
+    kv_info_t info;
+    size_t len = 0;
+
+    _mutex.lock();
+    if (index < count())
+    {
+        _key(key, (_header.head + index));
+        if (kv_get_info(key, &info) == MBED_SUCCESS && info.size >= sizeof(record_t))
+        {
+            len = info.size - sizeof(record_t);
+        }
+    }
+    _mutex.unlock();
+    return len;
+}
+
+int QUECTEL_BG77_QUEUE::drop(size_t records)
+{
+    _mutex.lock();
+    for (size_t i = 0; i < records && count() > 0; i++)
+    {
+        _drop_one();
+    }
+    _find_oldest();
+    int status = _save();
+    _mutex.unlock();
+    return status;
+}
+
+void QUECTEL_BG77_QUEUE::hold(bool held)
+{
+    _mutex.lock();
+    _held = held;
+    _mutex.unlock();
+}
@@ -0,0 +1,161 @@
+/** 
+    @file    quectel_bg77_queue.h
+    @version 0.0.3
+    @brief   Persistent store-and-forward queue of telemetry records for the quectel bg77
+ */
+
+#ifndef QUECTEL_BG77_QUEUE_H
+#define QUECTEL_BG77_QUEUE_H
+
+/** Define to prevent recursive inclusion
+ */
+#pragma once
+
+/** Includes 
+ */
+#include <mbed.h>
+#include <cstddef>
+#include <cstdint>
+
+/** Ring buffer of records kept in KVStore, so it survives resets and PSM cycles. Readings
+    are pushed as they are taken and sent together in one POST when enough of them, old 
+    enough ones or an urgent one are waiting, see QUECTEL_BG77::flush_queue(). Records are 
+    only dropped once the server acknowledged them. When the queue is full the oldest 
+    record is overwritten, unless a flush holds the queue.
+
+    Every record is its own KVStore key, so a push or an acknowledgement writes the record
+    and the small queue header only, never the whole queue. The record is written before the
+    header, a reset in between leaves an orphan record that the next push overwrites.
+
+    Example code
+    QUECTEL_BG77_QUEUE::thresholds flush_at = { 512, 16, 3600 };
+    QUECTEL_BG77_QUEUE queue("tlm", 64, flush_at);
+    queue.push(reading, len);
+    if (queue.flush_due())
+    {
+        modem.flush_queue(queue, http_header);
+    }
+ */
+class QUECTEL_BG77_QUEUE
+{
+    public:
+        enum
+        {
+            QUEUE_SUCCESS = 0,
+            QUEUE_FAILURE = -1
+        };
+
+        enum priority_t
+        {
+            PRIORITY_NORMAL = 0,
+            PRIORITY_URGENT = 1         // makes the queue due for a flush at once
+        };
+
+        /** Largest record
+         */
+        static const size_t RECORD_MAX = 256;
+
+        /** When the queue is due for a flush, a threshold of 0 is not checked
+         */
+        struct thresholds
+        {
+            size_t      bytes;          // queued payload bytes
+            size_t      records;        // queued records
+            uint32_t    age_s;          // age of the oldest record
+        };
+
+        /** Constructor. Picks up the queue left in KVStore under the same name
+            @param name. Short name of the queue, up to 8 characters, used in its KVStore keys
+            @param capacity. Most records kept
+            @param flush_at. Thresholds of flush_due()
+         */
+        QUECTEL_BG77_QUEUE(const char *name, size_t capacity, const thresholds &flush_at);
+
+        /** Append a record
+            @param record. Payload, up to RECORD_MAX bytes
+            @param len. Payload length
+            @param priority. PRIORITY_URGENT asks for a flush as soon as possible
+            @return QUEUE_SUCCESS or QUEUE_FAILURE, also if the queue is full and held
+         */
+        int push(const void *record, size_t len, priority_t priority = PRIORITY_NORMAL);
+
+        /** Number of records waiting
+         */
+        size_t count();
+
+        /** Payload bytes waiting
+         */
+        size_t bytes();
+
+        /** True if a threshold is reached or an urgent record is waiting
+         */
+        bool flush_due();
+
+        /** Read a record without removing it
+            @param index. 0 is the oldest record
+            @param buffer. Receives the payload
+            @param size. Size of buffer
+            @param len. Receives the payload length
+            @return QUEUE_SUCCESS or QUEUE_FAILURE
+         */
+        int peek(size_t index, void *buffer, size_t size, size_t &len);
+
+        /** Payload length of a record
+            @param index. 0 is the oldest record
+            @return length, 0 if there is no such record
+         */
+        size_t length(size_t index);
+
+        /** Remove the oldest records, once the server acknowledged them
+            @param records. Number of records to remove
+            @return QUEUE_SUCCESS or QUEUE_FAILURE
+         */
+        int drop(size_t records);
+
+        /** Keep the records in place while a flush is sending them: when held, a push to a 
+            full queue fails instead of overwriting the oldest record, so the drop() that
+            follows the acknowledgement removes exactly the records that were sent
+            @param held. true from the first peek() until drop(), false after
+         */
+        void hold(bool held);
+
+    private:
+        static const uint32_t QUEUE_VERSION = 1;
+        static const size_t NAME_LEN = 8;
+        static const size_t KEY_LEN = 24;
+
+        /** Queue header, kept under its own key
+         */
+        struct header_t
+        {
+            uint32_t    version;
+            uint32_t    head;           // sequence number of the oldest record
+            uint32_t    tail;           // sequence number of the next record
+            uint32_t    bytes;          // payload bytes of the records between head and tail
+            uint32_t    urgent_until;   // sequence number after the last urgent record
+            uint32_t    oldest;         // time the oldest record was pushed
+        };
+
+        /** Record prefix, the payload follows
+         */
+        struct record_t
+        {
+            uint32_t    time;           // time the record was pushed
+            uint32_t    priority;
+        };
+
+        void _key(char *key, uint32_t seq);
+        int  _save();
+        void _drop_one();
+        void _find_oldest();
+
+        char        _name[NAME_LEN + 1];
+        char        _header_key[KEY_LEN];
+        size_t      _capacity;
+        thresholds  _flush_at;
+        header_t    _header;
+        bool        _held;
+        Mutex       _mutex;
+};
+
+#endif